@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# dir_scaling.sh - mede o tempo de criar (e depois remover) N entradas num
+# nico directrio, para N = 25000, 50000 e 100000; com inseres e remoes
+# de custo constante o tempo por entrada deve manter-se aproximadamente igual
+#
+# utilizao: bench/dir_scaling.sh [VFS]   (por omisso ./vfs)
+
+VFS=${1:-./vfs}
+TMP=${TMPDIR:-/tmp}/vfs_dir_scaling.$$
+
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+: > $TMP/empty
+
+now() {
+  date +%s.%N
+}
+
+printf "%-8s %-10s %-12s %-10s %-12s\n" entries create_s create_us rm_s rm_us
+for n in 25000 50000 100000; do
+  rm -f $TMP/img
+  awk -v n=$n -v f=$TMP/empty 'BEGIN { for (i = 0; i < n; i++) printf "get %s f%06d\n", f, i }' > $TMP/create
+  awk -v n=$n 'BEGIN { for (i = 0; i < n; i++) printf "rm f%06d\n", i }' > $TMP/remove
+
+  # formata a imagem antes de medir
+  echo pwd | $VFS -b1024 -f12 $TMP/img > /dev/null
+
+  t0=$(now)
+  $VFS $TMP/img < $TMP/create > /dev/null
+  t1=$(now)
+  $VFS $TMP/img < $TMP/remove > /dev/null
+  t2=$(now)
+
+  awk -v n=$n -v t0=$t0 -v t1=$t1 -v t2=$t2 'BEGIN {
+    printf "%-8d %-10.3f %-12.2f %-10.3f %-12.2f\n", n, t1 - t0, (t1 - t0) * 1e6 / n, t2 - t1, (t2 - t1) * 1e6 / n
+  }'
+done
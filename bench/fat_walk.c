@@ -0,0 +1,104 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   fat_walk: dbito de percorrer cadeias na FAT antiga (um   //
+//   int por entrada) e na FAT compactada (acedida com fat_get) //
+//                                                             //
+// compilao: gcc -O2 bench/fat_walk.c -Wall -o bench/fat_walk
+// utilizao: bench/fat_walk [HOPS]                            //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#include "../libvfs.c"
+
+vfs_t image;           // contexto sem imagem: s a FAT  usada
+vfs_t *fs = &image;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// liga os blocos 1..n-1 num ciclo pela ordem de order, nas duas FATs
+void link_chain(int *old_fat, int *order, int n) {
+  int i;
+
+  for (i = 0; i < n - 1; i++)
+  {
+    old_fat[order[i]] = order[(i + 1) % (n - 1)];
+    fat_set(fs, order[i], order[(i + 1) % (n - 1)]);
+  }
+  return;
+}
+
+// percorre hops ligaes na FAT antiga e devolve o tempo por ligao (ns)
+double walk_old(int *old_fat, int start, long hops, long *sink) {
+  int block = start;
+  long i;
+  double t0 = now();
+
+  for (i = 0; i < hops; i++)
+    block = old_fat[block];
+  *sink += block;
+  return (now() - t0) * 1e9 / hops;
+}
+
+// percorre hops ligaes na FAT compactada e devolve o tempo por ligao (ns)
+double walk_packed(int start, long hops, long *sink) {
+  int block = start;
+  long i;
+  double t0 = now();
+
+  for (i = 0; i < hops; i++)
+    block = fat_get(fs, block);
+  *sink += block;
+  return (now() - t0) * 1e9 / hops;
+}
+
+int main(int argc, char *argv[]) {
+  int types[] = {8, 10, 12, 16, 32}, t, i;
+  long hops = argc > 1 ? atol(argv[1]) : 50000000, sink = 0;
+  superblock fake_sb;
+
+  srand(1);
+  fs->sb = &fake_sb;
+  printf("%-6s %-10s %-12s %-14s %-14s\n", "fat", "layout", "fat_bytes", "seq_ns/hop", "rand_ns/hop");
+  for (t = 0; t < 5; t++)
+  {
+    int n = FAT_ENTRIES(types[t]);
+    int *order = (int *) malloc((n - 1) * sizeof(int));
+    int *old_fat = (int *) malloc(OLD_FAT_SIZE(types[t]));
+    double old_seq, old_rand, packed_seq, packed_rand;
+
+    fs->sb->fat_type = types[t];
+    fs->fat_bits = FAT_BITS(types[t]);
+    fs->fat = (unsigned char *) calloc(1, FAT_SIZE(types[t]));
+
+    // cadeia sequencial (ficheiros contguos)
+    for (i = 0; i < n - 1; i++)
+      order[i] = i + 1;
+    link_chain(old_fat, order, n);
+    old_seq = walk_old(old_fat, 1, hops, &sink);
+    packed_seq = walk_packed(1, hops, &sink);
+
+    // cadeia dispersa por toda a FAT
+    for (i = n - 2; i > 0; i--)
+    {
+      int j = rand() % (i + 1), tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+    link_chain(old_fat, order, n);
+    old_rand = walk_old(old_fat, order[0], hops, &sink);
+    packed_rand = walk_packed(order[0], hops, &sink);
+
+    printf("%-6d %-10s %-12lu %-14.2f %-14.2f\n", types[t], "int", OLD_FAT_SIZE(types[t]), old_seq, old_rand);
+    printf("%-6d %-10s %-12lu %-14.2f %-14.2f\n", types[t], "packed", FAT_SIZE(types[t]), packed_seq, packed_rand);
+
+    free(order);
+    free(old_fat);
+    free(fs->fat);
+  }
+
+  return sink == 42;
+}
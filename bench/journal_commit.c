@@ -0,0 +1,113 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   journal_commit: dbito das operaes de metadados com     //
+//   diferentes janelas de confirmao dos grupos do dirio    //
+//                                                             //
+// compilao: gcc -O2 bench/journal_commit.c libvfs.c -Wall -o bench/journal_commit
+// utilizao: bench/journal_commit [IMAGEM] [SEGUNDOS]        //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../libvfs.h"
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// depois de cada operao: se j no h grupo aberto, a operao confirmou o seu
+void count_group(vfs_t *fs, long long *groups) {
+  if (fs_commit_pending(fs) == -1)
+    (*groups)++;
+  return;
+}
+
+// cada iterao cria e escreve um ficheiro, copia-o, muda o nome  cpia e remove os dois, e cria e
+// remove um directrio (8 operaes que alteram metadados); corre durante seconds segundos e devolve
+// o nmero de operaes, e em groups o nmero de grupos confirmados
+long long run(vfs_t *fs, double seconds, long long *groups) {
+  char data[1000], name[MAX_NAME_LENGHT], copy[MAX_NAME_LENGHT], moved[MAX_NAME_LENGHT];
+  long long ops = 0;
+  int error, i;
+
+  memset(data, 'j', sizeof(data));
+  *groups = 0;
+  double end = now() + seconds;
+  for (i = 0; now() < end; i++)
+  {
+    sprintf(name, "f%d", i % 64);
+    sprintf(copy, "c%d", i % 64);
+    sprintf(moved, "m%d", i % 64);
+
+    vfs_file *file = fs_open(fs, name, VFS_WRITE | VFS_CREATE | VFS_TRUNC, &error);
+    count_group(fs, groups);
+    fs_write(file, data, sizeof(data));
+    count_group(fs, groups);
+    fs_close(file);
+    fs_copy(fs, name, copy);
+    count_group(fs, groups);
+    fs_rename(fs, copy, moved);
+    count_group(fs, groups);
+    fs_unlink(fs, moved);
+    count_group(fs, groups);
+    fs_unlink(fs, name);
+    count_group(fs, groups);
+    fs_mkdir(fs, name);
+    count_group(fs, groups);
+    fs_rmdir(fs, name);
+    count_group(fs, groups);
+    ops += 8;
+  }
+  fs_sync(fs);
+
+  return ops;
+}
+
+int main(int argc, char *argv[]) {
+  char *image_name = argc > 1 ? argv[1] : "/tmp/journal_commit.img";
+  double seconds = argc > 2 ? atof(argv[2]) : 2;
+  long long windows[] = {-1, 0, 100, 1000, 10000, 100000}, groups;
+  int n_windows = sizeof(windows) / sizeof(windows[0]), error, i;
+  double base = 0;
+  vfs_t *fs;
+
+  printf("%-10s %-12s %-10s %-12s %-8s\n", "window", "ops/s", "groups/s", "ops/group", "relative");
+  for (i = 0; i < n_windows; i++)
+  {
+    // cada medio comea numa imagem nova
+    unlink(image_name);
+    if (fs_format(image_name, 512, 16) != 0 || (fs = fs_mount(image_name, &error)) == NULL)
+    {
+      fprintf(stderr, "journal_commit: cannot create %s\n", image_name);
+      return 1;
+    }
+    fs_set_commit_window(fs, windows[i]);
+
+    double t0 = now();
+    long long ops = run(fs, seconds, &groups);
+    double elapsed = now() - t0;
+    fs_unmount(fs);
+
+    char label[32];
+    if (windows[i] < 0)
+      strcpy(label, "no journal");
+    else
+      sprintf(label, "%lldus", windows[i]);
+    if (i == 1)
+      base = ops / elapsed;
+    if (windows[i] < 0)
+      printf("%-10s %-12.0f %-10s %-12s %-8s\n", label, ops / elapsed, "-", "-", "-");
+    else
+      printf("%-10s %-12.0f %-10.0f %-12.1f %-8.2f\n", label, ops / elapsed, groups / elapsed,
+             groups ? (double) ops / groups : 0, ops / elapsed / base);
+  }
+
+  unlink(image_name);
+  return 0;
+}
@@ -0,0 +1,103 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   mmap_hints: dbito e faltas de pgina da escrita, leitura //
+//   e exportao de ficheiros grandes, com e sem as dicas     //
+//   madvise (e com pginas grandes, se o kernel as der)       //
+//                                                             //
+// compilao: gcc -O2 bench/mmap_hints.c libvfs.c -Wall -o bench/mmap_hints
+// utilizao: bench/mmap_hints [IMAGEM] [MB]                  //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../libvfs.h"
+
+#define CHUNK (1 << 16)
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// escreve a linha de uma medio: dbito e contadores desde before
+void report(char *mode, char *op, long long bytes, double elapsed, vfs_t *fs, vm_stats *before) {
+  vm_stats after;
+  char tlb[32];
+
+  fs_vm_stats(fs, &after);
+  if (after.tlb_misses == -1)
+    strcpy(tlb, "-");
+  else
+    sprintf(tlb, "%lld", after.tlb_misses - before->tlb_misses);
+  printf("%-12s %-8s %-10.0f %-12lld %-12lld %-14s\n", mode, op, bytes / elapsed / 1e6,
+         after.minor_faults - before->minor_faults, after.major_faults - before->major_faults, tlb);
+  *before = after;
+  return;
+}
+
+int main(int argc, char *argv[]) {
+  char *image_name = argc > 1 ? argv[1] : "/tmp/mmap_hints.img";
+  long long size = (argc > 2 ? atoll(argv[2]) : 48) << 20, done;
+  char *modes[] = {"no hints", "hints", "hints+huge"}, name[16];
+  char *buf = (char *) malloc(CHUNK);
+  int null = open("/dev/null", O_WRONLY), error, m;
+  vm_stats stats;
+  vfs_t *fs;
+
+  memset(buf, 'h', CHUNK);
+  unlink(image_name);
+  // FAT16 com blocos de 1024 bytes: uma imagem de 64MB
+  if (fs_format(image_name, 1024, 16) != 0)
+  {
+    fprintf(stderr, "mmap_hints: cannot create %s\n", image_name);
+    return 1;
+  }
+
+  printf("%-12s %-8s %-10s %-12s %-12s %-14s\n", "mode", "op", "MB/s", "faults", "disk faults", "TLB misses");
+  for (m = 0; m < 3; m++)
+  {
+    // cada modo monta a imagem de novo, para comear sem nenhuma pgina mapeada
+    if ((fs = fs_mount(image_name, &error)) == NULL)
+      return 1;
+    fs_set_commit_window(fs, -1);
+    fs_set_hints(fs, m > 0);
+    if (m == 2 && fs_set_hugepages(fs, 1) != 0)
+    {
+      printf("%-12s (huge pages not available)\n", modes[m]);
+      fs_unmount(fs);
+      break;
+    }
+    sprintf(name, "f%d", m);
+
+    // cada modo escreve um ficheiro novo, l-o atravs do mapeamento e exporta-o
+    fs_vm_stats(fs, &stats);
+    vfs_file *file = fs_open(fs, name, VFS_WRITE | VFS_CREATE | VFS_TRUNC, &error);
+    double t0 = now();
+    for (done = 0; done < size; done += CHUNK)
+      fs_write(file, buf, CHUNK);
+    report(modes[m], "write", size, now() - t0, fs, &stats);
+    fs_close(file);
+
+    file = fs_open(fs, name, VFS_READ, &error);
+    t0 = now();
+    while (fs_read(file, buf, CHUNK) > 0);
+    report(modes[m], "read", size, now() - t0, fs, &stats);
+    fs_close(file);
+
+    t0 = now();
+    fs_export(fs, name, null);
+    report(modes[m], "export", size, now() - t0, fs, &stats);
+
+    fs_unlink(fs, name);
+    fs_unmount(fs);
+  }
+
+  unlink(image_name);
+  return 0;
+}
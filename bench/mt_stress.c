@@ -0,0 +1,158 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   mt_stress: dbito de vrias threads sobre a mesma imagem, //
+//   cada uma com o seu contexto (fs_mount), em directrios    //
+//   prprios ou todas no mesmo directrio                     //
+//                                                             //
+// compilao: gcc -O2 bench/mt_stress.c libvfs.c -Wall -lpthread -o bench/mt_stress
+// utilizao: bench/mt_stress [IMAGEM] [OPS] [MAX_THREADS]    //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../libvfs.h"
+
+typedef struct worker {
+  pthread_t thread;
+  int id;
+  int shared;   // 1 se todas as threads trabalham no mesmo directrio
+  int errors;   // operaes que falharam
+} worker;
+
+char *image_name;
+int n_ops;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// cada iterao cria e escreve um ficheiro, l-o, copia-o, muda o nome  cpia e remove os dois
+// (6 operaes da biblioteca); de 16 em 16 iteraes lista tambm o directrio
+void *run_worker(void *arg) {
+  worker *w = (worker *) arg;
+  char data[1000], buf[1000], name[MAX_NAME_LENGHT], copy[MAX_NAME_LENGHT], moved[MAX_NAME_LENGHT];
+  int error, i;
+  vfs_t *fs = fs_mount(image_name, &error);
+
+  if (fs == NULL)
+  {
+    w->errors = n_ops;
+    return NULL;
+  }
+
+  memset(data, 'a' + w->id % 26, sizeof(data));
+  sprintf(name, "t%d", w->id);
+  if (!w->shared)
+  {
+    fs_mkdir(fs, name);
+    fs_chdir(fs, name);
+  }
+  else
+    fs_chdir(fs, "shared");
+
+  for (i = 0; i < n_ops; i++)
+  {
+    sprintf(name, "f%d_%d", w->id, i % 64);
+    sprintf(copy, "c%d_%d", w->id, i % 64);
+    sprintf(moved, "m%d_%d", w->id, i % 64);
+
+    vfs_file *file = fs_open(fs, name, VFS_WRITE | VFS_CREATE | VFS_TRUNC, &error);
+    if (file == NULL || fs_write(file, data, sizeof(data)) != sizeof(data))
+      w->errors++;
+    if (file != NULL)
+      fs_close(file);
+
+    file = fs_open(fs, name, VFS_READ, &error);
+    if (file == NULL || fs_read(file, buf, sizeof(buf)) != sizeof(buf) || memcmp(buf, data, sizeof(buf)) != 0)
+      w->errors++;
+    if (file != NULL)
+      fs_close(file);
+
+    w->errors += fs_copy(fs, name, copy) != 0;
+    w->errors += fs_rename(fs, copy, moved) != 0;
+    w->errors += fs_unlink(fs, moved) != 0;
+    w->errors += fs_unlink(fs, name) != 0;
+
+    if (i % 16 == 0)
+    {
+      dir_entry entry;
+      vfs_dir *dir = fs_opendir(fs, NULL, &error);
+      if (dir == NULL)
+        w->errors++;
+      else
+      {
+        while (fs_readdir(dir, &entry));
+        fs_closedir(dir);
+      }
+    }
+  }
+
+  fs_unmount(fs);
+  return NULL;
+}
+
+// corre n_threads threads e devolve o dbito total (operaes por segundo)
+double run(int n_threads, int shared, int *errors) {
+  worker *workers = (worker *) calloc(n_threads, sizeof(worker));
+  int i;
+
+  double t0 = now();
+  for (i = 0; i < n_threads; i++)
+  {
+    workers[i].id = i;
+    workers[i].shared = shared;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  *errors = 0;
+  for (i = 0; i < n_threads; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    *errors += workers[i].errors;
+  }
+  double elapsed = now() - t0;
+
+  free(workers);
+  return (double) n_threads * n_ops * 6 / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int max_threads = argc > 3 ? atoi(argv[3]) : 8, n_threads, shared, errors;
+  vfs_t *fs;
+
+  image_name = argc > 1 ? argv[1] : "/tmp/mt_stress.img";
+  n_ops = argc > 2 ? atoi(argv[2]) : 20000;
+
+  printf("%-8s %-8s %-12s %-8s %-6s\n", "dirs", "threads", "ops/s", "speedup", "errors");
+  for (shared = 0; shared <= 1; shared++)
+  {
+    double base = 0;
+
+    for (n_threads = 1; n_threads <= max_threads; n_threads *= 2)
+    {
+      // cada medio comea numa imagem nova
+      unlink(image_name);
+      if (fs_format(image_name, 512, 16) != 0 || (fs = fs_mount(image_name, &errors)) == NULL)
+      {
+        fprintf(stderr, "mt_stress: cannot create %s\n", image_name);
+        return 1;
+      }
+      fs_mkdir(fs, "shared");
+      fs_unmount(fs);
+
+      double ops = run(n_threads, shared, &errors);
+      if (n_threads == 1)
+        base = ops;
+      printf("%-8s %-8d %-12.0f %-8.2f %-6d\n", shared ? "shared" : "private", n_threads, ops, ops / base, errors);
+    }
+  }
+
+  unlink(image_name);
+  return 0;
+}
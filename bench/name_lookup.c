@@ -0,0 +1,89 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   name_lookup: tempo de procurar um nome num directrio     //
+//   grande (dir_find) com cada verso da comparao de nomes  //
+//                                                             //
+// compilao: gcc -O2 bench/name_lookup.c -Wall -lpthread -o bench/name_lookup
+// utilizao: bench/name_lookup [IMAGEM] [PROCURAS]           //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#include "../libvfs.c"
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// faz lookups procuras de nomes ao acaso entre os n do directrio dir_block (com miss != 0, procura
+// nomes que no existem mas caem entre eles) e devolve o tempo por procura (ns)
+double lookup(vfs_t *fs, int dir_block, int n, long lookups, int miss, long *found) {
+  char name[MAX_NAME_LENGHT + 1];
+  unsigned int seed = 12345;
+  int block, slot;
+  long i;
+  double t0 = now();
+
+  for (i = 0; i < lookups; i++)
+  {
+    sprintf(name, miss ? "entry%07dx" : "entry%07d", rand_r(&seed) % n);
+    if (dir_find(fs, dir_block, name, 0, &block, &slot) != NULL)
+      (*found)++;
+  }
+
+  return (now() - t0) * 1e9 / lookups;
+}
+
+int main(int argc, char *argv[]) {
+  char *image_name = argc > 1 ? argv[1] : "/tmp/name_lookup.img";
+  long lookups = argc > 2 ? atol(argv[2]) : 1000000, found = 0;
+  int sizes[] = {1000, 10000, 100000, 1000000}, n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  struct {
+    char *label;
+    int (*cmp)(const char*, const char*);
+  } kernels[] = {{"scalar", name_cmp_scalar}, {"sse2", name_cmp_sse2}, {"avx2", name_cmp_avx2}};
+  int n_kernels = sizeof(kernels) / sizeof(kernels[0]), error, i, j, k, block, slot;
+  char name[MAX_NAME_LENGHT + 1];
+  vfs_t *fs;
+
+  printf("%-10s %-8s %-12s %-12s\n", "entries", "version", "hit_ns", "miss_ns");
+  for (i = 0; i < n_sizes; i++)
+  {
+    // cada tamanho usa uma imagem nova, com as entradas acrescentadas por ordem (os blocos ficam cheios)
+    unlink(image_name);
+    if (fs_format(image_name, 1024, 16) != 0 || (fs = fs_mount(image_name, &error)) == NULL)
+    {
+      fprintf(stderr, "name_lookup: cannot create %s\n", image_name);
+      return 1;
+    }
+    fs_set_sync(fs, VFS_SYNC_NONE);
+    fs_mkdir(fs, "dir");
+    int dir_block = dir_find(fs, fs->sb->root_block, "dir", TYPE_DIR, &block, &slot)->first_block;
+    for (j = 0; j < sizes[i]; j++)
+    {
+      sprintf(name, "entry%07d", j);
+      if (!reserve_blocks(fs, dir_full(fs, dir_block, name)))
+      {
+        fprintf(stderr, "name_lookup: %s is full\n", image_name);
+        return 1;
+      }
+      dir_insert(fs, dir_block, TYPE_FILE, name, 0, 0);
+    }
+
+    // a mesma sequncia de procuras para cada verso
+    for (k = 0; k < n_kernels; k++)
+    {
+      if ((k == 1 && !__builtin_cpu_supports("sse2")) || (k == 2 && !__builtin_cpu_supports("avx2")))
+        continue;
+      name_cmp = kernels[k].cmp;
+      double hit = lookup(fs, dir_block, sizes[i], lookups, 0, &found);
+      double miss = lookup(fs, dir_block, sizes[i], lookups, 1, &found);
+      printf("%-10d %-8s %-12.1f %-12.1f\n", sizes[i], kernels[k].label, hit, miss);
+    }
+    fs_unmount(fs);
+  }
+
+  unlink(image_name);
+  return found == 0;
+}
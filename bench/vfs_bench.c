@@ -0,0 +1,321 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   vfs_bench: bateria de medies da biblioteca, com imagens //
+//   novas para cada tamanho de bloco e tipo de FAT            //
+//                                                             //
+// Cada carga (mkdir, get de ficheiros pequenos e grandes,     //
+// cat, put, cp/mv/rm e cd/pwd numa rvore funda) chama as     //
+// funes fs_* que os comandos do vfs usam, sem passar pelo   //
+// readline nem pelo interpretador de comandos. Cada linha do  //
+// resultado  um objecto JSON com a configurao, ops/s, MB/s //
+// e os percentis da latncia de uma operao (em us); o       //
+// nmero de operaes cresce com ESCALA, sem passar de uma    //
+// fraco dos blocos livres da imagem.                        //
+//                                                             //
+// compilao: gcc -O2 bench/vfs_bench.c libvfs.a -Wall -lpthread -o bench/vfs_bench
+// utilizao: bench/vfs_bench [IMAGEM] [ESCALA]  (ou make bench)
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../libvfs.h"
+
+#define SMALL_FILE "/tmp/vfs_bench.small"
+#define BIG_FILE "/tmp/vfs_bench.big"
+#define OUT_FILE "/tmp/vfs_bench.out"
+#define SMALL_SIZE 1024
+#define MAX_BIG_SIZE (8 << 20)
+#define MAX_DEPTH 64
+#define PATH_SIZE 4096
+
+typedef struct result {
+  const char *workload;  // nome da carga
+  int ops;               // operaes medidas
+  long long bytes;       // bytes transferidos (0 nas operaes que no copiam dados)
+  double seconds;        // tempo total
+  double *lat;           // latncia de cada operao (us)
+} result;
+
+vfs_t *fs;
+int block_size, fat_type, errors;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// cria o ficheiro UNIX name com size bytes
+int make_host_file(char *name, long long size) {
+  char buffer[1 << 16];
+  int fd = open(name, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  long long done;
+
+  if (fd == -1)
+    return -1;
+  memset(buffer, 'x', sizeof(buffer));
+  for (done = 0; done < size; done += sizeof(buffer))
+    if (write(fd, buffer, size - done < (long long) sizeof(buffer) ? size - done : sizeof(buffer)) == -1)
+    {
+      close(fd);
+      return -1;
+    }
+  close(fd);
+  return 0;
+}
+
+// conta uma operao que devia ter sucesso e falhou
+void check(const char *workload, int res) {
+  if (res != 0)
+  {
+    if (errors++ == 0)
+      fprintf(stderr, "vfs_bench: %s failed with error %d (-b%d -f%d)\n", workload, res, block_size, fat_type);
+  }
+  return;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+// percentil p (entre 0 e 1) das latncias j ordenadas
+double percentile(result *r, double p) {
+  int i = (int) (p * (r->ops - 1) + 0.5);
+  return r->ops > 0 ? r->lat[i] : 0;
+}
+
+// escreve o resultado de uma carga como uma linha JSON
+void report(result *r) {
+  qsort(r->lat, r->ops, sizeof(double), cmp_double);
+  printf("{\"block_size\": %d, \"fat_type\": %d, \"workload\": \"%s\", \"ops\": %d, \"seconds\": %.6f, "
+         "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+         "\"max_us\": %.2f}\n",
+         block_size, fat_type, r->workload, r->ops, r->seconds, r->seconds > 0 ? r->ops / r->seconds : 0,
+         r->seconds > 0 ? r->bytes / r->seconds / (1 << 20) : 0, percentile(r, 0.5), percentile(r, 0.9),
+         percentile(r, 0.99), r->ops > 0 ? r->lat[r->ops - 1] : 0);
+  fflush(stdout);
+  return;
+}
+
+// comea uma carga de at ops operaes
+void start(result *r, const char *workload, int ops) {
+  r->workload = workload;
+  r->ops = 0;
+  r->bytes = 0;
+  r->seconds = 0;
+  r->lat = (double *) realloc(r->lat, (ops > 0 ? ops : 1) * sizeof(double));
+  return;
+}
+
+// regista uma operao que comeou em t0
+void record(result *r, double t0, long long bytes) {
+  double t = now() - t0;
+
+  r->lat[r->ops++] = t * 1e6;
+  r->seconds += t;
+  r->bytes += bytes;
+  return;
+}
+
+// nmero de operaes de uma carga: n * scale (pelo menos uma)
+int scaled(int n, double scale) {
+  return n * scale >= 1 ? n * scale : 1;
+}
+
+// nmero de operaes de uma carga em que cada operao ocupa cost blocos: no mais do que as que
+// cabem num quarto dos n_free blocos livres
+int ops_for(int n, double scale, int n_free, int cost) {
+  int ops = scaled(n, scale), limit = n_free / 4 / cost;
+
+  return ops < limit ? ops : limit > 0 ? limit : 1;
+}
+
+// corre todas as cargas numa imagem nova com blocos de block_size bytes e FAT fat_type
+int run(char *image_name, double scale, int small_fd, int big_fd, long long big_size) {
+  char name[PATH_SIZE], cwd[PATH_SIZE];
+  frag_stats stats;
+  result r = {0};
+  double t0;
+  int error, i, n, n_free;
+
+  unlink(image_name);
+  if (fs_format(image_name, block_size, fat_type) != 0 || (fs = fs_mount(image_name, &error)) == NULL)
+  {
+    fprintf(stderr, "vfs_bench: cannot create %s\n", image_name);
+    return -1;
+  }
+  fs_frag(fs, &stats);
+  n_free = stats.free_blocks;
+  int big_blocks = (big_size + block_size - 1) / block_size;
+  if (big_blocks * 4 > n_free)
+    big_blocks = n_free / 4;
+  big_size = (long long) big_blocks * block_size;
+  if (ftruncate(big_fd, big_size) == -1)
+    return -1;
+
+  // mkdir de muitos subdirectrios no mesmo directrio (cada um ocupa um bloco)
+  check("mkdir", fs_mkdir(fs, "m"));
+  n = ops_for(2000, scale, n_free, 1);
+  start(&r, "mkdir", n);
+  for (i = 0; i < n; i++)
+  {
+    sprintf(name, "m/d%06d", i);
+    t0 = now();
+    check("mkdir", fs_mkdir(fs, name));
+    record(&r, t0, 0);
+  }
+  report(&r);
+  check("rm -r", fs_remove_tree(fs, "m"));
+
+  // get de ficheiros pequenos
+  check("mkdir", fs_mkdir(fs, "s"));
+  n = ops_for(2000, scale, n_free, (SMALL_SIZE + block_size - 1) / block_size + 1);
+  start(&r, "get_small", n);
+  for (i = 0; i < n; i++)
+  {
+    sprintf(name, "s/f%06d", i);
+    lseek(small_fd, 0, SEEK_SET);
+    t0 = now();
+    check("get_small", fs_import(fs, small_fd, name));
+    record(&r, t0, SMALL_SIZE);
+  }
+  report(&r);
+  check("rm -r", fs_remove_tree(fs, "s"));
+
+  // get de um ficheiro grande (substitudo a cada vez)
+  n = ops_for(20, scale, n_free, big_blocks);
+  start(&r, "get_large", n);
+  for (i = 0; i < n; i++)
+  {
+    lseek(big_fd, 0, SEEK_SET);
+    t0 = now();
+    check("get_large", fs_import(fs, big_fd, "big"));
+    record(&r, t0, big_size);
+  }
+  report(&r);
+
+  // cat (para /dev/null) e put do ficheiro grande
+  int null_fd = open("/dev/null", O_WRONLY);
+  n = scaled(20, scale);
+  start(&r, "cat", n);
+  for (i = 0; i < n; i++)
+  {
+    t0 = now();
+    check("cat", fs_export(fs, "big", null_fd));
+    record(&r, t0, big_size);
+  }
+  report(&r);
+  close(null_fd);
+
+  start(&r, "put", n);
+  for (i = 0; i < n; i++)
+  {
+    int out_fd = open(OUT_FILE, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    t0 = now();
+    check("put", fs_export(fs, "big", out_fd));
+    record(&r, t0, big_size);
+    close(out_fd);
+  }
+  report(&r);
+  unlink(OUT_FILE);
+  check("rm", fs_unlink(fs, "big"));
+
+  // cp, mv e rm de ficheiros pequenos, alternados; o cp s partilha os blocos do original (copy-on-write)
+  // e no copia nenhum byte, por isso conta s como operao ("cp_cow", sem MB/s)
+  lseek(small_fd, 0, SEEK_SET);
+  check("get_small", fs_import(fs, small_fd, "orig"));
+  n = scaled(2000, scale);
+  result cp = {0}, mv = {0}, rm = {0};
+  start(&cp, "cp_cow", n);
+  start(&mv, "mv", n);
+  start(&rm, "rm", n);
+  for (i = 0; i < n; i++)
+  {
+    char moved[32];
+    sprintf(name, "c%06d", i);
+    sprintf(moved, "v%06d", i);
+    t0 = now();
+    check("cp", fs_copy(fs, "orig", name));
+    record(&cp, t0, 0);
+    t0 = now();
+    check("mv", fs_rename(fs, name, moved));
+    record(&mv, t0, 0);
+    t0 = now();
+    check("rm", fs_unlink(fs, moved));
+    record(&rm, t0, 0);
+  }
+  report(&cp);
+  report(&mv);
+  report(&rm);
+  free(cp.lat);
+  free(mv.lat);
+  free(rm.lat);
+
+  // cd e pwd no fundo de uma cadeia de subdirectrios
+  int depth = MAX_DEPTH < n_free / 4 ? MAX_DEPTH : n_free / 4;
+  strcpy(name, "");
+  for (i = 0; i < depth; i++)
+  {
+    strcat(name, "/d");
+    check("mkdir", fs_mkdir(fs, name));
+  }
+  n = scaled(10000, scale);
+  start(&r, "cd", n);
+  for (i = 0; i < n; i++)
+  {
+    t0 = now();
+    check("cd", fs_chdir(fs, i % 2 ? "/" : name));
+    record(&r, t0, 0);
+  }
+  report(&r);
+  check("cd", fs_chdir(fs, name));
+  start(&r, "pwd", n);
+  for (i = 0; i < n; i++)
+  {
+    t0 = now();
+    check("pwd", fs_getcwd(fs, cwd, PATH_SIZE));
+    record(&r, t0, 0);
+  }
+  report(&r);
+
+  free(r.lat);
+  fs_unmount(fs);
+  unlink(image_name);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char *image_name = argc > 1 ? argv[1] : "/tmp/vfs_bench.img";
+  double scale = argc > 2 ? atof(argv[2]) : 1;
+  int block_sizes[] = {256, 512, 1024}, fat_types[] = {8, 10, 12, 16, 32}, i, j;
+
+  if (make_host_file(SMALL_FILE, SMALL_SIZE) == -1 || make_host_file(BIG_FILE, MAX_BIG_SIZE) == -1)
+  {
+    fprintf(stderr, "vfs_bench: cannot create %s\n", BIG_FILE);
+    return 1;
+  }
+  int small_fd = open(SMALL_FILE, O_RDONLY), big_fd = open(BIG_FILE, O_RDWR);
+
+  for (i = 0; i < (int) (sizeof(block_sizes) / sizeof(block_sizes[0])); i++)
+    for (j = 0; j < (int) (sizeof(fat_types) / sizeof(fat_types[0])); j++)
+    {
+      block_size = block_sizes[i];
+      fat_type = fat_types[j];
+      if (run(image_name, scale, small_fd, big_fd, MAX_BIG_SIZE) == -1)
+        errors++;
+    }
+
+  close(small_fd);
+  close(big_fd);
+  unlink(SMALL_FILE);
+  unlink(BIG_FILE);
+  return errors != 0;
+}
@@ -0,0 +1,261 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   vfs_load: gerador de carga para o modo servidor do vfs,   //
+//   comparado com lanar o programa vfs para cada comando     //
+//                                                             //
+// compilao: gcc -O2 bench/vfs_load.c -Wall -lpthread -o bench/vfs_load
+// utilizao: bench/vfs_load [VFS] [PEDIDOS]                  //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define IMAGE "/tmp/vfs_load.img"
+#define SOCKET "/tmp/vfs_load.sock"
+#define SMALL_FILE "/tmp/vfs_load.small"
+#define BIG_FILE "/tmp/vfs_load.big"
+#define SMALL_SIZE 4096
+#define BIG_SIZE (8 << 20)
+#define BUFFER_SIZE (1 << 16)
+
+typedef struct client {
+  pthread_t thread;
+  char *requests;       // pedidos enviados de cada vez (depth linhas)
+  int depth;            // pedidos enviados antes de ler as respostas
+  int rounds;           // nmero de vezes que os pedidos so enviados
+  long long bytes;      // bytes recebidos nas respostas
+  int errors;           // respostas com cdigo diferente de 0
+} client;
+
+char *vfs_binary;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connect_server(void) {
+  struct sockaddr_un addr;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, SOCKET);
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+  {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// corre o programa vfs com os argumentos argv, com a sada em /dev/null
+int run_vfs(char *argv[]) {
+  int status;
+  pid_t pid = fork();
+
+  if (pid == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execv(vfs_binary, argv);
+    _exit(127);
+  }
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// cria um ficheiro UNIX com size bytes
+void make_file(char *name, long long size) {
+  char buf[BUFFER_SIZE];
+  int fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644), i;
+
+  for (i = 0; i < BUFFER_SIZE; i++)
+    buf[i] = 'a' + i % 26;
+  while (size > 0)
+  {
+    int n = size < BUFFER_SIZE ? size : BUFFER_SIZE;
+    if (write(fd, buf, n) != n)
+      break;
+    size -= n;
+  }
+  close(fd);
+  return;
+}
+
+// l uma resposta completa do servidor (usando buf, com *len bytes j lidos); devolve o cdigo
+// da resposta, -1 se a ligao falhar, e soma a *bytes o tamanho da sada
+int read_response(int sock, char *buf, int *len, long long *bytes) {
+  char *end;
+  int res;
+  long long size;
+
+  while ((end = memchr(buf, '\n', *len)) == NULL)
+  {
+    int n = read(sock, buf + *len, BUFFER_SIZE - *len);
+    if (n <= 0)
+      return -1;
+    *len += n;
+  }
+  if (sscanf(buf, "%d %lld", &res, &size) != 2)
+    return -1;
+  *bytes += size;
+
+  // a sada que j est no buffer  descartada, e o resto  lido directamente
+  int header = end + 1 - buf;
+  long long in_buf = *len - header < size ? *len - header : size;
+  memmove(buf, buf + header + in_buf, *len - header - in_buf);
+  *len -= header + in_buf;
+  size -= in_buf;
+  while (size > 0)
+  {
+    int n = read(sock, buf, size < BUFFER_SIZE ? size : BUFFER_SIZE);
+    if (n <= 0)
+      return -1;
+    size -= n;
+  }
+
+  return res;
+}
+
+void *run_client(void *arg) {
+  client *c = (client *) arg;
+  char buf[BUFFER_SIZE];
+  int sock = connect_server(), len = 0, request_len = strlen(c->requests), i, j;
+
+  if (sock == -1)
+  {
+    c->errors = c->rounds * c->depth;
+    return NULL;
+  }
+  for (i = 0; i < c->rounds; i++)
+  {
+    if (write(sock, c->requests, request_len) != request_len)
+    {
+      c->errors++;
+      break;
+    }
+    for (j = 0; j < c->depth; j++)
+      if (read_response(sock, buf, &len, &c->bytes) != 0)
+        c->errors++;
+  }
+  close(sock);
+  return NULL;
+}
+
+// n_clients ligaes simultneas, cada uma a enviar os comandos de mix em grupos de depth;
+// devolve o tempo total e em bytes e errors os totais das respostas
+double run_load(int n_clients, int depth, int n_requests, char *mix[], int n_mix, long long *bytes, int *errors) {
+  client *clients = (client *) calloc(n_clients, sizeof(client));
+  char *requests = (char *) malloc(depth * 64 + 1);
+  int i;
+
+  requests[0] = '\0';
+  for (i = 0; i < depth; i++)
+    strcat(strcat(requests, mix[i % n_mix]), "\n");
+
+  double t0 = now();
+  for (i = 0; i < n_clients; i++)
+  {
+    clients[i].requests = requests;
+    clients[i].depth = depth;
+    clients[i].rounds = n_requests / n_clients / depth > 0 ? n_requests / n_clients / depth : 1;
+    pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+  }
+  *bytes = *errors = 0;
+  for (i = 0; i < n_clients; i++)
+  {
+    pthread_join(clients[i].thread, NULL);
+    *bytes += clients[i].bytes;
+    *errors += clients[i].errors;
+  }
+  double elapsed = now() - t0;
+
+  free(requests);
+  free(clients);
+  return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  char *mix[] = {"cat small", "ls", "pwd", "cat small 1000 100"};
+  char *big[] = {"cat big"};
+  int n_requests = argc > 2 ? atoi(argv[2]) : 100000, clients[] = {1, 4, 16}, depths[] = {1, 16, 64};
+  int errors, i, j, spawn = n_requests / 200 > 20 ? n_requests / 200 : 20;
+  long long bytes;
+  pid_t server;
+
+  vfs_binary = argc > 1 ? argv[1] : "./vfs";
+  make_file(SMALL_FILE, SMALL_SIZE);
+  make_file(BIG_FILE, BIG_SIZE);
+  unlink(IMAGE);
+  char *setup[] = {vfs_binary, "-b1024", "-f16", "-c", "get " SMALL_FILE " small;get " BIG_FILE " big", IMAGE, NULL};
+  if (run_vfs(setup) != 0)
+  {
+    fprintf(stderr, "vfs_load: cannot create %s with %s\n", IMAGE, vfs_binary);
+    return 1;
+  }
+
+  // referncia: um processo vfs por comando (monta e valida a imagem de cada vez)
+  char *cat_small[] = {vfs_binary, "-c", "cat small", IMAGE, NULL};
+  double t0 = now();
+  for (i = 0; i < spawn; i++)
+    run_vfs(cat_small);
+  printf("%-24s %-8s %-6s %-12s %-10s %-6s\n", "mode", "clients", "depth", "requests/s", "MB/s", "errors");
+  printf("%-24s %-8d %-6d %-12.0f %-10s %-6d\n", "vfs -c per command", 1, 1, spawn / (now() - t0), "-", 0);
+
+  if ((server = fork()) == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    execl(vfs_binary, vfs_binary, "-d", SOCKET, IMAGE, NULL);
+    _exit(127);
+  }
+  for (i = 0; i < 100; i++)
+  {
+    int sock = connect_server();
+    if (sock != -1)
+    {
+      close(sock);
+      break;
+    }
+    usleep(10000);
+  }
+
+  // comandos pequenos: o dbito depende do nmero de pedidos em curso por ligao
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++)
+    {
+      double elapsed = run_load(clients[i], depths[j], n_requests, mix, 4, &bytes, &errors);
+      int done = clients[i] * (n_requests / clients[i] / depths[j] > 0 ? n_requests / clients[i] / depths[j] : 1) * depths[j];
+      printf("%-24s %-8d %-6d %-12.0f %-10.1f %-6d\n", "server (mix)", clients[i], depths[j], done / elapsed, bytes / elapsed / 1e6, errors);
+    }
+
+  // ficheiros grandes: o dbito de cat enviado com sendfile
+  for (i = 0; i < 3; i++)
+  {
+    int rounds = 64 / clients[i];
+    double elapsed = run_load(clients[i], 1, rounds * clients[i], big, 1, &bytes, &errors);
+    printf("%-24s %-8d %-6d %-12.0f %-10.1f %-6d\n", "server (cat 8MB)", clients[i], 1, rounds * clients[i] / elapsed, bytes / elapsed / 1e6, errors);
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  unlink(IMAGE);
+  unlink(SMALL_FILE);
+  unlink(BIG_FILE);
+  return 0;
+}
@@ -0,0 +1,4896 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//         Trabalho II: Sistema de Gesto de Ficheiros         //
+//                                                             //
+//   libvfs: implementao do sistema de ficheiros (FAT) sobre //
+//   uma imagem mapeada em memria; ver libvfs.h               //
+//                                                             //
+//                    Pedro Paredes                            //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "libvfs.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define DEBUG 0
+
+#define CHECK_NUMBER 9999
+// verses do formato da imagem: 0 - o programa original (FAT de um int por entrada, entradas de 32
+// bytes e um bloco em cada ficheiro, mesmo vazio); 1 - FAT compactada, entradas de 40 bytes, referncias
+// por bloco e ficheiros vazios sem blocos (first_block a -1); 2 - blocos reservados s at high_water;
+// 3 - dirio no fim da imagem; 4 - directrios com o ltimo bloco no superblock. As verses anteriores
+// so convertidas ao montar (upgrade_image e journal_open)
+#define FS_VERSION 4
+#define INDEX_TABLE_SIZE 256
+#define SKIP_INTERVAL 64
+#define JOURNAL_MAGIC 0x4c4e524a
+#define UNDO_MAGIC 0x4f444e55
+#define JOURNAL_START 64         // os grupos comeam depois do cabealho do dirio
+#define JOURNAL_CHUNK 64         // granularidade com que as alteraes aos metadados entram nos grupos
+#define UNDO_PAGE 4096           // granularidade das imagens anteriores dos metadados
+#define DEFAULT_COMMIT_WINDOW 10000
+#define PREFETCH_SIZE (1 << 20)    // bytes de uma cadeia pedidos ao kernel antes de serem lidos
+#define DONTNEED_SIZE (32 << 20)   // as exportaes a partir deste tamanho largam as pginas que leram
+#define HUGE_PAGE_SIZE (2 << 20)
+#define HUGE_PAGES_MIN (16 << 20)  // tamanho mnimo das imagens em que as pginas grandes podem ser pedidas
+#define MAX_WORKERS 16             // threads que percorrem ao mesmo tempo uma rvore de directrios
+#define DENTRY_CACHE_SIZE 1024     // posies da cache de entradas de subdirectrios de cada contexto
+#define NAME_KEY_SIZE 32           // bytes lidos de um nome pelas comparaes vectoriais (ver name_key)
+
+// a FAT32 usa entradas de 32 bits, mas o nmero de blocos fica limitado a 2^25
+#define FAT_ENTRIES(TYPE) (TYPE == 8 ? 256 : TYPE == 10 ? 1024 : TYPE == 12 ? 4096 : TYPE == 16 ? 65536 : 1 << 25)
+// a FAT  guardada compactada: 8 bits por entrada na FAT8, 12 bits na FAT10 e FAT12, 16 na FAT16 e 32 na FAT32
+#define FAT_BITS(TYPE) (TYPE == 8 ? 8 : TYPE <= 12 ? 12 : TYPE)
+#define FAT_SIZE(TYPE) (((size_t) FAT_ENTRIES(TYPE) * FAT_BITS(TYPE) / 8 + 7) / 8 * 8)
+#define OLD_FAT_SIZE(TYPE) (FAT_ENTRIES(TYPE) * sizeof(int))
+#define BITMAP_SIZE(TYPE) (FAT_ENTRIES(TYPE) / 64 * sizeof(unsigned long long))
+#define REFS_SIZE(TYPE) (FAT_ENTRIES(TYPE) * sizeof(unsigned short))
+#define REFS_MAX 65535
+#define FILESYSTEM_SIZE(BS, TYPE) (BS + FAT_SIZE(TYPE) + BITMAP_SIZE(TYPE) + REFS_SIZE(TYPE) + (off_t) FAT_ENTRIES(TYPE) * BS)
+// as imagens da verso 0 (as do programa original) s tm o superblock, a FAT de um int por entrada e os blocos
+#define OLD_FILESYSTEM_SIZE(BS, TYPE) (BS + OLD_FAT_SIZE(TYPE) + (off_t) FAT_ENTRIES(TYPE) * BS)
+// o dirio fica no fim da imagem, depois dos dados, com espao para um quarto dos metadados e 1MB
+#define JOURNAL_SIZE(TYPE) (((FAT_SIZE(TYPE) + BITMAP_SIZE(TYPE) + REFS_SIZE(TYPE)) / 4 + (1 << 20)) / 4096 * 4096)
+#define IMAGE_SIZE(BS, TYPE) (FILESYSTEM_SIZE(BS, TYPE) + JOURNAL_SIZE(TYPE))
+// as macros seguintes usam o contexto fs da funo onde aparecem
+#define BLOCK(N) (fs->blocks + (size_t) (N) * fs->sb->block_size)
+#define BLOCK_OFFSET(N) ((loff_t) (BLOCK(N) - (char *) fs->sb))
+#define BLOCK_USED(N) ((fs->bitmap[(N) / 64] >> ((N) % 64)) & 1)
+#define DIR_ENTRIES_PER_BLOCK (fs->sb->block_size / sizeof(dir_entry))
+#ifdef VFS_STATS
+#define COUNT(FIELD, N) (fs->counters.FIELD += (N))
+#else
+#define COUNT(FIELD, N) ((void) 0)
+#endif
+// as entradas de um directrio (excepto "." e "..", nas duas primeiras posies do primeiro bloco) ficam
+// ordenadas pelo nome ao longo da cadeia; cada bloco ocupa as primeiras posies e as livres esto a zeros
+// (o nome vazio marca o fim das entradas do bloco), e s o primeiro bloco pode no ter nenhuma entrada
+// a gerao de um directrio (muda quando uma entrada  acrescentada, removida ou renomeada) fica
+// nos bytes no usados do nome da entrada ".", a 8 bytes do incio do primeiro bloco
+#define DIR_GENERATION(N) ((unsigned int *) (BLOCK(N) + 8))
+#define JOURNAL_OFFSET FILESYSTEM_SIZE(fs->sb->block_size, fs->sb->fat_type)
+#define JOURNAL_HEADER ((journal_header *) ((char *) fs->sb + JOURNAL_OFFSET))
+// bytes do dirio usados como bloqueios de registo: escrita no dirio, montagem (o primeiro contexto
+// repe o dirio), operaes a meio (para leitura), confirmao  espera delas e converso das imagens
+// das verses anteriores (que ainda no tm dirio, mas os bloqueios podem estar depois do fim do ficheiro)
+#define LOCK_LOG JOURNAL_OFFSET
+#define LOCK_MOUNT (JOURNAL_OFFSET + 1)
+#define LOCK_OPS (JOURNAL_OFFSET + 2)
+#define LOCK_GATE (JOURNAL_OFFSET + 3)
+#define LOCK_UPGRADE (JOURNAL_OFFSET + 4)
+
+typedef struct superblock_entry {
+  int check_number;   // nmero que permite identificar o sistema como vlido
+  int block_size;     // tamanho de um bloco {256, 512(default) ou 1024 bytes}
+  int fat_type;       // tipo de FAT {8, 10(default), 12, 16 ou 32}
+  int root_block;     // nmero do 1 bloco a que corresponde o directrio raiz
+  int free_block;     // nmero do bloco a partir do qual se procuram blocos no utilizados
+  int n_free_blocks;  // total de blocos no utilizados
+  int version;        // verso do formato (0 nas imagens do programa original)
+  int high_water;     // primeiro bloco nunca utilizado (da em diante nada foi escrito na imagem)
+  unsigned int generation;  // muda sempre que uma cadeia de um ficheiro  religada ou libertada
+  int n_walks;        // percursos de fs_copy_tree e fs_remove_tree a meio, com uma rvore fora da raiz
+} superblock;
+
+// cabealho do dirio; seguem-se-lhe os grupos e as imagens anteriores escritos desde o ltimo checkpoint,
+// os grupos com nmeros de sequncia consecutivos a partir de first_seq e as imagens com o nmero do
+// checkpoint (o primeiro registo que no os tiver, ou estiver estragado,  o fim)
+typedef struct journal_header {
+  unsigned int magic;
+  unsigned int first_seq;   // sequncia do primeiro grupo depois do ltimo checkpoint
+  unsigned int next_seq;    // sequncia do prximo grupo a escrever
+  unsigned int tail;        // posio (a partir do incio do dirio) onde  escrito o prximo registo
+  unsigned int checkpoint;  // nmero do ltimo checkpoint (0 nas imagens das verses anteriores)
+} journal_header;
+
+// grupo de operaes confirmado (ou imagem anterior, com UNDO_MAGIC): n_ranges regies da imagem
+// (journal_range seguido dos bytes, arredondados a 8), com o contedo que tinham no fim do grupo (ou
+// antes da primeira alterao depois do checkpoint)
+typedef struct journal_group {
+  unsigned int magic;
+  unsigned int checksum;   // FNV-1a dos bytes do grupo a partir de seq
+  unsigned int seq;
+  unsigned int n_ranges;
+  unsigned int length;     // tamanho total do grupo (mltiplo de 8)
+  unsigned int pad;
+} journal_group;
+
+typedef struct journal_range {
+  long long offset;  // posio da regio na imagem
+  long long len;     // tamanho da regio
+} journal_range;
+
+// regio alterada no grupo aberto
+typedef struct dirty_range {
+  off_t offset;
+  off_t len;
+  int data;      // 1 nos dados de um ficheiro (so escritos nas suas posies antes do grupo)
+} dirty_range;
+
+// estado do grupo aberto, comum a todos os contextos que montaram a imagem; fica no fim do dirio, seguido
+// do mapa dos blocos livres no ltimo checkpoint, dos mapas dos pedaos dos metadados e dos blocos
+// alterados (1 bit cada), dos mapas das imagens anteriores, dos mapas dos blocos libertados e das regies
+// alteradas
+typedef struct journal_shared {
+  long long group_start;   // instante da primeira alterao do grupo aberto (0 se no h nenhuma)
+  long long bytes;         // estimativa do tamanho do grupo no dirio
+  unsigned int group;      // muda sempre que um grupo  confirmado
+  unsigned int n_ranges;   // regies acrescentadas (se passar de max_ranges, o grupo acaba num checkpoint)
+  int committing;          // 1 enquanto uma confirmao tem LOCK_GATE e espera pelas operaes a meio
+  int n_freed[2];          // blocos nos mapas freed (pela paridade do grupo em que foram libertados)
+  int undo_lost;           // 1 se uma imagem anterior no pde ser escrita (a confirmao seguinte faz um
+                           // checkpoint)
+} journal_shared;
+
+// dirio de um contexto (partilhado pelos contextos criados com fs_clone)
+typedef struct journal {
+  int fd;                            // descritor da imagem com O_DSYNC, para as escritas no dirio
+  long long window;                  // janela de confirmao em microssegundos (-1 com o dirio desligado)
+  int strict;                        // cada grupo  tambm escrito nas suas posies (VFS_SYNC_STRICT)
+  unsigned int log_size;             // bytes do dirio usados pelos registos (o resto  de shared)
+  journal_shared *shared;            // grupo aberto
+  unsigned long long *checkpoint_free;  // blocos livres no ltimo checkpoint (no precisam de imagem anterior)
+  unsigned long long *dirty_chunks;  // pedaos de JOURNAL_CHUNK bytes dos metadados no grupo aberto
+  unsigned long long *dirty_blocks;  // blocos de directrios no grupo aberto
+  dirty_range *ranges;               // regies do grupo aberto
+  unsigned int max_ranges;
+  dirty_range *data;                 // regies dos dados dos ficheiros do grupo a escrever pelo contexto
+  int n_data, data_size;
+  unsigned int data_group;           // grupo e posio da ltima regio de dados acrescentada pelo contexto
+  unsigned int data_last;
+  int in_op;                         // 1 entre a primeira alterao de uma operao e journal_op
+  int undo_failed;                   // 1 se a operao em curso alterou uma regio sem imagem anterior
+  int *locked;                       // directrios bloqueados pelo contexto
+  int n_locked, locked_size;
+  unsigned long long *undo_pages;    // pginas dos metadados e blocos de directrios com a imagem
+  unsigned long long *undo_blocks;   // anterior j no dirio desde o ltimo checkpoint
+  unsigned long long *freed[2];      // blocos libertados no grupo aberto e no que est a ser escrito (pela
+                                     // paridade do grupo), que s podem voltar a ser usados depois de
+                                     // o grupo estar no disco
+  char *buf;                         // registo a escrever no dirio
+  size_t buf_len, buf_size;
+} journal;
+
+// blocos libertados cujos bits no mapa e contagem em sb->n_free_blocks ainda no foram actualizados
+typedef struct free_batch {
+  int word;                 // palavra do mapa dos blocos acumulados em bits (-1 se nenhuma)
+  unsigned long long bits;
+  int n;                    // blocos libertados que ainda no foram somados a sb->n_free_blocks
+} free_batch;
+
+// subdirectrio name do directrio dir_block, guardado na cache de entradas do contexto
+typedef struct dentry {
+  int dir_block;                   // directrio onde est a entrada (-1 se a posio est livre)
+  unsigned int generation;         // gerao desse directrio quando a entrada foi guardada
+  char name[MAX_NAME_LENGHT + 1];  // nome da entrada
+  int first_block;                 // primeiro bloco do subdirectrio
+} dentry;
+
+// um nvel do caminho do directrio corrente
+typedef struct path_level {
+  int block;                       // primeiro bloco do directrio
+  char name[MAX_NAME_LENGHT + 1];  // nome do directrio no seu pai
+} path_level;
+
+// blocos de um directrio, para procurar as entradas por pesquisa binria (primeiro o bloco, pelo nome da
+// sua primeira entrada, e depois a posio dentro dele)
+typedef struct directory_index {
+  int dir_block;            // primeiro bloco do directrio indexado
+  int n_chain;              // nmero de blocos do directrio
+  int chain_size;           // capacidade dos vectores chain e used
+  int *chain;               // blocos do directrio, pela ordem da cadeia (e dos nomes)
+  int *used;                // posies ocupadas em cada bloco (incluindo "." e ".." no primeiro)
+  unsigned int generation;  // gerao do directrio quando o ndice foi actualizado
+  struct directory_index *next;
+} dir_index;
+
+struct vfs {
+  superblock *sb;              // superblock do sistema de ficheiros (incio do mapeamento)
+  unsigned char *fat;          // apontador para a FAT (compactada, acedida com fat_get e fat_set)
+  int fat_bits;                // nmero de bits de cada entrada da FAT
+  unsigned long long *bitmap;  // apontador para o mapa de blocos utilizados (1 bit por bloco)
+  unsigned short *refs;        // apontador para o nmero de referncias (entradas ou FAT) de cada bloco
+  char *blocks;                // apontador para a regio dos dados
+  off_t size;                  // tamanho da imagem mapeada
+  int fd;                      // descritor do ficheiro que contm o sistema de ficheiros
+  int *mounts;                 // nmero de contextos que partilham o mapeamento e o descritor (fs_clone)
+  journal *journal;            // grupo de alteraes por confirmar (partilhado com os clones)
+  int copy_range_ok;           // 0 se o kernel no suportar copy_file_range para a imagem
+  int hints;                   // 1 se as operaes do dicas ao kernel sobre o acesso  imagem (madvise)
+  int tlb_fd;                  // contador das falhas na TLB de dados (perf_event_open), ou -1
+  vm_stats vm_base;            // valores dos contadores quando a imagem foi montada
+  op_stats counters;           // contadores das operaes internas (s com VFS_STATS; ver COUNT)
+  char *name;                  // caminho absoluto da imagem (para as threads de fs_copy_tree e fs_remove_tree)
+  int workers;                 // nmero mximo de threads dessas operaes
+  int current_dir;             // bloco do directrio corrente
+  path_level *path;            // caminho do directrio corrente, a partir da raiz (para fs_getcwd)
+  int depth;                   // nveis do caminho (-1 se tiver de ser reconstrudo a partir da imagem)
+  int path_size;               // capacidade do vector path
+  dentry *dentries;            // cache das entradas dos subdirectrios usadas nos caminhos
+  dir_index *indexes[INDEX_TABLE_SIZE];  // ndices (em memria) dos directrios j visitados
+};
+
+struct vfs_file {
+  vfs_t *fs;
+  int dir_block;                   // directrio onde est a entrada do ficheiro
+  char name[MAX_NAME_LENGHT + 1];  // nome da entrada
+  int mode;                        // modo de abertura (VFS_READ, VFS_WRITE, ...)
+  long long pos;                   // posio corrente
+  unsigned int generation;         // valor de sb->generation quando os campos seguintes foram obtidos
+  int cur_index;                   // ltimo bloco lgico visitado (-1 se nenhum)
+  int cur_block;                   // bloco fsico correspondente
+  int private_blocks;              // nmero de blocos iniciais que se sabe no serem partilhados
+  int n_skip;                      // entradas vlidas em skip
+  int skip_size;                   // capacidade do vector skip
+  int *skip;                       // skip[j]  o bloco fsico do bloco lgico j * SKIP_INTERVAL
+  long long advised;               // posio at onde as leituras j pediram o contedo ao kernel
+};
+
+struct vfs_dir {
+  vfs_t *fs;
+  int dir_block;  // primeiro bloco do directrio
+  int block;      // bloco da ltima entrada lida (-1 no fim)
+  int slot;       // posio da ltima entrada lida dentro do bloco
+};
+
+// directrio a percorrer por fs_copy_tree ou fs_remove_tree
+typedef struct tree_task {
+  int src;     // primeiro bloco do directrio
+  int dst;     // primeiro bloco (j alocado) da cpia
+  int parent;  // directrio pai da cpia
+} tree_task;
+
+// percurso de uma rvore de directrios por vrias threads: cada directrio  uma tarefa, e os seus
+// subdirectrios so acrescentados s tarefas por fazer  medida que vo sendo encontrados
+typedef struct tree_walk {
+  vfs_t *fs;                        // contexto de quem pediu a operao
+  int copy;                         // 1 em fs_copy_tree, 0 em fs_remove_tree
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  tree_task *tasks;                 // directrios por percorrer
+  int n_tasks, tasks_size;
+  int busy;                         // directrios a ser percorridos
+  int idle;                         // threads  espera de tarefas
+  pthread_t threads[MAX_WORKERS];   // threads iniciadas (alm da de quem pediu a operao)
+  int n_threads;
+  int error;                        // primeiro erro (as cpias dos directrios seguintes ficam vazias)
+} tree_walk;
+
+// entrada de um directrio nas imagens da verso 0 (32 bytes, com o tamanho num int)
+typedef struct old_dir_entry {
+  char type;
+  char name[MAX_NAME_LENGHT];
+  unsigned char day;
+  unsigned char month;
+  unsigned char year;
+  int size;
+  int first_block;
+} old_dir_entry;
+
+// directrio de uma imagem da verso 0 lido por upgrade_fat, com as entradas j no formato actual
+typedef struct old_dir {
+  dir_entry *entries;
+  int n_entries;
+  int *chain;           // blocos da cadeia: os da cadeia antiga e os acrescentados para as entradas maiores
+  int n_chain;
+} old_dir;
+
+// funes auxiliares
+void *map_image(int, off_t);
+void init_superblock(vfs_t*, int, int);
+void init_regions(vfs_t*);
+int upgrade_image(vfs_t*, char*);
+int reload_image(vfs_t*, char*);
+int upgrade_fat(vfs_t*, char*);
+int replace_image(char*, char*);
+int upgrade_journal(vfs_t*);
+int dir_entry_cmp(const void*, const void*);
+void upgrade_dirs(vfs_t*);
+void init_fat(vfs_t*);
+void init_journal(vfs_t*);
+void init_dir_block(vfs_t*, int, int);
+void init_dir_entry(dir_entry*, char, char*, long long, int);
+int valid_name(char*);
+void init_path_cache(vfs_t*);
+
+// funes de acesso  FAT
+static inline int fat_get(vfs_t*, int);
+static inline void fat_set(vfs_t*, int, int);
+static inline unsigned long long freed_word(vfs_t*, int);
+static inline unsigned long long taken_word(vfs_t*, int);
+int find_free_extent(vfs_t*, int, int*);
+int reserve_blocks(vfs_t*, int);
+void unreserve_blocks(vfs_t*, int);
+static inline int claim_block(vfs_t*, int);
+int get_free_chain(vfs_t*, int);
+int get_free_block(vfs_t*);
+int get_free_extent(vfs_t*, int, int);
+void delete_block(vfs_t*, int);
+void delete_chain(vfs_t*, int);
+void batch_free(vfs_t*, free_batch*, int);
+void mark_freed(vfs_t*, int, unsigned long long);
+void batch_flush(vfs_t*, free_batch*);
+void release_chain(vfs_t*, int);
+void release_chain_batch(vfs_t*, int, free_batch*);
+int copy_chain(vfs_t*, int);
+int share_block(vfs_t*, int);
+int unshare_block(vfs_t*, dir_entry*, int, int*);
+int read_chain(vfs_t*, int, int, long long);
+int write_iov(int, struct iovec*, int);
+int write_chain(vfs_t*, int, int, long long);
+
+// dicas ao kernel sobre o acesso ao mapeamento
+void image_advise(vfs_t*, void*, long long, int);
+int chain_advise(vfs_t*, int, int, long long, int);
+int open_tlb_counter(void);
+void read_vm_counters(vfs_t*, vm_stats*);
+
+// dirio das alteraes aos metadados
+long long now_usec(void);
+int image_lock(vfs_t*, off_t, short, int);
+int journal_open(vfs_t*, char*);
+void journal_close(vfs_t*);
+journal_group *journal_record(vfs_t*, journal_header*, unsigned int, unsigned int);
+void journal_apply(vfs_t*, journal_group*);
+int journal_replay(vfs_t*);
+void journal_lock_ops(vfs_t*);
+void journal_unlock_ops(vfs_t*);
+void journal_gate(vfs_t*);
+void journal_begin(vfs_t*);
+static inline void journal_mark(vfs_t*, void*, size_t);
+void journal_register(vfs_t*, off_t, size_t);
+void journal_undo(vfs_t*, int, long long, long long);
+void journal_add_range(vfs_t*, off_t, off_t, int);
+void journal_data(vfs_t*, void*, size_t);
+void journal_append(journal*, off_t, void*, size_t);
+int journal_commit(vfs_t*);
+int journal_build_group(vfs_t*);
+int journal_write_group(vfs_t*, unsigned int);
+void journal_end_group(vfs_t*);
+void journal_clear_freed(vfs_t*, int);
+void journal_free_map(vfs_t*);
+int journal_checkpoint(vfs_t*);
+int journal_write_home(vfs_t*);
+int journal_op(vfs_t*);
+
+// funes de acesso s entradas dos directrios
+unsigned int hash_name(char*);
+void name_key(char*, char*);
+int name_cmp_scalar(const char*, const char*);
+int name_cmp_sse2(const char*, const char*);
+int name_cmp_avx2(const char*, const char*);
+void select_name_cmp(void);
+int block_used(dir_entry*, int);
+int block_search(vfs_t*, dir_entry*, int, int, char*);
+int index_block(vfs_t*, dir_index*, char*);
+dir_index *find_index(vfs_t*, int);
+dir_index *get_index(vfs_t*, int);
+void drop_index(vfs_t*, int);
+dir_entry *dir_find(vfs_t*, int, char*, char, int*, int*);
+dir_entry *dir_next(vfs_t*, int*, int*);
+int dir_full(vfs_t*, int, char*);
+dir_entry *dir_insert(vfs_t*, int, char, char*, long long, int);
+void dir_remove(vfs_t*, int, int, int);
+void dir_changed(vfs_t*, int, dir_index*);
+
+// funes de acesso aos ficheiros abertos
+dir_entry *file_entry(vfs_file*);
+void skip_push(vfs_file*, int);
+int file_block(vfs_file*, dir_entry*, int);
+void file_copy(vfs_file*, dir_entry*, long long, char*, long long, int);
+long long file_write(vfs_file*, dir_entry*, const char*, long long);
+
+// bloqueios entre contextos (de outros processos ou de outras threads)
+void dir_lock(vfs_t*, int, short);
+void dir_unlock(vfs_t*, int);
+int dir_valid(vfs_t*, int);
+int lock_dirs(vfs_t*, int, int, char*);
+void unlock_dirs(vfs_t*, int, int, int);
+int dir_contains(vfs_t*, int, int);
+
+// caminhos
+int lookup_dir(vfs_t*, int, char*);
+int resolve_path(vfs_t*, char*, int*, char*);
+void path_push(vfs_t*, int, int, char*);
+int path_valid(vfs_t*);
+int rebuild_path(vfs_t*);
+
+// operaes com os directrios envolvidos j bloqueados
+int import_file(vfs_t*, int, int, char*);
+int copy_file(vfs_t*, int, char*, int, char*);
+int rename_entry(vfs_t*, int, char*, int, char*);
+int defrag_chain(vfs_t*, dir_entry*, int, int, char, int);
+
+// percurso paralelo das rvores de directrios
+int walk_tree(vfs_t*, int, int, int, int);
+void tree_push(tree_walk*, int, int, int);
+void tree_run(tree_walk*, vfs_t*);
+void *tree_worker(void*);
+void copy_dir(vfs_t*, tree_walk*, tree_task*);
+void remove_dir(vfs_t*, tree_walk*, tree_task*);
+void count_walk(vfs_t*, int);
+int reclaim_blocks(vfs_t*);
+int reclaim_chain(vfs_t*, unsigned long long*, unsigned short*, int);
+
+// verso da comparao dos nomes escolhida para o processador (ver select_name_cmp)
+int (*name_cmp)(const char*, const char*) = name_cmp_scalar;
+pthread_once_t name_cmp_once = PTHREAD_ONCE_INIT;
+
+
+// tamanho da imagem de um sistema de ficheiros com blocos de block_size bytes e FAT fat_type
+off_t fs_image_size(int block_size, int fat_type) {
+  return IMAGE_SIZE(block_size, fat_type);
+}
+
+
+// cria e formata a imagem filesystem_name (apagando-a, se j existir)
+int fs_format(char *filesystem_name, int block_size, int fat_type) {
+  off_t filesystem_size = IMAGE_SIZE(block_size, fat_type);
+  vfs_t image;
+
+  if (!VALID_BLOCK_SIZE(block_size) || !VALID_FAT_TYPE(fat_type))
+    return ERR_INPUT;
+
+  if ((image.fd = open(filesystem_name, O_CREAT | O_TRUNC | O_RDWR, S_IRWXU)) == -1)
+    return ERR_IO;
+  image.journal = NULL;
+
+  // estende o sistema de ficheiros para o tamanho desejado (sem escrever nada, o ficheiro fica esparso)
+  if (ftruncate(image.fd, filesystem_size) == -1
+      || (image.sb = (superblock *) map_image(image.fd, filesystem_size)) == MAP_FAILED) {
+    close(image.fd);
+    return ERR_IO;
+  }
+
+  // inicia o superblock, a FAT e o bloco do directrio raiz '/'
+  init_superblock(&image, block_size, fat_type);
+  init_regions(&image);
+  init_fat(&image);
+  init_dir_block(&image, image.sb->root_block, image.sb->root_block);
+  init_journal(&image);
+
+  munmap(image.sb, filesystem_size);
+  close(image.fd);
+  return 0;
+}
+
+
+// monta a imagem filesystem_name; devolve NULL (e o cdigo do erro em error) se no for possvel
+vfs_t *fs_mount(char *filesystem_name, int *error) {
+  vfs_t *fs = (vfs_t *) calloc(1, sizeof(vfs_t));
+  struct stat buf;
+
+  pthread_once(&name_cmp_once, select_name_cmp);
+  if ((fs->fd = open(filesystem_name, O_RDWR)) == -1) {
+    free(fs);
+    *error = ERR_NOT_FOUND;
+    return NULL;
+  }
+
+  // faz o mapeamento do sistema de ficheiros (uma imagem menor que o superblock no pode ser vlida)
+  if (fstat(fs->fd, &buf) == -1)
+    *error = ERR_IO;
+  else if (buf.st_size < (off_t) sizeof(superblock))
+    *error = ERR_INPUT;
+  else if ((fs->sb = (superblock *) map_image(fs->fd, buf.st_size)) == MAP_FAILED)
+    *error = ERR_IO;
+  else
+    *error = 0;
+  if (*error != 0) {
+    close(fs->fd);
+    free(fs);
+    return NULL;
+  }
+  fs->size = buf.st_size;
+  fs->copy_range_ok = 1;
+  fs->mounts = (int *) malloc(sizeof(int));
+  *fs->mounts = 1;
+
+  // converte as imagens das verses anteriores  3 (ou espera que outro processo acabe de as converter)
+  if (fs->sb->check_number == CHECK_NUMBER && VALID_BLOCK_SIZE(fs->sb->block_size) && VALID_FAT_TYPE(fs->sb->fat_type)
+      && (fs->sb->version < 3 || fs->size != IMAGE_SIZE(fs->sb->block_size, fs->sb->fat_type)) && (*error = upgrade_image(fs, filesystem_name)) != 0) {
+    if (fs->fd != -1)
+      close(fs->fd);
+    free(fs->mounts);
+    free(fs);
+    return NULL;
+  }
+
+  // testa se o sistema de ficheiros  vlido
+  if (fs->sb->check_number != CHECK_NUMBER || !VALID_BLOCK_SIZE(fs->sb->block_size) || !VALID_FAT_TYPE(fs->sb->fat_type)
+      || (fs->sb->version != FS_VERSION && fs->sb->version != 3) || fs->size != IMAGE_SIZE(fs->sb->block_size, fs->sb->fat_type)
+      || JOURNAL_HEADER->magic != JOURNAL_MAGIC) {
+    munmap(fs->sb, fs->size);
+    close(fs->fd);
+    free(fs->mounts);
+    free(fs);
+    *error = ERR_INPUT;
+    return NULL;
+  }
+  init_regions(fs);
+
+  // repe os grupos de operaes confirmados no dirio que possam no ter chegado s suas posies
+  if (journal_open(fs, filesystem_name) == -1) {
+    journal_close(fs);
+    munmap(fs->sb, fs->size);
+    close(fs->fd);
+    free(fs->mounts);
+    free(fs);
+    *error = ERR_IO;
+    return NULL;
+  }
+
+  // o superblock, o mapa e a raiz so lidos logo nas primeiras operaes; a FAT (que numa imagem grande
+  // tem vrios MB)  lida  medida que as cadeias so percorridas, e os seus blocos pedidos por chain_advise
+  fs->hints = 1;
+  image_advise(fs, fs->sb, sizeof(superblock), MADV_WILLNEED);
+  image_advise(fs, fs->bitmap, BITMAP_SIZE(fs->sb->fat_type), MADV_WILLNEED);
+  image_advise(fs, BLOCK(fs->sb->root_block), fs->sb->block_size, MADV_WILLNEED);
+  fs->tlb_fd = open_tlb_counter();
+  read_vm_counters(fs, &fs->vm_base);
+
+  if ((fs->name = realpath(filesystem_name, NULL)) == NULL)
+    fs->name = strdup(filesystem_name);
+  fs_set_workers(fs, sysconf(_SC_NPROCESSORS_ONLN));
+
+  // inicia o directrio corrente
+  fs->current_dir = fs->sb->root_block;
+  init_path_cache(fs);
+  return fs;
+}
+
+
+// cria um novo contexto (na raiz) sobre a imagem j montada em fs, sem a voltar a mapear nem a validar;
+// os dois contextos partilham o descritor e por isso os bloqueios, pelo que s podem ser usados pela
+// mesma thread (servem por exemplo para dar um directrio corrente a cada cliente de um servidor)
+vfs_t *fs_clone(vfs_t *fs) {
+  vfs_t *clone = (vfs_t *) malloc(sizeof(vfs_t));
+
+  *clone = *fs;
+  memset(clone->indexes, 0, sizeof(clone->indexes));
+  clone->current_dir = fs->sb->root_block;
+  init_path_cache(clone);
+  clone->tlb_fd = open_tlb_counter();
+  read_vm_counters(clone, &clone->vm_base);
+  memset(&clone->counters, 0, sizeof(op_stats));
+  (*fs->mounts)++;
+
+  return clone;
+}
+
+
+// desmonta a imagem, libertando o contexto e os ndices dos directrios (a imagem s deixa de
+// estar mapeada quando for desmontado o ltimo contexto que a partilha)
+void fs_unmount(vfs_t *fs) {
+  int i;
+
+  for (i = 0; i < INDEX_TABLE_SIZE; i++)
+    while (fs->indexes[i] != NULL)
+      drop_index(fs, fs->indexes[i]->dir_block);
+  free(fs->path);
+  free(fs->dentries);
+
+  // o grupo aberto  confirmado mesmo que outros clones continuem montados
+  journal_commit(fs);
+  if (fs->tlb_fd != -1)
+    close(fs->tlb_fd);
+  if (--(*fs->mounts) == 0)
+  {
+    journal_close(fs);
+    munmap(fs->sb, fs->size);
+    close(fs->fd);
+    free(fs->mounts);
+    free(fs->name);
+  }
+  free(fs);
+  return;
+}
+
+
+// mapeia os size bytes da imagem aberta em fd a partir de um endereo alinhado s pginas grandes, para
+// que possam ser usadas se forem pedidas com fs_set_hugepages; devolve MAP_FAILED se no conseguir
+void *map_image(int fd, off_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE), reserved = size + HUGE_PAGE_SIZE;
+  size_t mapped = (size + page_size - 1) / page_size * page_size;
+  char *area, *start;
+
+  if (size < HUGE_PAGE_SIZE)
+    return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  // reserva espao a mais e mapeia a imagem no primeiro endereo alinhado, largando o resto
+  if ((area = (char *) mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED)
+    return MAP_FAILED;
+  start = (char *) (((unsigned long) area + HUGE_PAGE_SIZE - 1) & ~((unsigned long) HUGE_PAGE_SIZE - 1));
+  if (mmap(start, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    munmap(area, reserved);
+    return MAP_FAILED;
+  }
+  if (start > area)
+    munmap(area, start - area);
+  if (area + reserved > start + mapped)
+    munmap(start + mapped, area + reserved - start - mapped);
+
+  return start;
+}
+
+
+void init_superblock(vfs_t *fs, int block_size, int fat_type) {
+  fs->sb->check_number = CHECK_NUMBER;
+  fs->sb->block_size = block_size;
+  fs->sb->fat_type = fat_type;
+  fs->sb->root_block = 0;
+  fs->sb->free_block = 1;
+  fs->sb->n_free_blocks = FAT_ENTRIES(fat_type) - 1;
+  fs->sb->version = FS_VERSION;
+  fs->sb->high_water = 1;
+  return;
+}
+
+
+// calcula, a partir do superblock, os apontadores para as regies do sistema de ficheiros
+void init_regions(vfs_t *fs) {
+  fs->fat = (unsigned char *) ((unsigned long int) fs->sb + fs->sb->block_size);
+  fs->fat_bits = FAT_BITS(fs->sb->fat_type);
+  fs->bitmap = (unsigned long long *) ((unsigned long int) fs->fat + FAT_SIZE(fs->sb->fat_type));
+  fs->refs = (unsigned short *) ((unsigned long int) fs->bitmap + BITMAP_SIZE(fs->sb->fat_type));
+  fs->blocks = (char *) ((unsigned long int) fs->refs + REFS_SIZE(fs->sb->fat_type));
+  return;
+}
+
+
+// converte uma imagem de uma verso anterior  3 (a converso para a 4  feita por quem repe o dirio) com
+// LOCK_UPGRADE, para que dois processos que a montem ao mesmo tempo no a convertam os dois: a imagem 
+// outra vez lida depois de o ter, porque outro processo a pode ter convertido entretanto (e upgrade_fat
+// substitui o ficheiro, cujo bloqueio tem de ser pedido outra vez); devolve 0 ou o erro, com a imagem
+// desmapeada
+int upgrade_image(vfs_t *fs, char *filesystem_name) {
+  int res = 0, reloaded;
+
+  while (res == 0)
+  {
+    image_lock(fs, LOCK_UPGRADE, F_WRLCK, F_OFD_SETLKW);
+    if ((reloaded = reload_image(fs, filesystem_name)) == -1)
+      return ERR_IO;
+    if (reloaded)
+      continue;
+    if (fs->sb->check_number != CHECK_NUMBER || !VALID_BLOCK_SIZE(fs->sb->block_size) || !VALID_FAT_TYPE(fs->sb->fat_type))
+      break;
+
+    // as imagens do programa original (sem mapa nem referncias, com a FAT de um int por entrada) passam a
+    // outro ficheiro, cujo bloqueio  pedido na volta seguinte
+    if (fs->sb->version == 0 && fs->size == OLD_FILESYSTEM_SIZE(fs->sb->block_size, fs->sb->fat_type))
+    {
+      res = upgrade_fat(fs, filesystem_name);
+      continue;
+    }
+
+    // as imagens da verso 1 no guardam o primeiro bloco nunca utilizado: considera-se que todos j o foram
+    if (fs->sb->version == 1)
+    {
+      fs->sb->high_water = FAT_ENTRIES(fs->sb->fat_type);
+      fs->sb->version = 2;
+    }
+
+    // as imagens da verso 2 no tm dirio:  acrescentado no fim (e os directrios so ordenados depois
+    // de repor o dirio, como nas imagens da verso 3)
+    if (fs->sb->version == 2 && fs->size == FILESYSTEM_SIZE(fs->sb->block_size, fs->sb->fat_type)
+        && upgrade_journal(fs) == -1)
+      return ERR_IO;
+    break;
+  }
+  if (res != 0)
+    return res;
+  image_lock(fs, LOCK_UPGRADE, F_UNLCK, F_OFD_SETLKW);
+
+  return 0;
+}
+
+// depois de esperar por LOCK_UPGRADE: se o ficheiro filesystem_name j no  o que est aberto (upgrade_fat
+// de outro processo substituiu-o) abre o novo, e se o tamanho mudou (upgrade_journal) volta a mape-lo;
+// devolve 1 se abriu o novo ficheiro (sem bloqueios), 0 ou -1 (com a imagem desmapeada)
+int reload_image(vfs_t *fs, char *filesystem_name) {
+  struct stat image, path;
+
+  if (fstat(fs->fd, &image) == -1 || stat(filesystem_name, &path) == -1)
+  {
+    munmap(fs->sb, fs->size);
+    return -1;
+  }
+  if (image.st_dev == path.st_dev && image.st_ino == path.st_ino && image.st_size == fs->size)
+    return 0;
+
+  int reopened = image.st_dev != path.st_dev || image.st_ino != path.st_ino;
+  munmap(fs->sb, fs->size);
+  if (reopened)
+  {
+    close(fs->fd);
+    if ((fs->fd = open(filesystem_name, O_RDWR)) == -1 || fstat(fs->fd, &image) == -1)
+      return -1;
+  }
+  fs->size = image.st_size;
+  if (fs->size < (off_t) sizeof(superblock) || (fs->sb = (superblock *) map_image(fs->fd, fs->size)) == MAP_FAILED)
+    return -1;
+
+  return reopened;
+}
+
+
+// converte uma imagem da verso 0, de fs->size bytes, para a verso 1: o mapa dos blocos e as referncias
+// so calculados a partir das cadeias da rvore (a lista dos blocos livres no  usada), as entradas dos
+// directrios passam de 32 para 40 bytes e a FAT  compactada; cada cadeia s fica com os blocos que o
+// nmero de entradas ou o tamanho do ficheiro pedem (o programa original deixava na cadeia de um
+// directrio o ltimo bloco depois de o libertar), e um ficheiro vazio fica sem blocos. A nova imagem 
+// escrita num ficheiro temporrio que s substitui filesystem_name (com rename) depois de estar no disco,
+// para que uma falha a meio deixe a imagem antiga intacta; fs passa a usar o descritor da nova. Devolve 0,
+// ERR_FULL se os directrios no couberem com as entradas maiores ou ERR_IO se no conseguir escrever a
+// nova imagem (em ambos os casos a imagem antiga no  alterada e fica desmapeada)
+int upgrade_fat(vfs_t *fs, char *filesystem_name) {
+  superblock *sb = fs->sb;
+  int n_blocks = FAT_ENTRIES(sb->fat_type), block_size = sb->block_size;
+  int old_per_block = block_size / sizeof(old_dir_entry), per_block = DIR_ENTRIES_PER_BLOCK;
+  char *old_image = (char *) sb;
+  int *old_fat = (int *) ((unsigned long int) sb + block_size);
+  char *old_blocks = (char *) old_fat + OLD_FAT_SIZE(sb->fat_type);
+  int *next = (int *) malloc(n_blocks * sizeof(int));
+  unsigned char *used = (unsigned char *) calloc(n_blocks, 1);
+  old_dir *dirs = (old_dir *) malloc(sizeof(old_dir));
+  int n_dirs = 1, dirs_size = 1, free_block = 0, res = 0, d, i, k;
+
+  for (i = 0; i < n_blocks; i++)
+    next[i] = -1;
+  used[sb->root_block] = 1;
+  dirs[0].chain = (int *) malloc(sizeof(int));
+  dirs[0].chain[0] = sb->root_block;
+
+  // l os directrios pela ordem em que so encontrados (dirs serve tambm de fila)
+  for (d = 0; d < n_dirs; d++)
+  {
+    old_dir_entry *old = (old_dir_entry *) (old_blocks + (size_t) dirs[d].chain[0] * block_size);
+    int n = old[0].size < 2 ? 2 : old[0].size > n_blocks * old_per_block ? n_blocks * old_per_block : old[0].size;
+    int n_old = (n + old_per_block - 1) / old_per_block, n_chain, m = 0;
+    int *chain = (int *) malloc(n_old * sizeof(int));
+    dir_entry *entries = (dir_entry *) calloc(n, sizeof(dir_entry));
+
+    chain[0] = dirs[d].chain[0];
+    for (k = 1; k < n_old; k++)
+    {
+      int block = old_fat[chain[k - 1]];
+      if (block <= 0 || block >= n_blocks || used[block])
+        break;
+      used[block] = 1;
+      chain[k] = block;
+    }
+    n_chain = k;
+    if (n > n_chain * old_per_block)
+      n = n_chain * old_per_block;
+    free(dirs[d].chain);
+
+    for (i = 0; i < n; i++)
+    {
+      old = (old_dir_entry *) (old_blocks + (size_t) chain[i / old_per_block] * block_size) + i % old_per_block;
+      dir_entry *entry = &entries[m];
+      entry->type = old->type;
+      snprintf(entry->name, MAX_NAME_LENGHT, "%.*s", MAX_NAME_LENGHT - 1, old->name);
+      entry->day = old->day;
+      entry->month = old->month;
+      entry->year = old->year;
+      entry->size = old->size;
+      entry->first_block = old->first_block;
+      if (i < 2)
+      {
+        m++;
+        continue;
+      }
+
+      int block = entry->first_block, prev = -1;
+      if (block < 0 || block >= n_blocks || used[block] || (entry->type != TYPE_DIR && entry->type != TYPE_FILE))
+      {
+        // uma entrada que aponta para fora da imagem ou para blocos de outra cadeia perde-se, e um
+        // ficheiro vazio (que no programa original tinha sempre um bloco) fica sem blocos
+        if (entry->type != TYPE_FILE || entry->size > 0)
+          continue;
+        entry->first_block = -1;
+      }
+      else if (entry->type == TYPE_DIR)
+      {
+        used[block] = 1;
+        if (n_dirs == dirs_size)
+        {
+          dirs_size *= 2;
+          dirs = (old_dir *) realloc(dirs, dirs_size * sizeof(old_dir));
+        }
+        dirs[n_dirs].chain = (int *) malloc(sizeof(int));
+        dirs[n_dirs++].chain[0] = block;
+        entry->size = 0;
+      }
+      else if (entry->size <= 0)
+      {
+        entry->size = 0;
+        entry->first_block = -1;
+      }
+      else
+      {
+        for (k = 0; k < (entry->size + block_size - 1) / block_size; k++)
+        {
+          if (block <= 0 || block >= n_blocks || used[block])
+          {
+            entry->size = (long long) k * block_size;
+            break;
+          }
+          used[block] = 1;
+          if (prev != -1)
+            next[prev] = block;
+          prev = block;
+          block = old_fat[block];
+        }
+      }
+      m++;
+    }
+
+    entries[0].size = m;
+    dirs[d].entries = entries;
+    dirs[d].n_entries = m;
+    dirs[d].chain = chain;
+    dirs[d].n_chain = n_chain;
+  }
+
+  // as entradas maiores podem precisar de mais blocos (e as que se perderam de menos)
+  for (d = 0; d < n_dirs && res == 0; d++)
+  {
+    int need = (dirs[d].n_entries + per_block - 1) / per_block;
+    for (k = need; k < dirs[d].n_chain; k++)
+      used[dirs[d].chain[k]] = 0;
+    if (need > dirs[d].n_chain)
+      dirs[d].chain = (int *) realloc(dirs[d].chain, need * sizeof(int));
+    for (k = dirs[d].n_chain; k < need; k++)
+    {
+      while (free_block < n_blocks && used[free_block])
+        free_block++;
+      if (free_block == n_blocks)
+      {
+        res = ERR_FULL;
+        break;
+      }
+      used[free_block] = 1;
+      dirs[d].chain[k] = free_block;
+    }
+    dirs[d].n_chain = need;
+  }
+
+  // a nova imagem (com os metadados a zeros, que se lem como blocos livres e fins de cadeia) fica em
+  // NOME.upgrade, com as mesmas permisses
+  off_t new_size = FILESYSTEM_SIZE(block_size, sb->fat_type);
+  size_t name_len = strlen(filesystem_name);
+  char *tmp_name = (char *) malloc(name_len + sizeof(".upgrade"));
+  superblock *new_sb = (superblock *) MAP_FAILED;
+  struct stat buf;
+  int new_fd = -1;
+
+  sprintf(tmp_name, "%s.upgrade", filesystem_name);
+  if (res == 0 && (fstat(fs->fd, &buf) == -1 || (new_fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, buf.st_mode & 0777)) == -1
+                   || ftruncate(new_fd, new_size) == -1 || (new_sb = (superblock *) map_image(new_fd, new_size)) == MAP_FAILED))
+    res = ERR_IO;
+
+  if (res == 0)
+  {
+    memcpy(new_sb, sb, sizeof(superblock));
+    sb = fs->sb = new_sb;
+    sb->n_walks = 0;
+    init_regions(fs);
+    memcpy(fs->blocks, old_blocks, (size_t) n_blocks * block_size);
+
+    sb->n_free_blocks = n_blocks;
+    for (i = 0; i < n_blocks; i++)
+      if (used[i])
+      {
+        fs->bitmap[i / 64] |= 1ULL << (i % 64);
+        fs->refs[i] = 1;
+        fat_set(fs, i, next[i]);
+        sb->n_free_blocks--;
+      }
+
+    // cada bloco de um directrio fica cheio, excepto o ltimo, e as entradas so ordenadas depois
+    // (com as imagens da verso 3, em upgrade_dirs)
+    for (d = 0; d < n_dirs; d++)
+    {
+      dirs[d].entries[1].size = dirs[d].chain[dirs[d].n_chain - 1];
+      for (k = 0; k < dirs[d].n_chain; k++)
+      {
+        int n = dirs[d].n_entries - k * per_block < per_block ? dirs[d].n_entries - k * per_block : per_block;
+        memset(BLOCK(dirs[d].chain[k]), 0, block_size);
+        memcpy(BLOCK(dirs[d].chain[k]), &dirs[d].entries[k * per_block], n * sizeof(dir_entry));
+        if (k > 0)
+          fat_set(fs, dirs[d].chain[k - 1], dirs[d].chain[k]);
+      }
+    }
+    sb->free_block = 0;
+    sb->version = 1;
+  }
+
+  for (d = 0; d < n_dirs; d++)
+  {
+    free(dirs[d].entries);
+    free(dirs[d].chain);
+  }
+  free(dirs);
+  free(used);
+  free(next);
+
+  munmap(old_image, fs->size);
+  if (res == 0 && (msync(new_sb, new_size, MS_SYNC) == -1 || fsync(new_fd) == -1 || replace_image(tmp_name, filesystem_name) == -1))
+    res = ERR_IO;
+  if (res != 0)
+  {
+    if (new_sb != MAP_FAILED)
+      munmap(new_sb, new_size);
+    if (new_fd != -1)
+    {
+      close(new_fd);
+      unlink(tmp_name);
+    }
+    free(tmp_name);
+    return res;
+  }
+  free(tmp_name);
+
+  close(fs->fd);
+  fs->fd = new_fd;
+  fs->size = new_size;
+  return 0;
+}
+
+// muda o nome do ficheiro tmp_name para name, substituindo-o, e sincroniza o directrio que os contm para
+// que a substituio fique no disco; devolve 0 ou -1
+int replace_image(char *tmp_name, char *name) {
+  char *slash = strrchr(name, '/');
+  char *dir_name = slash == NULL ? strdup(".") : slash == name ? strdup("/") : strndup(name, slash - name);
+  int dir_fd, res = rename(tmp_name, name);
+
+  if (res == 0 && (dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY)) != -1)
+  {
+    res = fsync(dir_fd);
+    close(dir_fd);
+  }
+  free(dir_name);
+
+  return res;
+}
+
+
+void init_fat(vfs_t *fs) {
+  // s o bloco 0 (directrio raiz) est ocupado; o resto da imagem acabou de ser criado
+  // com ftruncate e l-se como zeros (blocos livres, sem referncias e fins de cadeia)
+  fs->bitmap[0] = 1;
+  fs->refs[0] = 1;
+  fat_set(fs, 0, -1);
+  return;
+}
+
+
+void init_journal(vfs_t *fs) {
+  journal_header *header = JOURNAL_HEADER;
+
+  header->magic = JOURNAL_MAGIC;
+  header->first_seq = 1;
+  header->next_seq = 1;
+  header->tail = JOURNAL_START;
+  return;
+}
+
+
+// acrescenta o dirio (vazio) ao fim de uma imagem da verso 2
+// (devolve -1 se no conseguir voltar a mapear a imagem, que fica desmapeada)
+int upgrade_journal(vfs_t *fs) {
+  off_t new_size = IMAGE_SIZE(fs->sb->block_size, fs->sb->fat_type);
+
+  munmap(fs->sb, fs->size);
+  fs->size = new_size;
+  if (ftruncate(fs->fd, new_size) == -1 || (fs->sb = (superblock *) map_image(fs->fd, new_size)) == MAP_FAILED)
+    return -1;
+  init_journal(fs);
+  fs->sb->version = 3;
+  return 0;
+}
+
+
+int dir_entry_cmp(const void *a, const void *b) {
+  return strncmp(((const dir_entry *) a)->name, ((const dir_entry *) b)->name, MAX_NAME_LENGHT);
+}
+
+// ordena pelo nome as entradas de todos os directrios de uma imagem da verso 3, em que ficavam pela
+// ordem em que foram acrescentadas, com todos os blocos cheios excepto o ltimo; as posies livres do
+// ltimo bloco de cada directrio ficam a zeros (a converso pode ser repetida se for interrompida)
+void upgrade_dirs(vfs_t *fs) {
+  int per_block = DIR_ENTRIES_PER_BLOCK, n_stack = 1, stack_size = 64, size = 0, i;
+  int *stack = (int *) malloc(stack_size * sizeof(int));
+  dir_entry *entries = NULL;
+
+  stack[0] = fs->sb->root_block;
+  while (n_stack > 0)
+  {
+    int dir_block = stack[--n_stack], cur_block = dir_block;
+    int n_entries = ((dir_entry *) BLOCK(dir_block))[0].size;
+
+    if (n_entries > size)
+    {
+      size = n_entries;
+      entries = (dir_entry *) realloc(entries, size * sizeof(dir_entry));
+    }
+    for (i = 2; i < n_entries; i++)
+    {
+      if (i % per_block == 0)
+        cur_block = fat_get(fs, cur_block);
+      entries[i] = ((dir_entry *) BLOCK(cur_block))[i % per_block];
+      if (entries[i].type != TYPE_DIR)
+        continue;
+      if (n_stack == stack_size)
+      {
+        stack_size *= 2;
+        stack = (int *) realloc(stack, stack_size * sizeof(int));
+      }
+      stack[n_stack++] = entries[i].first_block;
+    }
+    if (n_entries > 2)
+      qsort(entries + 2, n_entries - 2, sizeof(dir_entry), dir_entry_cmp);
+
+    cur_block = dir_block;
+    for (i = 2; i < n_entries; i++)
+    {
+      if (i % per_block == 0)
+        cur_block = fat_get(fs, cur_block);
+      ((dir_entry *) BLOCK(cur_block))[i % per_block] = entries[i];
+    }
+    if (n_entries % per_block != 0)
+      memset(&((dir_entry *) BLOCK(cur_block))[n_entries % per_block], 0, (per_block - n_entries % per_block) * sizeof(dir_entry));
+    (*DIR_GENERATION(dir_block))++;
+  }
+  free(stack);
+  free(entries);
+
+  fs->sb->version = FS_VERSION;
+  msync(fs->sb, fs->size, MS_SYNC);
+
+  return;
+}
+
+
+void init_dir_block(vfs_t *fs, int block, int parent_block) {
+  dir_entry *dir = (dir_entry *) BLOCK(block);
+  unsigned int generation = *DIR_GENERATION(block);
+
+  // o nmero de entradas no directrio (inicialmente 2) fica guardado no campo size da entrada "."
+  // e o ltimo bloco da cadeia do directrio no campo size da entrada ".."
+  journal_mark(fs, dir, fs->sb->block_size);
+  memset(dir, 0, fs->sb->block_size);
+  init_dir_entry(&dir[0], TYPE_DIR, ".", 2, block);
+  init_dir_entry(&dir[1], TYPE_DIR, "..", block, parent_block);
+  // um ndice de um directrio que ocupou antes o mesmo bloco fica obsoleto
+  *DIR_GENERATION(block) = generation + 1;
+  return;
+}
+
+
+void init_dir_entry(dir_entry *dir, char type, char *name, long long size, int first_block) {
+  time_t cur_time = time(NULL);
+  struct tm cur_tm;
+
+  // as threads de fs_copy_tree criam entradas ao mesmo tempo
+  localtime_r(&cur_time, &cur_tm);
+  dir->type = type;
+  strcpy(dir->name, name);
+  dir->day = cur_tm.tm_mday;
+  dir->month = cur_tm.tm_mon + 1;
+  dir->year = cur_tm.tm_year;
+  dir->size = size;
+  dir->first_block = first_block;
+  return;
+}
+
+
+// verifica se name pode ser o nome de uma nova entrada (o nome guardado tem de terminar em '\0')
+int valid_name(char *name) {
+  size_t len = strlen(name);
+
+  return len > 0 && len < MAX_NAME_LENGHT && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// inicia, vazios, o caminho do directrio corrente (a raiz) e a cache de entradas do contexto
+void init_path_cache(vfs_t *fs) {
+  int i;
+
+  fs->path = NULL;
+  fs->depth = 0;
+  fs->path_size = 0;
+  fs->dentries = (dentry *) malloc(DENTRY_CACHE_SIZE * sizeof(dentry));
+  for (i = 0; i < DENTRY_CACHE_SIZE; i++)
+    fs->dentries[i].dir_block = -1;
+
+  return;
+}
+
+// l a entrada n da FAT (o fim de cadeia, -1,  guardado como 0, j que o bloco 0 nunca tem antecessor)
+static inline int fat_get(vfs_t *fs, int n) {
+  unsigned char *entry;
+  int value;
+
+  switch (fs->fat_bits)
+  {
+    case 8:
+      value = fs->fat[n];
+      break;
+    case 12:
+      entry = fs->fat + n + n / 2;
+      value = (entry[0] | entry[1] << 8) >> ((n & 1) << 2) & 0xfff;
+      break;
+    case 16:
+      value = ((unsigned short *) fs->fat)[n];
+      break;
+    default:
+      value = ((int *) fs->fat)[n];
+  }
+  COUNT(fat_hops, 1);
+
+  return value == 0 ? -1 : value;
+}
+
+// escreve value na entrada n da FAT
+static inline void fat_set(vfs_t *fs, int n, int value) {
+  unsigned char *entry;
+
+  if (value == -1)
+    value = 0;
+
+  switch (fs->fat_bits)
+  {
+    case 8:
+      journal_mark(fs, &fs->fat[n], 1);
+      fs->fat[n] = value;
+      break;
+    case 12:
+      // cada entrada partilha meio byte com a vizinha, que pode estar a ser escrita por outro
+      // contexto: esse byte  alterado com operaes atmicas que s mexem na metade da entrada
+      entry = fs->fat + n + n / 2;
+      journal_mark(fs, entry, 2);
+      if (n & 1)
+      {
+        __atomic_fetch_and(&entry[0], 0x0f, __ATOMIC_RELAXED);
+        __atomic_fetch_or(&entry[0], (value & 0x0f) << 4, __ATOMIC_RELAXED);
+        entry[1] = value >> 4;
+      }
+      else
+      {
+        entry[0] = value & 0xff;
+        __atomic_fetch_and(&entry[1], 0xf0, __ATOMIC_RELAXED);
+        __atomic_fetch_or(&entry[1], value >> 8, __ATOMIC_RELAXED);
+      }
+      break;
+    case 16:
+      journal_mark(fs, &((unsigned short *) fs->fat)[n], 2);
+      ((unsigned short *) fs->fat)[n] = value;
+      break;
+    default:
+      journal_mark(fs, &((int *) fs->fat)[n], 4);
+      ((int *) fs->fat)[n] = value;
+  }
+
+  return;
+}
+
+// blocos da palavra word do mapa libertados num grupo que ainda no est no disco: no podem ser
+// reutilizados antes disso, porque se a imagem falhar as imagens anteriores devolvem-nos ao ficheiro
+// (ou directrio) de onde foram libertados, que ficaria com o contedo do novo dono
+static inline unsigned long long freed_word(vfs_t *fs, int word) {
+  journal *j = fs->journal;
+
+  if (j == NULL)
+    return 0;
+  return __atomic_load_n(&j->freed[0][word], __ATOMIC_ACQUIRE) | __atomic_load_n(&j->freed[1][word], __ATOMIC_ACQUIRE);
+}
+
+// blocos da palavra word do mapa que no podem ser alocados: ocupados ou libertados num grupo que ainda
+// no est no disco
+static inline unsigned long long taken_word(vfs_t *fs, int word) {
+  return __atomic_load_n(&fs->bitmap[word], __ATOMIC_RELAXED) | freed_word(fs, word);
+}
+
+// procura, a partir de sb->free_block, uma sequncia de want blocos livres contguos (sem os libertados
+// num grupo que ainda no est no disco); devolve o incio da primeira sequncia suficiente (ou da maior
+// encontrada) e o seu tamanho em len
+int find_free_extent(vfs_t *fs, int want, int *len) {
+  int n_blocks = FAT_ENTRIES(fs->sb->fat_type);
+  int block = __atomic_load_n(&fs->sb->free_block, __ATOMIC_RELAXED) % n_blocks, scanned = 0;
+  int best = -1, best_len = 0;
+
+  while (scanned < n_blocks && best_len < want)
+  {
+    if (block == n_blocks)
+      block = 0;
+
+    unsigned long long taken = taken_word(fs, block / 64);
+    if (block % 64 == 0 && taken == ~0ULL)
+    {
+      // palavra do mapa totalmente ocupada
+      block += 64;
+      scanned += 64;
+      continue;
+    }
+
+    if ((taken >> (block % 64)) & 1)
+    {
+      block++;
+      scanned++;
+      continue;
+    }
+
+    int start = block, run = 0;
+    while (block < n_blocks && run < want && !((taken >> (block % 64)) & 1))
+    {
+      if (block % 64 == 0 && taken == 0 && run + 64 <= want)
+      {
+        block += 64;
+        run += 64;
+      }
+      else
+      {
+        block++;
+        run++;
+      }
+      if (block % 64 == 0 && block < n_blocks)
+        taken = taken_word(fs, block / 64);
+    }
+    scanned += run;
+
+    if (run > best_len)
+    {
+      best = start;
+      best_len = run;
+    }
+  }
+
+  *len = best_len;
+  return best;
+}
+
+// reserva n blocos livres (descontando-os de sb->n_free_blocks), para que a alocao que se segue no
+// falhe mesmo com outros contextos a alocar ao mesmo tempo; os blocos libertados num grupo que ainda no
+// est no disco no contam (s ficam disponveis depois da confirmao); devolve 0 se no houver espao
+int reserve_blocks(vfs_t *fs, int n) {
+  journal *j = fs->journal;
+  int n_free = __atomic_load_n(&fs->sb->n_free_blocks, __ATOMIC_RELAXED), n_freed = 0;
+
+  if (j != NULL)
+    n_freed = __atomic_load_n(&j->shared->n_freed[0], __ATOMIC_RELAXED) + __atomic_load_n(&j->shared->n_freed[1], __ATOMIC_RELAXED);
+  if (n_free - n_freed < n)
+    return 0;
+  journal_mark(fs, fs->sb, sizeof(superblock));
+  do
+  {
+    if (j != NULL)
+      n_freed = __atomic_load_n(&j->shared->n_freed[0], __ATOMIC_RELAXED) + __atomic_load_n(&j->shared->n_freed[1], __ATOMIC_RELAXED);
+    if (n_free - n_freed < n)
+      return 0;
+  }
+  while (!__atomic_compare_exchange_n(&fs->sb->n_free_blocks, &n_free, n_free - n, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  return 1;
+}
+
+// devolve ao espao livre n blocos reservados que no chegaram a ser usados
+void unreserve_blocks(vfs_t *fs, int n) {
+  if (n > 0)
+  {
+    journal_mark(fs, fs->sb, sizeof(superblock));
+    __atomic_add_fetch(&fs->sb->n_free_blocks, n, __ATOMIC_ACQ_REL);
+  }
+
+  return;
+}
+
+// marca block como ocupado no mapa; devolve 0 se outro contexto o ocupou primeiro (ou o ocupou e libertou
+// entretanto, no grupo aberto)
+static inline int claim_block(vfs_t *fs, int block) {
+  unsigned long long bit = 1ULL << (block % 64);
+
+  journal_mark(fs, &fs->bitmap[block / 64], sizeof(unsigned long long));
+  if (__atomic_fetch_or(&fs->bitmap[block / 64], bit, __ATOMIC_ACQ_REL) & bit)
+    return 0;
+  if (freed_word(fs, block / 64) & bit)
+  {
+    __atomic_fetch_and(&fs->bitmap[block / 64], ~bit, __ATOMIC_ACQ_REL);
+    return 0;
+  }
+
+  return 1;
+}
+
+// aloca uma cadeia de n blocos j reservados, formada pelo menor nmero possvel de sequncias
+// contguas; devolve o primeiro bloco da cadeia
+int get_free_chain(vfs_t *fs, int n) {
+  superblock *sb = fs->sb;
+  int n_blocks = FAT_ENTRIES(sb->fat_type);
+  int first_block = -1, last_block = -1, len, i;
+
+  COUNT(blocks_allocated, n);
+  if (n > 0)
+    journal_mark(fs, sb, sizeof(superblock));
+  while (n > 0)
+  {
+    int start, high_water = __atomic_load_n(&sb->high_water, __ATOMIC_RELAXED);
+
+    if (high_water < n_blocks)
+    {
+      // enquanto houver blocos nunca utilizados, so esses os atribudos
+      len = n_blocks - high_water < n ? n_blocks - high_water : n;
+      if (!__atomic_compare_exchange_n(&sb->high_water, &high_water, high_water + len, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        continue;
+      start = high_water;
+    }
+    else if ((start = find_free_extent(fs, n, &len)) == -1)
+      continue;
+
+    // os blocos da sequncia que esto na mesma palavra do mapa so ocupados com uma s operao
+    // atmica: os que outro contexto ocupou entretanto so saltados
+    for (i = start; i < start + len && n > 0; )
+    {
+      int end = (i / 64 + 1) * 64 < start + len ? (i / 64 + 1) * 64 : start + len, k;
+      if (end - i > n)
+        end = i + n;
+      unsigned long long mask = (end - i == 64 ? ~0ULL : (1ULL << (end - i)) - 1) << (i % 64);
+      mask &= ~freed_word(fs, i / 64);
+      journal_mark(fs, &fs->bitmap[i / 64], sizeof(unsigned long long));
+      unsigned long long got = ~__atomic_fetch_or(&fs->bitmap[i / 64], mask, __ATOMIC_ACQ_REL) & mask;
+      // um bloco que outro contexto ocupou e voltou a libertar depois de find_free_extent  devolvido
+      unsigned long long late = got & freed_word(fs, i / 64);
+      if (late != 0)
+      {
+        __atomic_fetch_and(&fs->bitmap[i / 64], ~late, __ATOMIC_ACQ_REL);
+        got &= ~late;
+      }
+
+      for (k = i; k < end; k++)
+      {
+        if (!((got >> (k % 64)) & 1))
+          continue;
+
+        journal_mark(fs, &fs->refs[k], sizeof(unsigned short));
+        __atomic_store_n(&fs->refs[k], 1, __ATOMIC_RELAXED);
+        fat_set(fs, k, -1);
+        if (last_block == -1)
+          first_block = k;
+        else
+          fat_set(fs, last_block, k);
+        last_block = k;
+        n--;
+      }
+      i = end;
+    }
+
+    __atomic_store_n(&sb->free_block, i, __ATOMIC_RELAXED);
+  }
+
+  return first_block;
+}
+
+// aloca um bloco j reservado
+int get_free_block(vfs_t *fs) {
+  return get_free_chain(fs, 1);
+}
+
+// aloca uma cadeia de n blocos j reservados numa s sequncia contgua, a comear em hint se esses
+// blocos estiverem livres (ou na primeira sequncia suficiente a partir de sb->free_block); devolve o
+// primeiro bloco da cadeia, ou -1 se no houver nenhuma sequncia livre com n blocos
+int get_free_extent(vfs_t *fs, int n, int hint) {
+  superblock *sb = fs->sb;
+  int n_blocks = FAT_ENTRIES(sb->fat_type), start = hint, len = 0, i;
+
+  if (hint >= 0 && hint + n <= n_blocks)
+    while (len < n && !((taken_word(fs, (hint + len) / 64) >> ((hint + len) % 64)) & 1))
+      len++;
+  if (len < n && ((start = find_free_extent(fs, n, &len)) == -1 || len < n))
+    return -1;
+
+  for (i = start; i < start + n; i++)
+    if (!claim_block(fs, i))
+    {
+      // outro contexto ocupou entretanto um dos blocos
+      while (--i >= start)
+        __atomic_fetch_and(&fs->bitmap[i / 64], ~(1ULL << (i % 64)), __ATOMIC_ACQ_REL);
+      return -1;
+    }
+
+  // a sequncia pode estar (em parte) para l do primeiro bloco nunca utilizado
+  int high_water = __atomic_load_n(&sb->high_water, __ATOMIC_RELAXED);
+  journal_mark(fs, sb, sizeof(superblock));
+  while (high_water < start + n && !__atomic_compare_exchange_n(&sb->high_water, &high_water, start + n, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  journal_mark(fs, &fs->refs[start], n * sizeof(unsigned short));
+  for (i = start; i < start + n; i++)
+  {
+    __atomic_store_n(&fs->refs[i], 1, __ATOMIC_RELAXED);
+    fat_set(fs, i, i + 1 < start + n ? i + 1 : -1);
+  }
+  COUNT(blocks_allocated, n);
+
+  return start;
+}
+
+void delete_block(vfs_t *fs, int block) {
+  journal_mark(fs, &fs->refs[block], sizeof(unsigned short));
+  __atomic_store_n(&fs->refs[block], 0, __ATOMIC_RELAXED);
+  fat_set(fs, block, -1);
+  journal_mark(fs, &fs->bitmap[block / 64], sizeof(unsigned long long));
+  mark_freed(fs, block / 64, 1ULL << (block % 64));
+  __atomic_fetch_and(&fs->bitmap[block / 64], ~(1ULL << (block % 64)), __ATOMIC_ACQ_REL);
+  COUNT(blocks_freed, 1);
+
+  unreserve_blocks(fs, 1);
+
+  return;
+}
+
+// liberta todos os blocos da cadeia que comea em block
+void delete_chain(vfs_t *fs, int block) {
+  free_batch batch = {-1, 0, 0};
+  int next_block;
+
+  while (block != -1)
+  {
+    next_block = fat_get(fs, block);
+    batch_free(fs, &batch, block);
+    block = next_block;
+  }
+  batch_flush(fs, &batch);
+
+  return;
+}
+
+// liberta block como delete_block, mas o bit no mapa s  limpo quando os blocos acumulados em batch
+// deixarem de estar na mesma palavra, e a contagem dos blocos livres s  actualizada em batch_flush
+void batch_free(vfs_t *fs, free_batch *batch, int block) {
+  journal_mark(fs, &fs->refs[block], sizeof(unsigned short));
+  __atomic_store_n(&fs->refs[block], 0, __ATOMIC_RELAXED);
+  fat_set(fs, block, -1);
+
+  if (block / 64 != batch->word)
+  {
+    if (batch->bits != 0)
+    {
+      journal_mark(fs, &fs->bitmap[batch->word], sizeof(unsigned long long));
+      mark_freed(fs, batch->word, batch->bits);
+      __atomic_fetch_and(&fs->bitmap[batch->word], ~batch->bits, __ATOMIC_ACQ_REL);
+    }
+    batch->word = block / 64;
+    batch->bits = 0;
+  }
+  batch->bits |= 1ULL << (block % 64);
+  batch->n++;
+
+  return;
+}
+
+// devolve ao espao livre os blocos acumulados em batch
+void batch_flush(vfs_t *fs, free_batch *batch) {
+  if (batch->bits != 0)
+  {
+    journal_mark(fs, &fs->bitmap[batch->word], sizeof(unsigned long long));
+    mark_freed(fs, batch->word, batch->bits);
+    __atomic_fetch_and(&fs->bitmap[batch->word], ~batch->bits, __ATOMIC_ACQ_REL);
+  }
+  unreserve_blocks(fs, batch->n);
+  COUNT(blocks_freed, batch->n);
+  batch->word = -1;
+  batch->bits = 0;
+  batch->n = 0;
+
+  return;
+}
+
+// regista no mapa freed da paridade do grupo aberto os blocos bits da palavra word do mapa, antes de
+// serem libertados (as operaes que os libertam esto sempre a meio, e o grupo no muda at acabarem)
+void mark_freed(vfs_t *fs, int word, unsigned long long bits) {
+  journal *j = fs->journal;
+
+  if (j == NULL || j->window < 0)
+    return;
+  int parity = j->shared->group & 1;
+  __atomic_add_fetch(&j->shared->n_freed[parity], __builtin_popcountll(bits), __ATOMIC_RELAXED);
+  __atomic_fetch_or(&j->freed[parity][word], bits, __ATOMIC_RELEASE);
+
+  return;
+}
+
+// funo de disperso (FNV-1a) sobre o nome de uma entrada
+unsigned int hash_name(char *name) {
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i = 0; i < MAX_NAME_LENGHT && name[i] != '\0'; i++)
+  {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+
+// Comparao dos nomes nas pesquisas dos directrios: o nome de uma entrada (um campo de MAX_NAME_LENGHT
+// bytes, terminado por '\0' se for mais curto)  comparado com a chave procurada como com strncmp, mas com
+// os bytes todos comparados de uma vez; a verso  escolhida ao montar a primeira imagem, conforme o
+// processador. Os dois lados so lidos em NAME_KEY_SIZE bytes: nas entradas os bytes a mais so os campos
+// seguintes, e o nome procurado  copiado antes para uma chave com esse tamanho.
+
+// copia o nome name para key, com NAME_KEY_SIZE bytes
+void name_key(char *key, char *name) {
+  memset(key, 0, NAME_KEY_SIZE);
+  strncpy(key, name, MAX_NAME_LENGHT);
+  return;
+}
+
+// compara o nome de uma entrada com key, byte a byte: a primeira diferena ou o fim do nome decidem
+int name_cmp_scalar(const char *name, const char *key) {
+  int i;
+
+  for (i = 0; i < MAX_NAME_LENGHT; i++)
+    if (name[i] != key[i] || name[i] == '\0')
+      return (unsigned char) name[i] - (unsigned char) key[i];
+
+  return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// name_cmp_scalar com os primeiros 16 bytes comparados numa s instruo SSE2 (os bits de mask marcam
+// os bytes diferentes e os do fim do nome)
+__attribute__((target("sse2"))) int name_cmp_sse2(const char *name, const char *key) {
+  __m128i a = _mm_loadu_si128((const __m128i *) name), b = _mm_loadu_si128((const __m128i *) key);
+  unsigned int mask = (~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) | _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128()))) & 0xffff;
+  int i;
+
+  if (mask != 0)
+  {
+    i = __builtin_ctz(mask);
+    return (unsigned char) name[i] - (unsigned char) key[i];
+  }
+  for (i = 16; i < MAX_NAME_LENGHT; i++)
+    if (name[i] != key[i] || name[i] == '\0')
+      return (unsigned char) name[i] - (unsigned char) key[i];
+
+  return 0;
+}
+
+// name_cmp_scalar com o nome inteiro comparado numa s instruo AVX2
+__attribute__((target("avx2"))) int name_cmp_avx2(const char *name, const char *key) {
+  __m256i a = _mm256_loadu_si256((const __m256i *) name), b = _mm256_loadu_si256((const __m256i *) key);
+  unsigned int mask = (~_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, _mm256_setzero_si256())))
+                      & ((1u << MAX_NAME_LENGHT) - 1);
+
+  if (mask == 0)
+    return 0;
+  int i = __builtin_ctz(mask);
+
+  return (unsigned char) name[i] - (unsigned char) key[i];
+}
+#else
+int name_cmp_sse2(const char *name, const char *key) {
+  return name_cmp_scalar(name, key);
+}
+
+int name_cmp_avx2(const char *name, const char *key) {
+  return name_cmp_scalar(name, key);
+}
+#endif
+
+// escolhe a verso de name_cmp (chamada uma s vez, com pthread_once)
+void select_name_cmp(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    name_cmp = name_cmp_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    name_cmp = name_cmp_sse2;
+#endif
+  return;
+}
+
+// nmero de posies ocupadas no bloco dir de um directrio (as ocupadas vm antes das livres)
+int block_used(dir_entry *dir, int per_block) {
+  int low = 0, high = per_block;
+
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    if (dir[mid].name[0] != '\0')
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+// primeira posio, entre first e used - 1 no bloco dir, com uma entrada de nome igual ou posterior 
+// chave key (used, se no houver nenhuma)
+int block_search(vfs_t *fs, dir_entry *dir, int first, int used, char *key) {
+  int low = first, high = used;
+
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    COUNT(name_compares, 1);
+    if (name_cmp(dir[mid].name, key) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+// posio no ndice do bloco onde est, ou deve ficar, a entrada com a chave key: o ltimo bloco cuja
+// primeira entrada no vem depois dela (o primeiro bloco, que comea com "." e "..", se no houver nenhum)
+int index_block(vfs_t *fs, dir_index *idx, char *key) {
+  int low = 1, high = idx->n_chain;
+
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    COUNT(name_compares, 1);
+    if (name_cmp(((dir_entry *) BLOCK(idx->chain[mid]))[0].name, key) <= 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low - 1;
+}
+
+// devolve o ndice do directrio com primeiro bloco dir_block, ou NULL se ainda no foi construdo;
+// um ndice que outro contexto tornou obsoleto (a gerao do directrio mudou)  descartado
+dir_index *find_index(vfs_t *fs, int dir_block) {
+  dir_index *idx;
+
+  for (idx = fs->indexes[dir_block % INDEX_TABLE_SIZE]; idx != NULL; idx = idx->next)
+    if (idx->dir_block == dir_block)
+    {
+      if (idx->generation == *DIR_GENERATION(dir_block))
+        return idx;
+      drop_index(fs, dir_block);
+      return NULL;
+    }
+
+  return NULL;
+}
+
+// insere o bloco block, com used posies ocupadas, na posio pos dos vectores do ndice
+void index_add_block(dir_index *idx, int pos, int block, int used) {
+  if (idx->n_chain == idx->chain_size)
+  {
+    idx->chain_size *= 2;
+    idx->chain = (int *) realloc(idx->chain, idx->chain_size * sizeof(int));
+    idx->used = (int *) realloc(idx->used, idx->chain_size * sizeof(int));
+  }
+  memmove(&idx->chain[pos + 1], &idx->chain[pos], (idx->n_chain - pos) * sizeof(int));
+  memmove(&idx->used[pos + 1], &idx->used[pos], (idx->n_chain - pos) * sizeof(int));
+  idx->chain[pos] = block;
+  idx->used[pos] = used;
+  idx->n_chain++;
+
+  return;
+}
+
+// devolve o ndice do directrio com primeiro bloco dir_block, construindo-o se necessrio
+dir_index *get_index(vfs_t *fs, int dir_block) {
+  dir_index *idx = find_index(fs, dir_block);
+  int cur_block;
+
+  if (idx != NULL)
+    return idx;
+
+  idx = (dir_index *) malloc(sizeof(dir_index));
+  idx->dir_block = dir_block;
+  idx->n_chain = 0;
+  idx->chain_size = 16;
+  idx->chain = (int *) malloc(idx->chain_size * sizeof(int));
+  idx->used = (int *) malloc(idx->chain_size * sizeof(int));
+  idx->generation = *DIR_GENERATION(dir_block);
+  idx->next = fs->indexes[dir_block % INDEX_TABLE_SIZE];
+  fs->indexes[dir_block % INDEX_TABLE_SIZE] = idx;
+
+  for (cur_block = dir_block; cur_block != -1; cur_block = fat_get(fs, cur_block))
+    index_add_block(idx, idx->n_chain, cur_block, block_used((dir_entry *) BLOCK(cur_block), DIR_ENTRIES_PER_BLOCK));
+
+  return idx;
+}
+
+// liberta o ndice do directrio com primeiro bloco dir_block
+void drop_index(vfs_t *fs, int dir_block) {
+  dir_index **idx = &fs->indexes[dir_block % INDEX_TABLE_SIZE];
+
+  while (*idx != NULL && (*idx)->dir_block != dir_block)
+    idx = &(*idx)->next;
+  if (*idx == NULL)
+    return;
+
+  dir_index *del_idx = *idx;
+  *idx = del_idx->next;
+
+  free(del_idx->chain);
+  free(del_idx->used);
+  free(del_idx);
+
+  return;
+}
+
+// procura a entrada name (do tipo type, ou de qualquer tipo se type == 0) no directrio dir_block
+dir_entry *dir_find(vfs_t *fs, int dir_block, char *name, char type, int *block, int *slot) {
+  char key[NAME_KEY_SIZE];
+  int b = 0, cur_block = dir_block, pos;
+
+  COUNT(dir_lookups, 1);
+  // "." e ".." esto sempre nas duas primeiras posies, fora da ordem das outras entradas
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    pos = name[1] == '.';
+  else
+  {
+    dir_index *idx = get_index(fs, dir_block);
+    name_key(key, name);
+    b = index_block(fs, idx, key);
+    cur_block = idx->chain[b];
+    pos = block_search(fs, (dir_entry *) BLOCK(cur_block), b == 0 ? 2 : 0, idx->used[b], key);
+    if (pos == idx->used[b] || name_cmp(((dir_entry *) BLOCK(cur_block))[pos].name, key) != 0)
+      return NULL;
+  }
+
+  dir_entry *entry = &((dir_entry *) BLOCK(cur_block))[pos];
+  if (type != 0 && entry->type != type)
+    return NULL;
+  if (block != NULL)
+    *block = cur_block;
+  if (slot != NULL)
+    *slot = pos;
+
+  return entry;
+}
+
+// avana block e slot para a entrada seguinte do directrio, pela ordem dos nomes, e devolve-a (ou NULL
+// no fim, com block a -1); com slot a -1 no primeiro bloco comea em ".", e com slot a 1 na primeira
+// entrada depois de ".."
+dir_entry *dir_next(vfs_t *fs, int *block, int *slot) {
+  dir_entry *dir = (dir_entry *) BLOCK(*block);
+
+  if (++*slot < (int) DIR_ENTRIES_PER_BLOCK && dir[*slot].name[0] != '\0')
+    return &dir[*slot];
+  if ((*block = fat_get(fs, *block)) == -1)
+    return NULL;
+  *slot = 0;
+
+  return (dir_entry *) BLOCK(*block);
+}
+
+// verifica se acrescentar a entrada name ao directrio dir_block precisa de mais um bloco (o bloco onde
+// ficaria est cheio), para reservar o espao antes de chamar dir_insert
+int dir_full(vfs_t *fs, int dir_block, char *name) {
+  dir_index *idx = get_index(fs, dir_block);
+  char key[NAME_KEY_SIZE];
+
+  name_key(key, name);
+  return idx->used[index_block(fs, idx, key)] == (int) DIR_ENTRIES_PER_BLOCK;
+}
+
+// acrescenta uma entrada ao directrio dir_block, na posio que mantm os nomes ordenados (o espao livre
+// deve ser verificado antes, com dir_full); um bloco cheio  dividido ao meio, com a segunda metade num
+// bloco novo ligado a seguir, excepto se a entrada fica no fim dele: a vai sozinha para o bloco novo, para
+// que os nomes acrescentados por ordem crescente encham os blocos
+dir_entry *dir_insert(vfs_t *fs, int dir_block, char type, char *name, long long size, int first_block) {
+  dir_entry *dir = (dir_entry *) BLOCK(dir_block);
+  dir_index *idx = get_index(fs, dir_block);
+  char key[NAME_KEY_SIZE];
+
+  name_key(key, name);
+  int per_block = DIR_ENTRIES_PER_BLOCK, b = index_block(fs, idx, key), cur_block = idx->chain[b];
+  dir_entry *entries = (dir_entry *) BLOCK(cur_block);
+  int pos = block_search(fs, entries, b == 0 ? 2 : 0, idx->used[b], key);
+
+  // o primeiro bloco tem o nmero de entradas, o ltimo bloco e a gerao do directrio
+  journal_mark(fs, dir, fs->sb->block_size);
+  journal_mark(fs, entries, fs->sb->block_size);
+  if (idx->used[b] == per_block)
+  {
+    int split = pos == per_block ? per_block : (per_block + (b == 0 ? 2 : 0)) / 2;
+    int new_block = get_free_block(fs);
+    dir_entry *new_entries = (dir_entry *) BLOCK(new_block);
+
+    journal_mark(fs, new_entries, fs->sb->block_size);
+    memset(new_entries, 0, fs->sb->block_size);
+    memcpy(new_entries, &entries[split], (per_block - split) * sizeof(dir_entry));
+    memset(&entries[split], 0, (per_block - split) * sizeof(dir_entry));
+
+    fat_set(fs, new_block, fat_get(fs, cur_block));
+    fat_set(fs, cur_block, new_block);
+    // o ltimo bloco do directrio fica guardado no campo size da entrada ".."
+    if (dir[1].size == cur_block)
+      dir[1].size = new_block;
+    idx->used[b] = split;
+    index_add_block(idx, b + 1, new_block, per_block - split);
+
+    if (pos >= split)
+    {
+      b++;
+      cur_block = new_block;
+      entries = new_entries;
+      pos -= split;
+    }
+  }
+
+  memmove(&entries[pos + 1], &entries[pos], (idx->used[b] - pos) * sizeof(dir_entry));
+  init_dir_entry(&entries[pos], type, name, size, first_block);
+  idx->used[b]++;
+  dir[0].size++;
+  dir_changed(fs, dir_block, idx);
+
+  return &entries[pos];
+}
+
+// remove a entrada na posio slot do bloco block do directrio dir_block, deslocando as seguintes do
+// mesmo bloco; um bloco que fica sem entradas (que no seja o primeiro) sai da cadeia
+void dir_remove(vfs_t *fs, int dir_block, int block, int slot) {
+  dir_entry *dir = (dir_entry *) BLOCK(dir_block), *entries = (dir_entry *) BLOCK(block);
+  dir_index *idx = get_index(fs, dir_block);
+  char key[NAME_KEY_SIZE];
+
+  name_key(key, entries[slot].name);
+  int b = index_block(fs, idx, key), used = idx->used[b];
+
+  journal_mark(fs, dir, fs->sb->block_size);
+  journal_mark(fs, entries, fs->sb->block_size);
+  memmove(&entries[slot], &entries[slot + 1], (used - slot - 1) * sizeof(dir_entry));
+  memset(&entries[used - 1], 0, sizeof(dir_entry));
+  idx->used[b]--;
+
+  if (idx->used[b] == 0)
+  {
+    int prev_block = idx->chain[b - 1];
+    fat_set(fs, prev_block, fat_get(fs, block));
+    delete_block(fs, block);
+    if (dir[1].size == block)
+      dir[1].size = prev_block;
+    idx->n_chain--;
+    memmove(&idx->chain[b], &idx->chain[b + 1], (idx->n_chain - b) * sizeof(int));
+    memmove(&idx->used[b], &idx->used[b + 1], (idx->n_chain - b) * sizeof(int));
+  }
+
+  dir[0].size--;
+  dir_changed(fs, dir_block, idx);
+
+  return;
+}
+
+// muda a gerao do directrio dir_block depois de uma alterao s suas entradas (j reflectida
+// no ndice idx deste contexto, se existir), para que os ndices dos outros contextos sejam refeitos
+void dir_changed(vfs_t *fs, int dir_block, dir_index *idx) {
+  // a gerao est no primeiro bloco, com o nmero de entradas e o ltimo bloco do directrio
+  journal_mark(fs, DIR_GENERATION(dir_block), sizeof(unsigned int));
+  (*DIR_GENERATION(dir_block))++;
+  if (idx != NULL)
+    idx->generation = *DIR_GENERATION(dir_block);
+
+  return;
+}
+
+// l size bytes do ficheiro UNIX finput para a cadeia que comea em block, directamente para a
+// regio dos dados e com uma nica cpia por cada sequncia de blocos contguos
+int read_chain(vfs_t *fs, int finput, int block, long long size) {
+  while (block != -1 && size > 0)
+  {
+    int run = 1;
+    while (fat_get(fs, block + run - 1) == block + run)
+      run++;
+
+    loff_t offset = BLOCK_OFFSET(block);
+    long long len = (long long) run * fs->sb->block_size;
+    if (len > size)
+      len = size;
+    journal_data(fs, BLOCK(block), len);
+
+    while (len > 0)
+    {
+      ssize_t n = -1;
+      if (fs->copy_range_ok)
+      {
+        n = copy_file_range(finput, NULL, fs->fd, &offset, len, 0);
+        if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+          fs->copy_range_ok = 0;
+          continue;
+        }
+      }
+      else if ((n = read(finput, (char *) fs->sb + offset, len)) > 0)
+        offset += n;
+
+      if (n <= 0)
+        return -1;
+      len -= n;
+      size -= n;
+    }
+
+    block = fat_get(fs, block + run - 1);
+  }
+
+  return 0;
+}
+
+// escreve em fd todas as entradas de iov, continuando depois de escritas parciais
+int write_iov(int fd, struct iovec *iov, int n_iov) {
+  while (n_iov > 0)
+  {
+    ssize_t n = writev(fd, iov, n_iov);
+    if (n == -1)
+      return -1;
+
+    while (n_iov > 0 && (size_t) n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      n_iov--;
+    }
+    if (n_iov > 0)
+    {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+// escreve em foutput os size bytes da cadeia que comea em block: cada sequncia de blocos contguos
+//  enviada da imagem com sendfile ou, se o destino no o permitir, junta numa s entrada de writev
+int write_chain(vfs_t *fs, int foutput, int block, long long size) {
+  struct iovec iov[IOV_MAX];
+  int n_iov = 0, use_sendfile = 1, ahead = block, dontneed = size >= DONTNEED_SIZE;
+  long long ahead_left = size;  // bytes da cadeia que ainda no foram pedidos ao kernel
+
+  while (block != -1 && size > 0)
+  {
+    int run = 1;
+    while (fat_get(fs, block + run - 1) == block + run)
+      run++;
+
+    long long len = (long long) run * fs->sb->block_size;
+    if (len > size)
+      len = size;
+
+    // os blocos seguintes da cadeia so pedidos antes de serem precisos (a leitura antecipada do kernel
+    // seguiria a ordem da imagem e no a da cadeia)
+    if (ahead != -1 && ahead_left > 0 && ahead_left + PREFETCH_SIZE / 2 >= size)
+    {
+      long long want = ahead_left < PREFETCH_SIZE ? ahead_left : PREFETCH_SIZE;
+      ahead = chain_advise(fs, ahead, 0, want, MADV_WILLNEED);
+      ahead_left -= want;
+    }
+
+    if (use_sendfile)
+    {
+      off_t offset = BLOCK_OFFSET(block);
+      long long left = len;
+
+      while (left > 0)
+      {
+        ssize_t n = sendfile(foutput, fs->fd, &offset, left);
+        if (n == -1 && left == len && (errno == EINVAL || errno == ENOSYS))
+        {
+          use_sendfile = 0;
+          break;
+        }
+        if (n <= 0)
+          return -1;
+        left -= n;
+      }
+      // uma exportao grande no deve tirar da memria as pginas que so usadas a seguir
+      if (use_sendfile && dontneed && fs->hints)
+        posix_fadvise(fs->fd, BLOCK_OFFSET(block), len, POSIX_FADV_DONTNEED);
+    }
+
+    if (!use_sendfile)
+    {
+      iov[n_iov].iov_base = BLOCK(block);
+      iov[n_iov].iov_len = len;
+      if (++n_iov == IOV_MAX)
+      {
+        if (write_iov(foutput, iov, n_iov) == -1)
+          return -1;
+        n_iov = 0;
+      }
+    }
+
+    size -= len;
+    block = fat_get(fs, block + run - 1);
+  }
+
+  return write_iov(foutput, iov, n_iov);
+}
+
+// d ao kernel a dica advice (MADV_*) sobre os len bytes da imagem a partir de addr, alargados s pginas
+void image_advise(vfs_t *fs, void *addr, long long len, int advice) {
+  unsigned long page_size = sysconf(_SC_PAGESIZE);
+  unsigned long start = (unsigned long) addr & ~(page_size - 1);
+
+  if (fs->hints && len > 0)
+    madvise((void *) start, (unsigned long) addr + len - start, advice);
+
+  return;
+}
+
+// d a dica advice sobre len bytes do contedo da cadeia que comea em block, a partir da posio offset
+// desse bloco, com um madvise por cada sequncia de blocos contguos; devolve o bloco seguinte ao ltimo
+// abrangido (-1 se a cadeia acabou)
+int chain_advise(vfs_t *fs, int block, int offset, long long len, int advice) {
+  int block_size = fs->sb->block_size;
+
+  while (block != -1 && len > 0)
+  {
+    int run = 1;
+    while ((long long) run * block_size - offset < len && fat_get(fs, block + run - 1) == block + run)
+      run++;
+
+    long long run_len = (long long) run * block_size - offset;
+    image_advise(fs, BLOCK(block) + offset, run_len < len ? run_len : len, advice);
+    len -= run_len;
+    offset = 0;
+    block = fat_get(fs, block + run - 1);
+  }
+
+  return block;
+}
+
+// abre o contador das falhas na TLB de dados da thread (com as do kernel, se for permitido); devolve -1
+// se no estiver disponvel
+int open_tlb_counter(void) {
+  struct perf_event_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  attr.exclude_hv = 1;
+  if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC)) == -1)
+  {
+    attr.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  }
+
+  return fd;
+}
+
+// l os valores actuais dos contadores da thread
+void read_vm_counters(vfs_t *fs, vm_stats *stats) {
+  struct rusage usage;
+
+  getrusage(RUSAGE_THREAD, &usage);
+  stats->minor_faults = usage.ru_minflt;
+  stats->major_faults = usage.ru_majflt;
+  if (fs->tlb_fd == -1 || read(fs->tlb_fd, &stats->tlb_misses, sizeof(long long)) != sizeof(long long))
+    stats->tlb_misses = -1;
+
+  return;
+}
+
+// larga uma referncia para a cadeia que comea em block, libertando os blocos que deixam
+// de ser referidos (a cadeia pode ter um sufixo partilhado com outros ficheiros)
+void release_chain(vfs_t *fs, int block) {
+  free_batch batch = {-1, 0, 0};
+
+  release_chain_batch(fs, block, &batch);
+  batch_flush(fs, &batch);
+
+  return;
+}
+
+// release_chain, acumulando em batch os blocos libertados
+void release_chain_batch(vfs_t *fs, int block, free_batch *batch) {
+  int next_block;
+
+  journal_mark(fs, fs->sb, sizeof(superblock));
+  __atomic_add_fetch(&fs->sb->generation, 1, __ATOMIC_ACQ_REL);
+  while (block != -1)
+  {
+    journal_mark(fs, &fs->refs[block], sizeof(unsigned short));
+    int n_refs = __atomic_sub_fetch(&fs->refs[block], 1, __ATOMIC_ACQ_REL);
+    if (n_refs != 0)
+      break;
+    next_block = fat_get(fs, block);
+    batch_free(fs, batch, block);
+    block = next_block;
+  }
+
+  return;
+}
+
+// copia a cadeia que comea em block para blocos novos (reservados aqui); devolve o primeiro bloco
+// da cpia, ou -1 se no houver espao
+int copy_chain(vfs_t *fs, int block) {
+  int n_blocks = 0, cur, next_block, first_block;
+
+  for (cur = block; cur != -1; cur = fat_get(fs, cur))
+    n_blocks++;
+  if (!reserve_blocks(fs, n_blocks))
+    return -1;
+
+  first_block = get_free_chain(fs, n_blocks);
+  next_block = first_block;
+  for (cur = block; cur != -1; cur = fat_get(fs, cur))
+  {
+    memcpy(BLOCK(next_block), BLOCK(cur), fs->sb->block_size);
+    journal_data(fs, BLOCK(next_block), fs->sb->block_size);
+    next_block = fat_get(fs, next_block);
+  }
+
+  return first_block;
+}
+
+// acrescenta uma referncia ao bloco block, se ainda no tiver REFS_MAX; devolve 0 se j tiver
+int share_block(vfs_t *fs, int block) {
+  unsigned short n_refs = __atomic_load_n(&fs->refs[block], __ATOMIC_RELAXED);
+
+  journal_mark(fs, &fs->refs[block], sizeof(unsigned short));
+  do
+  {
+    if (n_refs >= REFS_MAX)
+      return 0;
+  }
+  while (!__atomic_compare_exchange_n(&fs->refs[block], &n_refs, n_refs + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  journal_mark(fs, fs->sb, sizeof(superblock));
+  __atomic_add_fetch(&fs->sb->generation, 1, __ATOMIC_ACQ_REL);
+  return 1;
+}
+
+// garante que o bloco n (a contar de 0) do ficheiro entry s  referido por esse ficheiro, copiando
+// os blocos partilhados at ele; devolve esse bloco e em copies o nmero de blocos alocados
+// (que devem ter sido reservados antes)
+int unshare_block(vfs_t *fs, dir_entry *entry, int n, int *copies) {
+  int prev_block = -1, block = -1, i;
+
+  *copies = 0;
+  for (i = 0; i <= n; i++)
+  {
+    block = prev_block == -1 ? entry->first_block : fat_get(fs, prev_block);
+    if (__atomic_load_n(&fs->refs[block], __ATOMIC_ACQUIRE) > 1)
+    {
+      int copy = get_free_block(fs), next_block = fat_get(fs, block);
+      memcpy(BLOCK(copy), BLOCK(block), fs->sb->block_size);
+      journal_data(fs, BLOCK(copy), fs->sb->block_size);
+      fat_set(fs, copy, next_block);
+      if (next_block != -1)
+      {
+        journal_mark(fs, &fs->refs[next_block], sizeof(unsigned short));
+        __atomic_add_fetch(&fs->refs[next_block], 1, __ATOMIC_ACQ_REL);
+      }
+      if (prev_block == -1)
+      {
+        journal_mark(fs, entry, sizeof(dir_entry));
+        entry->first_block = copy;
+      }
+      else
+        fat_set(fs, prev_block, copy);
+      // se os outros ficheiros que partilhavam o bloco tambm o copiaram entretanto,  libertado aqui
+      release_chain(fs, block);
+      block = copy;
+      (*copies)++;
+    }
+    prev_block = block;
+  }
+
+  return block;
+}
+
+
+// bloqueio de registo (OFD) do tipo type sobre o byte offset da imagem, com cmd F_OFD_SETLKW (espera)
+// ou F_OFD_SETLK; devolve -1 se no o conseguir obter
+int image_lock(vfs_t *fs, off_t offset, short type, int cmd) {
+  struct flock lock;
+  int res;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = offset;
+  lock.l_len = 1;
+  while ((res = fcntl(fs->fd, cmd, &lock)) == -1 && errno == EINTR);
+
+  return res;
+}
+
+// bloqueia o directrio dir_block para leitura (F_RDLCK) ou escrita (F_WRLCK), ou desbloqueia-o (F_UNLCK);
+//  um bloqueio de registo (OFD) sobre o primeiro byte do directrio na imagem, que pertence ao descritor
+// do contexto e por isso exclui tanto os outros processos como os outros contextos do mesmo processo
+// (o primeiro bloqueio de uma operao espera antes por uma confirmao do dirio que esteja pendente)
+void dir_lock(vfs_t *fs, int dir_block, short type) {
+  journal *j = fs->journal;
+  int i;
+
+  if (j == NULL)
+  {
+    image_lock(fs, BLOCK_OFFSET(dir_block), type, F_OFD_SETLKW);
+    return;
+  }
+  for (i = 0; i < j->n_locked && j->locked[i] != dir_block; i++);
+
+  if (type == F_UNLCK)
+  {
+    image_lock(fs, BLOCK_OFFSET(dir_block), type, F_OFD_SETLKW);
+    if (i < j->n_locked)
+      j->locked[i] = j->locked[--j->n_locked];
+    return;
+  }
+
+  if (j->n_locked == 0 && !j->in_op)
+    journal_gate(fs);
+  image_lock(fs, BLOCK_OFFSET(dir_block), type, F_OFD_SETLKW);
+  // o mesmo directrio pode ser bloqueado duas vezes (lock_dirs), mas um s desbloqueio liberta-o
+  if (i == j->n_locked)
+  {
+    if (j->n_locked == j->locked_size)
+    {
+      j->locked_size = j->locked_size ? 2 * j->locked_size : 8;
+      j->locked = (int *) realloc(j->locked, j->locked_size * sizeof(int));
+    }
+    j->locked[j->n_locked++] = dir_block;
+  }
+
+  return;
+}
+
+void dir_unlock(vfs_t *fs, int dir_block) {
+  dir_lock(fs, dir_block, F_UNLCK);
+  return;
+}
+
+// verifica se dir_block ainda  o primeiro bloco de um directrio (outro contexto pode t-lo removido)
+int dir_valid(vfs_t *fs, int dir_block) {
+  dir_entry *dir = (dir_entry *) BLOCK(dir_block);
+
+  return BLOCK_USED(dir_block) && dir[0].type == TYPE_DIR && strcmp(dir[0].name, ".") == 0 && dir[0].first_block == dir_block;
+}
+
+// bloqueia para escrita os directrios src_dir e dst_dir e, se name for um subdirectrio de dst_dir (ou ".."),
+// tambm esse, por ordem crescente dos blocos para evitar impasses; devolve o bloco do directrio name (dst_dir
+// se name no for um subdirectrio) ou -1, sem nada bloqueado, se src_dir ou dst_dir j no existirem
+int lock_dirs(vfs_t *fs, int src_dir, int dst_dir, char *name) {
+  int low = src_dir < dst_dir ? src_dir : dst_dir, high = src_dir < dst_dir ? dst_dir : src_dir, sub_block;
+  dir_entry *entry;
+
+  while (1)
+  {
+    dir_lock(fs, low, F_WRLCK);
+    dir_lock(fs, high, F_WRLCK);
+    if (!dir_valid(fs, low) || !dir_valid(fs, high))
+      break;
+
+    if ((entry = dir_find(fs, dst_dir, name, TYPE_DIR, NULL, NULL)) == NULL)
+      return dst_dir;
+    sub_block = entry->first_block;
+    if (sub_block == low || sub_block == high)
+      return sub_block;
+    if (sub_block > high)
+    {
+      dir_lock(fs, sub_block, F_WRLCK);
+      return sub_block;
+    }
+
+    dir_unlock(fs, high);
+    dir_unlock(fs, low);
+    dir_lock(fs, sub_block, F_WRLCK);
+    dir_lock(fs, sub_block < low ? low : high, F_WRLCK);
+    dir_lock(fs, sub_block < low ? high : low, F_WRLCK);
+
+    // enquanto dst_dir esteve desbloqueado, name pode ter sido removido ou movido
+    if (dir_valid(fs, low) && dir_valid(fs, high) && (entry = dir_find(fs, dst_dir, name, TYPE_DIR, NULL, NULL)) != NULL
+        && entry->first_block == sub_block)
+      return sub_block;
+    dir_unlock(fs, sub_block);
+    dir_unlock(fs, high);
+    dir_unlock(fs, low);
+  }
+  dir_unlock(fs, high);
+  dir_unlock(fs, low);
+
+  return -1;
+}
+
+// desbloqueia os directrios bloqueados com lock_dirs (sub_block  o bloco que a funo devolveu)
+void unlock_dirs(vfs_t *fs, int src_dir, int dst_dir, int sub_block) {
+  if (sub_block != src_dir && sub_block != dst_dir)
+    dir_unlock(fs, sub_block);
+  if (dst_dir != src_dir)
+    dir_unlock(fs, dst_dir);
+  dir_unlock(fs, src_dir);
+
+  return;
+}
+
+// verifica se o directrio block  o directrio dir ou est dentro dele, subindo pelas entradas ".."
+int dir_contains(vfs_t *fs, int dir, int block) {
+  int n;
+
+  for (n = 0; n < FAT_ENTRIES(fs->sb->fat_type); n++)
+  {
+    if (block == dir)
+      return 1;
+    if (block == fs->sb->root_block)
+      return 0;
+    block = ((dir_entry *) BLOCK(block))[1].first_block;
+  }
+
+  return 0;
+}
+
+
+// Caminhos: os nomes passados s funes da biblioteca so caminhos absolutos ou relativos ao directrio
+// corrente, com as componentes separadas por '/'. Os subdirectrios atravessados so procurados primeiro na
+// cache de entradas do contexto, indexada pelo directrio e pelo nome; uma entrada guardada s  usada se a
+// gerao do seu directrio no tiver mudado entretanto (muda com qualquer alterao s suas entradas).
+
+// devolve o primeiro bloco do subdirectrio name do directrio dir_block, ou -1 se no existir
+int lookup_dir(vfs_t *fs, int dir_block, char *name) {
+  dentry *d = &fs->dentries[(hash_name(name) ^ (unsigned int) dir_block * 2654435761u) % DENTRY_CACHE_SIZE];
+  unsigned int generation = __atomic_load_n(DIR_GENERATION(dir_block), __ATOMIC_ACQUIRE);
+  int sub_block = -1;
+  dir_entry *entry;
+
+  if (d->dir_block == dir_block && d->generation == generation && strncmp(d->name, name, MAX_NAME_LENGHT) == 0)
+    return d->first_block;
+
+  dir_lock(fs, dir_block, F_RDLCK);
+  if (dir_valid(fs, dir_block) && (entry = dir_find(fs, dir_block, name, TYPE_DIR, NULL, NULL)) != NULL)
+  {
+    sub_block = entry->first_block;
+    d->dir_block = dir_block;
+    d->generation = *DIR_GENERATION(dir_block);
+    strncpy(d->name, name, MAX_NAME_LENGHT);
+    d->name[MAX_NAME_LENGHT] = '\0';
+    d->first_block = sub_block;
+  }
+  dir_unlock(fs, dir_block);
+
+  return sub_block;
+}
+
+// resolve o caminho path excepto a ltima componente: devolve em dir_block o directrio onde essa componente
+// deve estar e copia-a para name (com MAX_NAME_LENGHT + 1 bytes;  "." no caminho "/"); devolve 0,
+// ERR_NOT_FOUND se um dos directrios intermdios no existir ou ERR_NAME se o caminho for vazio ou tiver
+// um nome demasiado longo
+int resolve_path(vfs_t *fs, char *path, int *dir_block, char *name) {
+  int block = path[0] == '/' ? fs->sb->root_block : fs->current_dir, pending = 0;
+  char *start = path, *end;
+
+  if (path[0] == '\0')
+    return ERR_NAME;
+  strcpy(name, ".");
+
+  while (1)
+  {
+    while (*start == '/')
+      start++;
+    if (*start == '\0')
+      break;
+    end = strchrnul(start, '/');
+    if (end - start > MAX_NAME_LENGHT)
+      return ERR_NAME;
+
+    // a componente anterior  um dos directrios intermdios
+    if (pending && (block = lookup_dir(fs, block, name)) == -1)
+      return ERR_NOT_FOUND;
+    memcpy(name, start, end - start);
+    name[end - start] = '\0';
+    pending = 1;
+    start = end;
+  }
+
+  *dir_block = block;
+  return 0;
+}
+
+// acrescenta o directrio block, com o nome name, ao nvel depth do caminho do directrio corrente
+void path_push(vfs_t *fs, int depth, int block, char *name) {
+  if (depth == fs->path_size)
+  {
+    fs->path_size = fs->path_size ? 2 * fs->path_size : 16;
+    fs->path = (path_level *) realloc(fs->path, fs->path_size * sizeof(path_level));
+  }
+  fs->path[depth].block = block;
+  strcpy(fs->path[depth].name, name);
+
+  return;
+}
+
+// verifica, atravs da cache de entradas, se o caminho guardado ainda leva ao directrio corrente (outro
+// contexto pode ter mudado o nome ou movido um dos directrios)
+int path_valid(vfs_t *fs) {
+  int parent = fs->sb->root_block, i;
+
+  if (fs->depth < 0)
+    return 0;
+  for (i = 0; i < fs->depth; i++)
+  {
+    if (lookup_dir(fs, parent, fs->path[i].name) != fs->path[i].block)
+      return 0;
+    parent = fs->path[i].block;
+  }
+
+  return parent == fs->current_dir;
+}
+
+// reconstri o caminho do directrio corrente a partir da imagem, subindo pelas entradas ".." e procurando
+// cada directrio na lista do pai; devolve 0 ou ERR_NOT_FOUND se o directrio j no estiver na rvore
+int rebuild_path(vfs_t *fs) {
+  int it_dir = fs->current_dir, depth = 0, i;
+  path_level level;
+
+  fs->depth = -1;
+  while (it_dir != fs->sb->root_block)
+  {
+    dir_entry *dir = (dir_entry *) BLOCK(it_dir);
+    int prev_dir = dir[1].first_block, found = 0;
+
+    dir_lock(fs, prev_dir, F_RDLCK);
+    int cur_block = prev_dir, slot = 1;
+    dir_entry *entry;
+
+    while (!found && (entry = dir_next(fs, &cur_block, &slot)) != NULL)
+    {
+      if (entry->type == TYPE_DIR && entry->first_block == it_dir)
+      {
+        // os nveis ficam do directrio corrente para a raiz e so invertidos no fim
+        strncpy(level.name, entry->name, MAX_NAME_LENGHT);
+        level.name[MAX_NAME_LENGHT] = '\0';
+        path_push(fs, depth++, it_dir, level.name);
+        found = 1;
+      }
+    }
+    dir_unlock(fs, prev_dir);
+
+    // o directrio foi removido ou movido por outro contexto
+    if (!found || depth > FAT_ENTRIES(fs->sb->fat_type))
+      return ERR_NOT_FOUND;
+    it_dir = prev_dir;
+  }
+
+  for (i = 0; i < depth / 2; i++)
+  {
+    level = fs->path[i];
+    fs->path[i] = fs->path[depth - 1 - i];
+    fs->path[depth - 1 - i] = level;
+  }
+  fs->depth = depth;
+
+  return 0;
+}
+
+
+// Dirio das alteraes aos metadados: cada operao altera a imagem no prprio mapeamento, e o kernel pode
+// escrever essas pginas no disco a qualquer momento. Por isso, antes de uma pgina dos metadados ou um bloco
+// de um directrio ser alterado pela primeira vez desde o ltimo checkpoint, a sua imagem anterior  escrita
+// no dirio com uma escrita sncrona; os bits dessas pginas e blocos so partilhados, pelo que cada imagem 
+// escrita uma s vez, e os blocos livres no checkpoint no precisam dela (as imagens anteriores dos metadados
+// voltam a p-los livres). As regies alteradas (em pedaos de JOURNAL_CHUNK bytes nos metadados e blocos
+// inteiros nos directrios) entram no grupo aberto, que  comum a todos os contextos que montaram a imagem:
+// cada operao bloqueia LOCK_OPS para leitura desde a primeira alterao at ao fim, e o grupo s 
+// confirmado com esse byte bloqueado para escrita, ou seja sem nenhuma operao a meio. A confirmao copia,
+// com as operaes paradas, o contedo que as regies do grupo tm nesse momento (que s tem operaes
+// completas) e, j com as operaes a correr, escreve os dados dos ficheiros alterados e acrescenta essa
+// cpia ao dirio com uma nica escrita sncrona. Ao montar a imagem depois de uma falha, as imagens
+// anteriores so repostas (da mais recente para a mais antiga, para que fique a que foi lida antes de
+// qualquer alterao) e depois os grupos confirmados, por ordem; o resultado  a imagem no fim do ltimo
+// grupo confirmado (por isso os blocos libertados num grupo s voltam a ser alocados depois de o grupo estar
+// no disco). O checkpoint, quando o dirio vai a meio ou a imagem  desmontada, tambm  feito sem
+// operaes a meio: sincroniza a imagem toda e esvazia o dirio; como no pode ser feito a meio de uma
+// operao, cada operao comea com o dirio a menos de meio. Uma operao que precise de mais imagens
+// anteriores do que as que ainda cabem no dirio (ou cuja escrita falhe) devolve ERR_IO, e o checkpoint 
+// feito logo que as operaes a meio acabem; as alteraes de um contexto com o dirio desligado no
+// so protegidas.
+
+long long now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// prepara o dirio do contexto fs; o primeiro contexto a montar a imagem (os outros tm LOCK_MOUNT
+// bloqueado para leitura) repe o que l estiver e limpa o estado partilhado do grupo aberto
+int journal_open(vfs_t *fs, char *filesystem_name) {
+  journal *j = (journal *) calloc(1, sizeof(journal));
+  off_t meta_size = fs->blocks - (char *) fs->sb, journal_size = JOURNAL_SIZE(fs->sb->fat_type);
+  int n_pages = (meta_size + UNDO_PAGE - 1) / UNDO_PAGE, n_chunks = (meta_size + JOURNAL_CHUNK - 1) / JOURNAL_CHUNK;
+  int n_blocks = FAT_ENTRIES(fs->sb->fat_type);
+
+  // o estado partilhado fica no fim do dirio, depois dos registos
+  j->max_ranges = journal_size / 16 / sizeof(dirty_range);
+  size_t shared_size = sizeof(journal_shared) + ((n_chunks + 63) / 64 + (n_pages + 63) / 64 + 5 * (n_blocks / 64))
+                       * sizeof(unsigned long long) + j->max_ranges * sizeof(dirty_range);
+  j->log_size = journal_size - (shared_size + 4095) / 4096 * 4096;
+  char *area = (char *) JOURNAL_HEADER + j->log_size;
+  j->shared = (journal_shared *) area;
+  j->checkpoint_free = (unsigned long long *) (area + sizeof(journal_shared));
+  j->dirty_chunks = j->checkpoint_free + n_blocks / 64;
+  j->dirty_blocks = j->dirty_chunks + (n_chunks + 63) / 64;
+  j->undo_pages = j->dirty_blocks + n_blocks / 64;
+  j->undo_blocks = j->undo_pages + (n_pages + 63) / 64;
+  j->freed[0] = j->undo_blocks + n_blocks / 64;
+  j->freed[1] = j->freed[0] + n_blocks / 64;
+  j->ranges = (dirty_range *) (j->freed[1] + n_blocks / 64);
+
+  fs->journal = j;
+  // nada  registado enquanto o dirio  reposto
+  j->window = -1;
+  j->data_last = UINT_MAX;
+  j->buf_size = 1 << 16;
+  j->buf = (char *) malloc(j->buf_size);
+  if ((j->fd = open(filesystem_name, O_RDWR | O_DSYNC)) == -1)
+    return -1;
+
+  if (image_lock(fs, LOCK_MOUNT, F_WRLCK, F_OFD_SETLK) == 0)
+  {
+    if (journal_replay(fs) == -1)
+      return -1;
+    // os directrios das imagens da verso 3 so ordenados por quem repe o dirio, antes de qualquer
+    // outro contexto poder usar a imagem
+    if (fs->sb->version == 3)
+      upgrade_dirs(fs);
+    // as rvores de um percurso que no acabou ficaram fora da raiz, com os seus blocos ocupados
+    if (fs->sb->n_walks != 0 && reclaim_blocks(fs) == -1)
+      return -1;
+  }
+  image_lock(fs, LOCK_MOUNT, F_RDLCK, F_OFD_SETLKW);
+  j->window = DEFAULT_COMMIT_WINDOW;
+
+  return 0;
+}
+
+void journal_close(vfs_t *fs) {
+  journal *j = fs->journal;
+
+  if (j == NULL)
+    return;
+  if (j->fd != -1 && j->window >= 0)
+  {
+    journal_lock_ops(fs);
+    journal_checkpoint(fs);
+    journal_unlock_ops(fs);
+  }
+  if (j->fd != -1)
+    close(j->fd);
+  free(j->locked);
+  free(j->data);
+  free(j->buf);
+  free(j);
+  fs->journal = NULL;
+
+  return;
+}
+
+// FNV-1a dos len bytes de data
+unsigned int journal_checksum(void *data, size_t len) {
+  unsigned char *p = (unsigned char *) data;
+  unsigned int h = 2166136261u;
+
+  while (len-- > 0)
+  {
+    h ^= *p++;
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+// devolve o registo na posio pos do dirio se for vlido: o grupo seq ou uma imagem anterior escrita
+// depois do checkpoint header->checkpoint, com todas as regies dentro dos metadados e dos dados (os
+// grupos das verses anteriores podem ocupar o dirio todo, incluindo o estado do grupo aberto)
+journal_group *journal_record(vfs_t *fs, journal_header *header, unsigned int pos, unsigned int seq) {
+  journal_group *record = (journal_group *) ((char *) JOURNAL_HEADER + pos);
+  off_t fs_size = JOURNAL_OFFSET, journal_size = JOURNAL_SIZE(fs->sb->fat_type);
+  unsigned int i;
+
+  if (pos + sizeof(journal_group) > journal_size
+      || !((record->magic == JOURNAL_MAGIC && record->seq == seq) || (record->magic == UNDO_MAGIC && record->seq == header->checkpoint))
+      || record->length < sizeof(journal_group) || record->length > journal_size - pos
+      || record->checksum != journal_checksum(&record->seq, record->length - 8))
+    return NULL;
+
+  char *data = (char *) (record + 1), *end = (char *) record + record->length;
+  for (i = 0; i < record->n_ranges; i++)
+  {
+    journal_range *range = (journal_range *) data;
+    if (data + sizeof(journal_range) > end || range->offset < 0 || range->len < 0 || range->offset + range->len > fs_size
+        || data + sizeof(journal_range) + range->len > end)
+      return NULL;
+    data += sizeof(journal_range) + (range->len + 7) / 8 * 8;
+  }
+
+  return record;
+}
+
+// copia as regies do registo record para as suas posies
+void journal_apply(vfs_t *fs, journal_group *record) {
+  char *data = (char *) (record + 1);
+  unsigned int i;
+
+  for (i = 0; i < record->n_ranges; i++)
+  {
+    journal_range *range = (journal_range *) data;
+    memcpy((char *) fs->sb + range->offset, range + 1, range->len);
+    data += sizeof(journal_range) + (range->len + 7) / 8 * 8;
+  }
+
+  return;
+}
+
+// repe as imagens anteriores (da mais recente para a mais antiga) e depois os grupos do dirio, sincroniza
+// a imagem, esvazia o dirio e limpa o estado partilhado; devolve o nmero de registos repostos ou -1
+int journal_replay(vfs_t *fs) {
+  journal *j = fs->journal;
+  journal_header header = *JOURNAL_HEADER;
+  journal_group *record;
+  unsigned int pos = JOURNAL_START, end, *undo = NULL;
+  int n_groups = 0, n_undo = 0, undo_size = 0, i;
+
+  while ((record = journal_record(fs, &header, pos, header.first_seq + n_groups)) != NULL)
+  {
+    if (record->magic == JOURNAL_MAGIC)
+      n_groups++;
+    else
+    {
+      if (n_undo == undo_size)
+      {
+        undo_size = undo_size ? 2 * undo_size : 64;
+        undo = (unsigned int *) realloc(undo, undo_size * sizeof(unsigned int));
+      }
+      undo[n_undo++] = pos;
+    }
+    pos += record->length;
+  }
+  end = pos;
+
+  for (i = n_undo - 1; i >= 0; i--)
+    journal_apply(fs, (journal_group *) ((char *) JOURNAL_HEADER + undo[i]));
+  for (pos = JOURNAL_START; pos < end; pos += record->length)
+  {
+    record = (journal_group *) ((char *) JOURNAL_HEADER + pos);
+    if (record->magic == JOURNAL_MAGIC)
+      journal_apply(fs, record);
+  }
+  free(undo);
+
+  if (n_groups + n_undo > 0 && fdatasync(fs->fd) == -1)
+    return -1;
+  header.first_seq += n_groups;
+  header.next_seq = header.first_seq;
+  header.tail = JOURNAL_START;
+  header.checkpoint++;
+  if (pwrite(j->fd, &header, sizeof(header), JOURNAL_OFFSET) != sizeof(header))
+    return -1;
+
+  // os mapas partilhados podem ter ficado com bits de um grupo que nunca foi confirmado
+  unsigned long long *word, *limit = (unsigned long long *) (j->ranges);
+  for (word = j->dirty_chunks; word < limit; word++)
+    if (*word != 0)
+      *word = 0;
+  memset(j->shared, 0, sizeof(journal_shared));
+  journal_free_map(fs);
+
+  return n_groups + n_undo;
+}
+
+// espera que as operaes a meio acabem e impede outras de comear, para confirmar um grupo ou fazer um
+// checkpoint (as operaes que ainda no bloquearam nada esperam em dir_lock, e as outras continuam
+// at journal_op); quem chama no pode ter nenhum directrio bloqueado
+void journal_lock_ops(vfs_t *fs) {
+  image_lock(fs, LOCK_GATE, F_WRLCK, F_OFD_SETLKW);
+  __atomic_store_n(&fs->journal->shared->committing, 1, __ATOMIC_SEQ_CST);
+  image_lock(fs, LOCK_OPS, F_WRLCK, F_OFD_SETLKW);
+  return;
+}
+
+void journal_unlock_ops(vfs_t *fs) {
+  image_lock(fs, LOCK_OPS, F_UNLCK, F_OFD_SETLKW);
+  __atomic_store_n(&fs->journal->shared->committing, 0, __ATOMIC_SEQ_CST);
+  image_lock(fs, LOCK_GATE, F_UNLCK, F_OFD_SETLKW);
+  return;
+}
+
+// incio de uma operao que ainda no bloqueou nada: espera por uma confirmao que esteja  espera
+// das operaes a meio, para que no seja adiada indefinidamente pelas que vo comeando; antes disso,
+// confirma o grupo aberto se o dirio j vai a meio (e faz o checkpoint, que no pode ser feito a meio da
+// operao) ou se a maior parte dos blocos livres foi libertada em grupos que ainda no esto no disco
+// (e no pode ser alocada)
+void journal_gate(vfs_t *fs) {
+  journal_shared *shared = fs->journal->shared;
+  int n_freed = __atomic_load_n(&shared->n_freed[0], __ATOMIC_RELAXED) + __atomic_load_n(&shared->n_freed[1], __ATOMIC_RELAXED);
+
+  if (JOURNAL_HEADER->tail > fs->journal->log_size / 2 || __atomic_load_n(&shared->undo_lost, __ATOMIC_RELAXED)
+      || (n_freed > 0 && __atomic_load_n(&fs->sb->n_free_blocks, __ATOMIC_RELAXED) - n_freed < n_freed))
+    journal_commit(fs);
+  if (!__atomic_load_n(&shared->committing, __ATOMIC_SEQ_CST))
+    return;
+  image_lock(fs, LOCK_GATE, F_RDLCK, F_OFD_SETLKW);
+  image_lock(fs, LOCK_GATE, F_UNLCK, F_OFD_SETLKW);
+
+  return;
+}
+
+// primeira alterao de uma operao: bloqueia LOCK_OPS para leitura (s espera se um grupo estiver a
+// ser confirmado)
+void journal_begin(vfs_t *fs) {
+  image_lock(fs, LOCK_OPS, F_RDLCK, F_OFD_SETLKW);
+  fs->journal->in_op = 1;
+
+  return;
+}
+
+// regista que os len bytes em addr (nos metadados ou num bloco de um directrio) vo ser alterados pela
+// operao em curso; tem de ser chamada antes de os alterar
+static inline void journal_mark(vfs_t *fs, void *addr, size_t len) {
+  journal *j = fs->journal;
+  off_t offset = (char *) addr - (char *) fs->sb;
+
+  if (j == NULL || j->window < 0)
+    return;
+  // o caso mais comum (uma entrada da FAT ou uma palavra do mapa j registadas) fica por aqui
+  if (j->in_op && (char *) addr < fs->blocks && offset / JOURNAL_CHUNK == (offset + (off_t) len - 1) / JOURNAL_CHUNK
+      && (__atomic_load_n(&j->undo_pages[offset / UNDO_PAGE / 64], __ATOMIC_ACQUIRE) >> (offset / UNDO_PAGE % 64) & 1)
+      && (__atomic_load_n(&j->dirty_chunks[offset / JOURNAL_CHUNK / 64], __ATOMIC_RELAXED) >> (offset / JOURNAL_CHUNK % 64) & 1))
+    return;
+  journal_register(fs, offset, len);
+
+  return;
+}
+
+// journal_mark para os len bytes na posio offset da imagem: escreve as imagens anteriores das pginas
+// dos metadados (ou dos blocos dos directrios) que ainda no esto no dirio desde o ltimo checkpoint
+// e acrescenta s regies do grupo aberto os pedaos (ou blocos) que ainda l no esto
+void journal_register(vfs_t *fs, off_t offset, size_t len) {
+  journal *j = fs->journal;
+  off_t meta_size = fs->blocks - (char *) fs->sb, end = offset + len;
+  int block_size = fs->sb->block_size;
+  long long first, last, i, n;
+
+  if (!j->in_op)
+    journal_begin(fs);
+
+  if (offset < meta_size)
+  {
+    first = offset / UNDO_PAGE;
+    last = (end - 1) / UNDO_PAGE;
+    for (i = first; i <= last; i++)
+      if (!(__atomic_load_n(&j->undo_pages[i / 64], __ATOMIC_ACQUIRE) >> (i % 64) & 1))
+      {
+        journal_undo(fs, 1, first, last);
+        break;
+      }
+
+    // s o contexto que passa o bit de um pedao a 1 o acrescenta s regies
+    for (i = offset / JOURNAL_CHUNK, last = (end - 1) / JOURNAL_CHUNK; i <= last; i = n)
+    {
+      for (n = i; n <= last; n++)
+      {
+        unsigned long long bit = 1ULL << (n % 64);
+        if (__atomic_fetch_or(&j->dirty_chunks[n / 64], bit, __ATOMIC_RELAXED) & bit)
+          break;
+      }
+      if (n > i)
+        journal_add_range(fs, i * JOURNAL_CHUNK, (n * JOURNAL_CHUNK < meta_size ? n * JOURNAL_CHUNK : meta_size) - i * JOURNAL_CHUNK, 0);
+      else
+        n = i + 1;
+    }
+    return;
+  }
+
+  first = (offset - meta_size) / block_size;
+  last = (end - 1 - meta_size) / block_size;
+  for (i = first; i <= last; i++)
+    if (!(__atomic_load_n(&j->undo_blocks[i / 64], __ATOMIC_ACQUIRE) >> (i % 64) & 1))
+    {
+      journal_undo(fs, 0, first, last);
+      break;
+    }
+
+  for (i = first; i <= last; i++)
+  {
+    unsigned long long bit = 1ULL << (i % 64);
+    if (!(__atomic_fetch_or(&j->dirty_blocks[i / 64], bit, __ATOMIC_RELAXED) & bit))
+      journal_add_range(fs, BLOCK_OFFSET(i), block_size, 0);
+  }
+
+  return;
+}
+
+// escreve no dirio, num s registo, as imagens anteriores das pginas dos metadados (meta = 1) ou dos
+// blocos dos directrios first a last que ainda no l esto desde o ltimo checkpoint (os blocos livres no
+// checkpoint no precisam); os bits s passam a 1 depois da escrita, e quem os encontra a 1 pode alterar
+// essas regies sem esperar por LOCK_LOG; se o registo no couber no dirio ou a escrita falhar, a operao
+// devolve ERR_IO em journal_op e a confirmao seguinte faz um checkpoint (os bits passam na mesma a 1, para
+// que o contedo j alterado no seja guardado mais tarde como imagem anterior)
+void journal_undo(vfs_t *fs, int meta, long long first, long long last) {
+  journal *j = fs->journal;
+  journal_header *header = JOURNAL_HEADER;
+  journal_group *record = (journal_group *) j->buf;
+  unsigned long long *bits = meta ? j->undo_pages : j->undo_blocks;
+  off_t meta_size = fs->blocks - (char *) fs->sb;
+  long long i, n;
+
+  image_lock(fs, LOCK_LOG, F_WRLCK, F_OFD_SETLKW);
+  j->buf_len = sizeof(journal_group);
+  record->n_ranges = 0;
+  for (i = first; i <= last; i = n)
+  {
+    for (n = i; n <= last && !(bits[n / 64] >> (n % 64) & 1) && !(!meta && j->checkpoint_free[n / 64] >> (n % 64) & 1); n++)
+      ;
+    if (n == i)
+      n = i + 1;
+    else if (meta)
+      journal_append(j, i * UNDO_PAGE, (char *) fs->sb + i * UNDO_PAGE, (n * UNDO_PAGE < meta_size ? n * UNDO_PAGE : meta_size) - i * UNDO_PAGE);
+    else
+      journal_append(j, BLOCK_OFFSET(i), BLOCK(i), (n - i) * fs->sb->block_size);
+  }
+
+  if (record->n_ranges > 0)
+  {
+    record->magic = UNDO_MAGIC;
+    record->length = j->buf_len;
+    record->pad = 0;
+    record->seq = header->checkpoint;
+    record->checksum = journal_checksum(&record->seq, record->length - 8);
+    if (header->tail + record->length <= j->log_size
+        && pwrite(j->fd, record, record->length, JOURNAL_OFFSET + header->tail) == record->length)
+      header->tail += record->length;
+    else
+    {
+      j->undo_failed = 1;
+      __atomic_store_n(&j->shared->undo_lost, 1, __ATOMIC_RELAXED);
+    }
+  }
+  for (i = first; i <= last; i++)
+    __atomic_fetch_or(&bits[i / 64], 1ULL << (i % 64), __ATOMIC_RELEASE);
+  image_lock(fs, LOCK_LOG, F_UNLCK, F_OFD_SETLKW);
+
+  return;
+}
+
+// acrescenta s regies do grupo aberto os len bytes na posio offset da imagem (data = 1 para os dados
+// de um ficheiro, que no vo para o dirio); se no couberem, a confirmao faz um checkpoint
+void journal_add_range(vfs_t *fs, off_t offset, off_t len, int data) {
+  journal *j = fs->journal;
+  journal_shared *shared = j->shared;
+  long long start = 0;
+
+  if (__atomic_load_n(&shared->group_start, __ATOMIC_RELAXED) == 0)
+    __atomic_compare_exchange_n(&shared->group_start, &start, now_usec(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  if (!data)
+    __atomic_add_fetch(&shared->bytes, len + sizeof(journal_range), __ATOMIC_RELAXED);
+
+  unsigned int n = __atomic_fetch_add(&shared->n_ranges, 1, __ATOMIC_RELAXED);
+  if (n < j->max_ranges)
+  {
+    j->ranges[n].offset = offset;
+    j->ranges[n].len = len;
+    j->ranges[n].data = data;
+  }
+  if (data)
+  {
+    j->data_group = shared->group;
+    j->data_last = n;
+  }
+
+  return;
+}
+
+// regista que os len bytes em addr (dados de um ficheiro) foram alterados; no vo para o dirio,
+// mas so escritos antes de o grupo ser confirmado
+void journal_data(vfs_t *fs, void *addr, size_t len) {
+  journal *j = fs->journal;
+  off_t offset = (char *) addr - (char *) fs->sb;
+
+  if (j == NULL || j->window < 0 || len == 0)
+    return;
+  if (!j->in_op)
+    journal_begin(fs);
+
+  // uma escrita que continua a anterior do mesmo contexto estende a sua regio
+  if (j->data_group == j->shared->group && j->data_last < j->max_ranges
+      && j->ranges[j->data_last].offset + j->ranges[j->data_last].len == offset)
+  {
+    j->ranges[j->data_last].len += len;
+    return;
+  }
+  journal_add_range(fs, offset, len, 1);
+
+  return;
+}
+
+// acrescenta ao registo em construo a regio de len bytes na posio offset da imagem, com o contedo em data
+void journal_append(journal *j, off_t offset, void *data, size_t len) {
+  size_t need = j->buf_len + sizeof(journal_range) + (len + 7) / 8 * 8;
+
+  if (need > j->buf_size)
+  {
+    while (need > j->buf_size)
+      j->buf_size = j->buf_size ? 2 * j->buf_size : 1 << 16;
+    j->buf = (char *) realloc(j->buf, j->buf_size);
+  }
+
+  journal_range *range = (journal_range *) (j->buf + j->buf_len);
+  range->offset = offset;
+  range->len = len;
+  memcpy(range + 1, data, len);
+  memset((char *) (range + 1) + len, 0, (len + 7) / 8 * 8 - len);
+  j->buf_len = need;
+  ((journal_group *) j->buf)->n_ranges++;
+
+  return;
+}
+
+int dirty_range_cmp(const void *a, const void *b) {
+  const dirty_range *ra = (const dirty_range *) a, *rb = (const dirty_range *) b;
+  return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+// confirma o grupo aberto (de todos os contextos): com as operaes paradas, o contedo actual das regies
+// do grupo  copiado para um registo e o grupo seguinte comea logo; depois os dados dos ficheiros so
+// escritos e o registo  acrescentado ao dirio com uma s escrita sncrona, com as operaes a correr
+// (as que precisarem de escrever imagens anteriores esperam, para no ficarem depois de um registo que
+// ainda no est no dirio); um grupo que passe de metade do dirio (ou a que faltem imagens anteriores)
+// acaba num checkpoint, que tambm  feito sem grupo aberto se o dirio j vai a meio; devolve 0, ERR_IO
+// ou ERR_AGAIN se o contexto tiver um directrio aberto
+int journal_commit(vfs_t *fs) {
+  journal *j = fs->journal;
+  journal_header *header = JOURNAL_HEADER;
+  unsigned int pos;
+  int res;
+
+  if (j == NULL || j->fd == -1
+      || (__atomic_load_n(&j->shared->group_start, __ATOMIC_RELAXED) == 0 && header->tail <= j->log_size / 2))
+    return 0;
+  if (j->in_op || j->n_locked > 0)
+    return ERR_AGAIN;
+
+  journal_lock_ops(fs);
+  if (j->shared->group_start == 0 && header->tail <= j->log_size / 2)
+  {
+    journal_unlock_ops(fs);
+    return 0;
+  }
+  res = journal_build_group(fs);
+  // espera que acabe a escrita do grupo anterior; sem todas as imagens anteriores, o grupo s fica seguro
+  // com um checkpoint
+  image_lock(fs, LOCK_LOG, F_WRLCK, F_OFD_SETLKW);
+  if (res == -1 || j->shared->undo_lost || header->tail + ((journal_group *) j->buf)->length > j->log_size / 2)
+  {
+    image_lock(fs, LOCK_LOG, F_UNLCK, F_OFD_SETLKW);
+    res = journal_checkpoint(fs);
+    journal_unlock_ops(fs);
+    return res;
+  }
+
+  journal_group *group = (journal_group *) j->buf;
+  int parity = j->shared->group & 1;
+  pos = header->tail;
+  group->seq = header->next_seq;
+  group->checksum = journal_checksum(&group->seq, group->length - 8);
+  header->tail += group->length;
+  header->next_seq++;
+  journal_end_group(fs);
+  journal_unlock_ops(fs);
+
+  res = journal_write_group(fs, pos);
+  if (res != 0)
+  {
+    header->tail = pos;
+    header->next_seq--;
+  }
+  else
+    journal_clear_freed(fs, parity);
+  image_lock(fs, LOCK_LOG, F_UNLCK, F_OFD_SETLKW);
+
+  // as alteraes do grupo que no foi escrito s ficam no disco com um checkpoint
+  if (res != 0)
+  {
+    journal_lock_ops(fs);
+    res = journal_checkpoint(fs);
+    journal_unlock_ops(fs);
+  }
+
+  return res;
+}
+
+// com as operaes paradas: copia para j->buf o contedo actual das regies de metadados do grupo aberto
+// e para j->data as regies dos dados dos ficheiros; devolve 0, ou -1 se alguma regio no coube no
+// estado partilhado
+int journal_build_group(vfs_t *fs) {
+  journal *j = fs->journal;
+  unsigned int n_ranges = j->shared->n_ranges, i, n;
+
+  if (n_ranges > j->max_ranges)
+    return -1;
+
+  qsort(j->ranges, n_ranges, sizeof(dirty_range), dirty_range_cmp);
+  j->buf_len = sizeof(journal_group);
+  ((journal_group *) j->buf)->n_ranges = 0;
+  j->n_data = 0;
+  for (i = 0; i < n_ranges; i = n)
+  {
+    off_t start = j->ranges[i].offset, end = start + j->ranges[i].len;
+    for (n = i + 1; n < n_ranges && j->ranges[n].data == j->ranges[i].data && j->ranges[n].offset <= end; n++)
+      if (j->ranges[n].offset + j->ranges[n].len > end)
+        end = j->ranges[n].offset + j->ranges[n].len;
+    if (!j->ranges[i].data)
+      journal_append(j, start, (char *) fs->sb + start, end - start);
+    else
+    {
+      if (j->n_data == j->data_size)
+      {
+        j->data_size = j->data_size ? 2 * j->data_size : 64;
+        j->data = (dirty_range *) realloc(j->data, j->data_size * sizeof(dirty_range));
+      }
+      j->data[j->n_data].offset = start;
+      j->data[j->n_data++].len = end - start;
+    }
+  }
+
+  journal_group *group = (journal_group *) j->buf;
+  group->magic = JOURNAL_MAGIC;
+  group->length = j->buf_len;
+  group->pad = 0;
+
+  return 0;
+}
+
+// com LOCK_LOG: escreve os dados dos ficheiros do grupo em j->buf (tm de estar no disco antes das
+// entradas que os referem), no modo estrito tambm as regies do grupo nas suas posies, e depois o
+// grupo, na posio pos do dirio; a escrita sncrona do grupo esvazia a cache do disco para todas
+// estas pginas; devolve 0 ou ERR_IO
+int journal_write_group(vfs_t *fs, unsigned int pos) {
+  journal *j = fs->journal;
+  journal_group *group = (journal_group *) j->buf;
+  int i;
+
+  for (i = 0; i < j->n_data; i++)
+    if (sync_file_range(fs->fd, j->data[i].offset, j->data[i].len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1)
+      return ERR_IO;
+  if (j->strict && journal_write_home(fs) != 0)
+    return ERR_IO;
+  if (pwrite(j->fd, j->buf, group->length, JOURNAL_OFFSET + pos) != group->length)
+    return ERR_IO;
+
+  return 0;
+}
+
+// esquece as regies do grupo aberto, depois de confirmado ou de um checkpoint
+void journal_end_group(vfs_t *fs) {
+  journal *j = fs->journal;
+  journal_shared *shared = j->shared;
+  off_t meta_size = fs->blocks - (char *) fs->sb;
+  unsigned int i;
+
+  if (shared->n_ranges > j->max_ranges)
+    memset(j->dirty_chunks, 0, (char *) j->undo_pages - (char *) j->dirty_chunks);
+  else
+    for (i = 0; i < shared->n_ranges; i++)
+    {
+      dirty_range *range = &j->ranges[i];
+      long long k;
+      if (range->data)
+        continue;
+      if (range->offset < meta_size)
+        for (k = range->offset / JOURNAL_CHUNK; k < (range->offset + range->len + JOURNAL_CHUNK - 1) / JOURNAL_CHUNK; k++)
+          j->dirty_chunks[k / 64] &= ~(1ULL << (k % 64));
+      else
+      {
+        k = (range->offset - meta_size) / fs->sb->block_size;
+        j->dirty_blocks[k / 64] &= ~(1ULL << (k % 64));
+      }
+    }
+  shared->n_ranges = 0;
+  shared->bytes = 0;
+  shared->group_start = 0;
+  shared->group++;
+
+  return;
+}
+
+// guarda o mapa dos blocos livres no checkpoint: o contedo que tinham no precisa de imagem anterior,
+// porque as imagens anteriores dos metadados os voltam a pr livres
+void journal_free_map(vfs_t *fs) {
+  int i, n_words = FAT_ENTRIES(fs->sb->fat_type) / 64;
+
+  // s as palavras que mudaram so escritas, para no sujar as pginas do estado partilhado
+  for (i = 0; i < n_words; i++)
+    if (fs->journal->checkpoint_free[i] != ~fs->bitmap[i])
+      fs->journal->checkpoint_free[i] = ~fs->bitmap[i];
+
+  return;
+}
+
+// com LOCK_LOG, depois de escrito o grupo da paridade parity: os blocos que libertou podem voltar a ser
+// usados (as operaes a correr esto no grupo seguinte, que usa o outro mapa)
+void journal_clear_freed(vfs_t *fs, int parity) {
+  journal *j = fs->journal;
+  unsigned long long *word, *limit = j->freed[parity] + FAT_ENTRIES(fs->sb->fat_type) / 64;
+
+  if (__atomic_load_n(&j->shared->n_freed[parity], __ATOMIC_RELAXED) == 0)
+    return;
+  for (word = j->freed[parity]; word < limit; word++)
+    if (*word != 0)
+      __atomic_store_n(word, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&j->shared->n_freed[parity], 0, __ATOMIC_RELEASE);
+
+  return;
+}
+
+// com as operaes paradas: sincroniza a imagem, que passa a ter nas suas posies tudo o que est no
+// dirio e o grupo aberto, e esvazia o dirio (depois de acabar a escrita de um grupo anterior, que pode
+// ainda estar a correr); devolve 0 ou ERR_IO
+int journal_checkpoint(vfs_t *fs) {
+  journal *j = fs->journal;
+  unsigned long long *word;
+  int res = 0;
+
+  image_lock(fs, LOCK_LOG, F_WRLCK, F_OFD_SETLKW);
+  journal_header header = *JOURNAL_HEADER;
+  header.first_seq = header.next_seq;
+  header.tail = JOURNAL_START;
+  header.checkpoint++;
+  if (fdatasync(fs->fd) == -1 || pwrite(j->fd, &header, sizeof(header), JOURNAL_OFFSET) != sizeof(header))
+    res = ERR_IO;
+  image_lock(fs, LOCK_LOG, F_UNLCK, F_OFD_SETLKW);
+  if (res != 0)
+    return res;
+
+  // as imagens anteriores do dirio esvaziado j no servem, e os blocos libertados j esto livres no disco
+  for (word = j->undo_pages; word < (unsigned long long *) j->ranges; word++)
+    if (*word != 0)
+      *word = 0;
+  j->shared->n_freed[0] = 0;
+  j->shared->n_freed[1] = 0;
+  j->shared->undo_lost = 0;
+  journal_free_map(fs);
+  journal_end_group(fs);
+  return 0;
+}
+
+// escreve nas suas posies s as regies do grupo em j->buf (as outras pginas alteradas da imagem ficam
+// para o kernel); podem chegar ao disco antes do grupo, porque se o grupo se perder as imagens anteriores
+// desfazem-nas; devolve 0 ou ERR_IO
+int journal_write_home(vfs_t *fs) {
+  journal_group *group = (journal_group *) fs->journal->buf;
+  char *data = (char *) (group + 1);
+  unsigned int i;
+
+  for (i = 0; i < group->n_ranges; i++)
+  {
+    journal_range *range = (journal_range *) data;
+    if (sync_file_range(fs->fd, range->offset, range->len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1)
+      return ERR_IO;
+    data += sizeof(journal_range) + (range->len + 7) / 8 * 8;
+  }
+
+  return 0;
+}
+
+// fim de uma operao: desbloqueia LOCK_OPS e confirma o grupo aberto se a janela de confirmao j
+// passou (ou se o dirio j vai a meio, ou se faltam imagens anteriores); devolve ERR_IO se a operao
+// alterou regies cujas imagens anteriores no foram escritas, e 0 nos outros casos
+int journal_op(vfs_t *fs) {
+  journal *j = fs->journal;
+  int res = 0;
+
+  if (j == NULL || !j->in_op)
+    return 0;
+  j->in_op = 0;
+  image_lock(fs, LOCK_OPS, F_UNLCK, F_OFD_SETLKW);
+  if (j->undo_failed)
+  {
+    j->undo_failed = 0;
+    res = ERR_IO;
+  }
+
+  // se outro contexto j est a confirmar o grupo, no vale a pena esperar por ele
+  long long start = __atomic_load_n(&j->shared->group_start, __ATOMIC_RELAXED);
+  if (j->window < 0 || j->n_locked > 0 || start == 0 || __atomic_load_n(&j->shared->committing, __ATOMIC_RELAXED))
+    return res;
+  if (j->window == 0 || now_usec() - start >= j->window || __atomic_load_n(&j->shared->undo_lost, __ATOMIC_RELAXED)
+      || JOURNAL_HEADER->tail + __atomic_load_n(&j->shared->bytes, __ATOMIC_RELAXED) > j->log_size / 2)
+    journal_commit(fs);
+
+  return res;
+}
+
+
+// confirma j o grupo de operaes aberto
+int fs_commit(vfs_t *fs) {
+  return journal_commit(fs);
+}
+
+
+// sync - passa todas as alteraes (incluindo as do grupo aberto) para as suas posies, esvaziando o
+// dirio (com o dirio desligado, sincroniza toda a imagem)
+int fs_sync(vfs_t *fs) {
+  journal *j = fs->journal;
+  int res;
+
+  if (j->in_op || j->n_locked > 0)
+    return ERR_AGAIN;
+  journal_lock_ops(fs);
+  res = journal_checkpoint(fs);
+  journal_unlock_ops(fs);
+
+  return res;
+}
+
+
+// muda o modo de sincronizao (VFS_SYNC_*)
+void fs_set_sync(vfs_t *fs, int mode) {
+  if (mode == VFS_SYNC_NONE)
+    fs_set_commit_window(fs, -1);
+  else if (mode == VFS_SYNC_COMMAND)
+    fs_set_commit_window(fs, LLONG_MAX);
+  else if (mode == VFS_SYNC_STRICT)
+    fs_set_commit_window(fs, 0);
+  else
+    fs_set_commit_window(fs, DEFAULT_COMMIT_WINDOW);
+  fs->journal->strict = mode == VFS_SYNC_STRICT;
+
+  return;
+}
+
+
+// muda a janela de confirmao (em microssegundos) dos grupos de operaes: 0 confirma cada operao,
+// -1 desliga o dirio (as alteraes do contexto chegam ao disco quando o kernel as escrever, e podem
+// entrar a meio nos grupos confirmados pelos outros contextos) e LLONG_MAX s confirma os grupos com
+// fs_commit
+void fs_set_commit_window(vfs_t *fs, long long window) {
+  journal *j = fs->journal;
+
+  if (window < 0 && j->window >= 0)
+  {
+    journal_lock_ops(fs);
+    journal_checkpoint(fs);
+    journal_unlock_ops(fs);
+  }
+  j->window = window < 0 ? -1 : window;
+
+  return;
+}
+
+
+// microssegundos que faltam para o grupo aberto ter de ser confirmado (0 se j passou a janela),
+// ou -1 se no h nenhum grupo aberto
+long long fs_commit_pending(vfs_t *fs) {
+  journal *j = fs->journal;
+  long long start = __atomic_load_n(&j->shared->group_start, __ATOMIC_RELAXED);
+
+  if (j->window < 0 || start == 0)
+    return -1;
+  long long left = j->window - (now_usec() - start);
+  return left > 0 ? left : 0;
+}
+
+
+// mkdir - cria o directrio nome_dir
+int fs_mkdir(vfs_t *fs, char *nome_dir) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block, res = resolve_path(fs, nome_dir, &dir_block, name);
+
+  if (res != 0)
+    return res;
+  if (!valid_name(name))
+    return ERR_NAME;
+
+  dir_lock(fs, dir_block, F_WRLCK);
+  if (!dir_valid(fs, dir_block))
+    res = ERR_NOT_FOUND;
+  else if (dir_find(fs, dir_block, name, 0, NULL, NULL) != NULL)
+    res = ERR_EXISTS;
+  else if (!reserve_blocks(fs, dir_full(fs, dir_block, name) + 1))
+    res = ERR_FULL;
+  else
+  {
+    int new_block = get_free_block(fs);
+    init_dir_block(fs, new_block, dir_block);
+    dir_insert(fs, dir_block, TYPE_DIR, name, 0, new_block);
+  }
+  dir_unlock(fs, dir_block);
+  if (journal_op(fs) != 0 && res == 0)
+    res = ERR_IO;
+
+  return res;
+}
+
+
+// cd - muda o directrio corrente para nome_dir, acompanhando cada componente do caminho no caminho
+// guardado do directrio corrente ("." no muda nada e ".." tira o ltimo nvel)
+int fs_chdir(vfs_t *fs, char *nome_dir) {
+  int block = nome_dir[0] == '/' ? fs->sb->root_block : fs->current_dir;
+  int depth = nome_dir[0] == '/' ? 0 : fs->depth;
+  char name[MAX_NAME_LENGHT + 1], *start = nome_dir, *end;
+
+  while (1)
+  {
+    while (*start == '/')
+      start++;
+    if (*start == '\0')
+      break;
+    end = strchrnul(start, '/');
+    if (end - start > MAX_NAME_LENGHT)
+      return ERR_NOT_FOUND;
+    memcpy(name, start, end - start);
+    name[end - start] = '\0';
+    start = end;
+
+    // os nveis escritos at aqui podem j no ser os do caminho guardado, que  reconstrudo se falhar
+    if ((block = lookup_dir(fs, block, name)) == -1)
+    {
+      if (depth != fs->depth)
+        fs->depth = -1;
+      return ERR_NOT_FOUND;
+    }
+    if (depth < 0 || strcmp(name, ".") == 0)
+      continue;
+    if (strcmp(name, "..") == 0)
+      depth -= depth > 0;
+    else
+      path_push(fs, depth++, block, name);
+  }
+
+  fs->current_dir = block;
+  fs->depth = depth;
+
+  return 0;
+}
+
+
+// pwd - escreve em buf (com size bytes) o caminho absoluto do directrio corrente, a partir do caminho
+// guardado (s  reconstrudo a partir da imagem se j no levar ao directrio corrente)
+int fs_getcwd(vfs_t *fs, char *buf, int size) {
+  int pos = 0, i, res;
+
+  if (size < 2)
+    return ERR_INPUT;
+  if (!path_valid(fs) && (res = rebuild_path(fs)) != 0)
+    return res;
+
+  buf[pos++] = '/';
+  for (i = 0; i < fs->depth; i++)
+  {
+    int len = strlen(fs->path[i].name);
+    if (pos + len + 2 > size)
+      return ERR_INPUT;
+    if (i > 0)
+      buf[pos++] = '/';
+    memcpy(buf + pos, fs->path[i].name, len);
+    pos += len;
+  }
+  buf[pos] = '\0';
+
+  return 0;
+}
+
+
+// rmdir - remove o directrio nome_dir (se vazio e no for o directrio corrente)
+int fs_rmdir(vfs_t *fs, char *nome_dir) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block, block, slot, sub_block, res = resolve_path(fs, nome_dir, &dir_block, name);
+
+  if (res != 0)
+    return res;
+  if ((sub_block = lock_dirs(fs, dir_block, dir_block, name)) == -1)
+    return ERR_NOT_FOUND;
+
+  dir_entry *entry = dir_find(fs, dir_block, name, TYPE_DIR, &block, &slot);
+  dir_entry *del_dir = (dir_entry *) BLOCK(sub_block);
+
+  if (entry == NULL)
+    res = ERR_NOT_FOUND;
+  else if (!valid_name(name))
+    res = ERR_NAME;
+  else if (del_dir[0].size != 2)
+    res = ERR_NOT_EMPTY;
+  else if (sub_block == fs->current_dir)
+    res = ERR_INPUT;
+  else
+  {
+    // a gerao muda para que os ndices do directrio nos outros contextos sejam descartados
+    drop_index(fs, sub_block);
+    dir_changed(fs, sub_block, NULL);
+    delete_block(fs, sub_block);
+    dir_remove(fs, dir_block, block, slot);
+  }
+  unlock_dirs(fs, dir_block, dir_block, sub_block);
+  if (journal_op(fs) != 0 && res == 0)
+    res = ERR_IO;
+
+  return res;
+}
+
+
+// abre o directrio nome_dir (ou o directrio corrente, se nome_dir for NULL) para ler as entradas; o
+// directrio fica bloqueado para leitura at fs_closedir, e o contexto no o deve alterar entretanto (nem
+// confirmar o grupo aberto, que podia ter de esperar por uma operao  espera do directrio)
+vfs_dir *fs_opendir(vfs_t *fs, char *nome_dir, int *error) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block = fs->current_dir, parent;
+
+  if (nome_dir != NULL)
+  {
+    if ((*error = resolve_path(fs, nome_dir, &parent, name)) != 0)
+      return NULL;
+    dir_block = lookup_dir(fs, parent, name);
+  }
+
+  if (dir_block != -1)
+  {
+    dir_lock(fs, dir_block, F_RDLCK);
+    if (!dir_valid(fs, dir_block))
+    {
+      dir_unlock(fs, dir_block);
+      dir_block = -1;
+    }
+  }
+  if (dir_block == -1)
+  {
+    *error = ERR_NOT_FOUND;
+    return NULL;
+  }
+
+  vfs_dir *dir = (vfs_dir *) malloc(sizeof(vfs_dir));
+  dir->fs = fs;
+  dir->dir_block = dir_block;
+  dir->block = dir_block;
+  dir->slot = -1;
+  return dir;
+}
+
+
+// copia para entry a prxima entrada do directrio ("." e ".." primeiro e depois as outras, pela ordem
+// dos nomes); devolve 0 quando j no h mais entradas
+int fs_readdir(vfs_dir *dir, dir_entry *entry) {
+  dir_entry *next;
+
+  if (dir->block == -1 || (next = dir_next(dir->fs, &dir->block, &dir->slot)) == NULL)
+    return 0;
+  *entry = *next;
+
+  return 1;
+}
+
+// posiciona o directrio aberto dir antes da primeira entrada (depois de "." e "..") com nome igual ou
+// posterior a name, para que fs_readdir continue da pela ordem dos nomes
+void fs_seekdir(vfs_dir *dir, char *name) {
+  vfs_t *fs = dir->fs;
+  dir_index *idx = get_index(fs, dir->dir_block);
+  char key[NAME_KEY_SIZE];
+
+  name_key(key, name);
+  int b = index_block(fs, idx, key);
+  dir->block = idx->chain[b];
+  dir->slot = block_search(fs, (dir_entry *) BLOCK(dir->block), b == 0 ? 2 : 0, idx->used[b], key) - 1;
+
+  return;
+}
+
+
+void fs_closedir(vfs_dir *dir) {
+  dir_unlock(dir->fs, dir->dir_block);
+  free(dir);
+  return;
+}
+
+
+// abre o ficheiro nome_fich no modo mode; devolve NULL (e o cdigo do erro em error)
+vfs_file *fs_open(vfs_t *fs, char *nome_fich, int mode, int *error) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block;
+
+  if ((*error = resolve_path(fs, nome_fich, &dir_block, name)) != 0)
+    return NULL;
+  nome_fich = name;
+
+  dir_entry *entry = NULL;
+  dir_lock(fs, dir_block, (mode & (VFS_CREATE | VFS_TRUNC)) ? F_WRLCK : F_RDLCK);
+  if (!dir_valid(fs, dir_block))
+    *error = ERR_NOT_FOUND;
+  else if ((entry = dir_find(fs, dir_block, nome_fich, 0, NULL, NULL)) != NULL && entry->type == TYPE_DIR)
+  {
+    *error = ERR_EXISTS;
+    entry = NULL;
+  }
+  else if (entry == NULL)
+  {
+    if (!(mode & VFS_CREATE))
+      *error = ERR_NOT_FOUND;
+    else if (!valid_name(nome_fich))
+      *error = ERR_NAME;
+    else if (!reserve_blocks(fs, dir_full(fs, dir_block, nome_fich)))
+      *error = ERR_FULL;
+    else
+      entry = dir_insert(fs, dir_block, TYPE_FILE, nome_fich, 0, -1);
+  }
+  else if ((mode & VFS_TRUNC) && (mode & VFS_WRITE) && entry->first_block != -1)
+  {
+    journal_mark(fs, entry, sizeof(dir_entry));
+    release_chain(fs, entry->first_block);
+    entry->first_block = -1;
+    entry->size = 0;
+  }
+
+  if (entry == NULL)
+  {
+    dir_unlock(fs, dir_block);
+    journal_op(fs);
+    return NULL;
+  }
+
+  vfs_file *file = (vfs_file *) malloc(sizeof(vfs_file));
+  file->fs = fs;
+  file->dir_block = dir_block;
+  strncpy(file->name, entry->name, MAX_NAME_LENGHT);
+  file->name[MAX_NAME_LENGHT] = '\0';
+  file->mode = mode;
+  file->pos = 0;
+  file->generation = __atomic_load_n(&fs->sb->generation, __ATOMIC_ACQUIRE);
+  file->cur_index = -1;
+  file->cur_block = -1;
+  file->private_blocks = 0;
+  file->n_skip = 0;
+  file->skip_size = 0;
+  file->skip = NULL;
+  file->advised = 0;
+  dir_unlock(fs, dir_block);
+  if (journal_op(fs) != 0)
+  {
+    free(file);
+    *error = ERR_IO;
+    return NULL;
+  }
+  return file;
+}
+
+
+// devolve a entrada do ficheiro aberto file (ou NULL, se j no existir), com o seu directrio j
+// bloqueado, esquecendo as posies guardadas se alguma cadeia tiver sido religada ou libertada desde
+// que foram obtidas, ou se o nome passou entretanto a ser de outro ficheiro
+dir_entry *file_entry(vfs_file *file) {
+  vfs_t *fs = file->fs;
+  unsigned int generation = __atomic_load_n(&fs->sb->generation, __ATOMIC_ACQUIRE);
+
+  if (!dir_valid(fs, file->dir_block))
+    return NULL;
+  dir_entry *entry = dir_find(fs, file->dir_block, file->name, TYPE_FILE, NULL, NULL);
+
+  if (file->generation != generation || (entry != NULL && file->n_skip > 0 && file->skip[0] != entry->first_block))
+  {
+    file->generation = generation;
+    file->cur_index = -1;
+    file->private_blocks = 0;
+    file->n_skip = 0;
+  }
+
+  return entry;
+}
+
+
+// acrescenta block ao ndice de saltos do ficheiro aberto
+void skip_push(vfs_file *file, int block) {
+  if (file->n_skip == file->skip_size)
+  {
+    file->skip_size = file->skip_size ? 2 * file->skip_size : 16;
+    file->skip = (int *) realloc(file->skip, file->skip_size * sizeof(int));
+  }
+  file->skip[file->n_skip++] = block;
+
+  return;
+}
+
+
+// devolve o bloco fsico correspondente ao bloco lgico index do ficheiro aberto; o percurso da
+// cadeia parte da entrada do ndice de saltos anterior a index (no mximo SKIP_INTERVAL ligaes)
+// ou do ltimo bloco visitado, se estiver mais perto, e acrescenta ao ndice os blocos que atravessa
+int file_block(vfs_file *file, dir_entry *entry, int index) {
+  vfs_t *fs = file->fs;
+  int i = 0, block = entry->first_block;
+
+  if (file->n_skip == 0)
+    skip_push(file, block);
+  else
+  {
+    int j = index / SKIP_INTERVAL < file->n_skip ? index / SKIP_INTERVAL : file->n_skip - 1;
+    i = j * SKIP_INTERVAL;
+    block = file->skip[j];
+  }
+  if (file->cur_index != -1 && file->cur_index <= index && file->cur_index > i)
+  {
+    i = file->cur_index;
+    block = file->cur_block;
+  }
+  while (i < index)
+  {
+    block = fat_get(fs, block);
+    if (++i % SKIP_INTERVAL == 0 && i / SKIP_INTERVAL == file->n_skip)
+      skip_push(file, block);
+  }
+
+  file->cur_index = index;
+  file->cur_block = block;
+  return block;
+}
+
+
+// copia len bytes entre buf e o ficheiro aberto, a partir da posio offset do ficheiro;
+// se write for 1 copia de buf para o ficheiro (ou escreve zeros, se buf for NULL)
+void file_copy(vfs_file *file, dir_entry *entry, long long offset, char *buf, long long len, int write) {
+  vfs_t *fs = file->fs;
+  long long len_total = len;
+  int block_size = fs->sb->block_size;
+  int index = offset / block_size, in_block = offset % block_size;
+  int block = file_block(file, entry, index);
+
+  // as pginas escritas so mapeadas de uma vez por cada sequncia contgua, em vez de uma falta de
+  // pgina por cada uma
+  if (write && len > block_size)
+    chain_advise(fs, block, in_block, len, MADV_POPULATE_WRITE);
+
+  while (len > 0)
+  {
+    long long chunk = block_size - in_block;
+    if (chunk > len)
+      chunk = len;
+
+    char *data = BLOCK(block) + in_block;
+    if (!write)
+      memcpy(buf, data, chunk);
+    else if (buf == NULL)
+      memset(data, 0, chunk);
+    else
+      memcpy(data, buf, chunk);
+    if (write)
+      journal_data(fs, data, chunk);
+
+    if (buf != NULL)
+      buf += chunk;
+    len -= chunk;
+    in_block = 0;
+    if (len > 0)
+      block = file_block(file, entry, ++index);
+  }
+
+  // uma leitura sequencial mapeia os blocos seguintes da cadeia antes de l chegar
+  if (!write && offset + len_total > file->advised - PREFETCH_SIZE / 2 && offset + len_total < entry->size)
+  {
+    chain_advise(fs, fat_get(fs, block), 0, PREFETCH_SIZE, MADV_POPULATE_READ);
+    file->advised = (long long) (index + 1) * block_size + PREFETCH_SIZE;
+  }
+
+  return;
+}
+
+
+
+
+// l at n bytes do ficheiro aberto para buf, a partir da posio corrente
+long long fs_read(vfs_file *file, void *buf, long long n) {
+  vfs_t *fs = file->fs;
+  dir_entry *entry;
+
+  if (!(file->mode & VFS_READ))
+    return -ERR_INPUT;
+
+  dir_lock(fs, file->dir_block, F_RDLCK);
+  if ((entry = file_entry(file)) == NULL)
+    n = -ERR_NOT_FOUND;
+  else if (file->pos >= entry->size || n <= 0)
+    n = 0;
+  else
+  {
+    if (n > entry->size - file->pos)
+      n = entry->size - file->pos;
+
+    file_copy(file, entry, file->pos, (char *) buf, n, 0);
+    file->pos += n;
+  }
+  dir_unlock(fs, file->dir_block);
+
+  return n;
+}
+
+
+// envia at n bytes do ficheiro aberto para o descritor fd (um socket, por exemplo), a partir da
+// posio corrente, com sendfile directamente da imagem; devolve os bytes enviados, que podem ser
+// menos que n se o ficheiro acabar ou fd no aceitar mais sem bloquear, ou -ERR_AGAIN se fd no
+// aceitou nenhum
+long long fs_sendfile(vfs_file *file, int fd, long long n) {
+  vfs_t *fs = file->fs;
+  int block_size = fs->sb->block_size;
+  long long sent = 0;
+  dir_entry *entry;
+
+  if (!(file->mode & VFS_READ))
+    return -ERR_INPUT;
+
+  dir_lock(fs, file->dir_block, F_RDLCK);
+  if ((entry = file_entry(file)) == NULL)
+    sent = -ERR_NOT_FOUND;
+  else if (n > entry->size - file->pos)
+    n = entry->size - file->pos;
+
+  // cada sequncia de blocos contguos  enviada com uma s chamada
+  while (sent >= 0 && sent < n)
+  {
+    int index = file->pos / block_size, in_block = file->pos % block_size;
+    int block = file_block(file, entry, index), run = 1;
+    long long len = block_size - in_block;
+
+    while (len < n - sent && fat_get(fs, block + run - 1) == block + run)
+    {
+      run++;
+      len += block_size;
+    }
+    if (len > n - sent)
+      len = n - sent;
+
+    off_t offset = BLOCK_OFFSET(block) + in_block;
+    ssize_t res = sendfile(fd, fs->fd, &offset, len);
+    if (res == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (sent == 0)
+        sent = errno == EAGAIN || errno == EWOULDBLOCK ? -ERR_AGAIN : -ERR_IO;
+      break;
+    }
+
+    sent += res;
+    file->pos += res;
+    if (res < len)
+      break;
+    // a sequncia seguinte da cadeia  pedida enquanto esta  enviada
+    if (sent < n)
+      chain_advise(fs, fat_get(fs, block + run - 1), 0, n - sent < PREFETCH_SIZE ? n - sent : PREFETCH_SIZE, MADV_WILLNEED);
+  }
+  dir_unlock(fs, file->dir_block);
+
+  return sent;
+}
+
+
+// escreve n bytes de buf no ficheiro aberto, a partir da posio corrente; os blocos partilhados
+// com cpias do ficheiro so copiados antes de serem alterados e um buraco deixado por fs_lseek
+// para l do fim do ficheiro fica com zeros
+long long fs_write(vfs_file *file, const void *buf, long long n) {
+  vfs_t *fs = file->fs;
+  dir_entry *entry;
+
+  if (!(file->mode & VFS_WRITE))
+    return -ERR_INPUT;
+
+  dir_lock(fs, file->dir_block, F_WRLCK);
+  if ((entry = file_entry(file)) == NULL)
+    n = -ERR_NOT_FOUND;
+  else if (n > 0)
+    n = file_write(file, entry, (const char *) buf, n);
+  else
+    n = 0;
+  dir_unlock(fs, file->dir_block);
+  if (journal_op(fs) != 0 && n >= 0)
+    n = -ERR_IO;
+
+  return n;
+}
+
+
+// fs_write com o directrio do ficheiro j bloqueado para escrita
+long long file_write(vfs_file *file, dir_entry *entry, const char *buf, long long n) {
+  vfs_t *fs = file->fs;
+  int block_size = fs->sb->block_size;
+
+  long long end = file->pos + n;
+  if ((end - 1) / block_size >= FAT_ENTRIES(fs->sb->fat_type))
+    return -ERR_FULL;
+
+  int n_blocks = (entry->size + block_size - 1) / block_size;
+  int last = (end - 1) / block_size;               // ltimo bloco lgico escrito
+  int last_old = last < n_blocks ? last : n_blocks - 1;  // ltimo bloco j existente que  alterado
+  int new_blocks = last + 1 - n_blocks > 0 ? last + 1 - n_blocks : 0;
+  int copies = 0, i;
+
+  // a partir do primeiro bloco partilhado, todos os seguintes so alcanados tambm pelas cpias
+  for (i = file->private_blocks; i <= last_old; i++)
+    if (__atomic_load_n(&fs->refs[file_block(file, entry, i)], __ATOMIC_ACQUIRE) > 1)
+    {
+      copies = last_old - i + 1;
+      break;
+    }
+
+  if (!reserve_blocks(fs, copies + new_blocks))
+    return -ERR_FULL;
+  journal_mark(fs, entry, sizeof(dir_entry));
+
+  if (copies > 0)
+  {
+    // as outras cpias podem ter deixado entretanto de partilhar alguns blocos
+    int used;
+    unshare_block(fs, entry, last_old, &used);
+    unreserve_blocks(fs, copies - used);
+    file->generation = __atomic_load_n(&fs->sb->generation, __ATOMIC_ACQUIRE);
+    file->cur_index = -1;
+    file->n_skip = 0;
+  }
+  if (last_old + 1 > file->private_blocks)
+    file->private_blocks = last_old + 1;
+
+  if (new_blocks > 0)
+  {
+    int first_new = get_free_chain(fs, new_blocks);
+    if (n_blocks == 0)
+    {
+      entry->first_block = first_new;
+      file->n_skip = 0;
+      file->cur_index = -1;
+    }
+    else
+      fat_set(fs, file_block(file, entry, n_blocks - 1), first_new);
+    file->private_blocks = last + 1;
+  }
+
+  if (file->pos > entry->size)
+    file_copy(file, entry, entry->size, NULL, file->pos - entry->size, 1);
+  file_copy(file, entry, file->pos, (char *) buf, n, 1);
+
+  file->pos = end;
+  if (end > entry->size)
+    entry->size = end;
+
+  return n;
+}
+
+
+// muda a posio corrente do ficheiro aberto (whence  SEEK_SET, SEEK_CUR ou SEEK_END);
+// devolve a nova posio ou -ERR_*
+long long fs_lseek(vfs_file *file, long long offset, int whence) {
+  vfs_t *fs = file->fs;
+  dir_entry *entry;
+
+  if (whence == SEEK_CUR)
+    offset += file->pos;
+  else if (whence == SEEK_END)
+  {
+    dir_lock(fs, file->dir_block, F_RDLCK);
+    if ((entry = file_entry(file)) != NULL)
+      offset += entry->size;
+    dir_unlock(fs, file->dir_block);
+    if (entry == NULL)
+      return -ERR_NOT_FOUND;
+  }
+  else if (whence != SEEK_SET)
+    return -ERR_INPUT;
+
+  if (offset < 0)
+    return -ERR_INPUT;
+
+  file->pos = offset;
+  return offset;
+}
+
+
+int fs_close(vfs_file *file) {
+  free(file->skip);
+  free(file);
+  return 0;
+}
+
+
+// get - copia o ficheiro UNIX aberto em finput para o ficheiro nome_dest (substituindo-o, se j existir)
+int fs_import(vfs_t *fs, int finput, char *nome_dest) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block, res = resolve_path(fs, nome_dest, &dir_block, name);
+
+  if (res != 0)
+    return res;
+
+  dir_lock(fs, dir_block, F_WRLCK);
+  if (!dir_valid(fs, dir_block))
+    res = ERR_NOT_FOUND;
+  else
+    res = import_file(fs, dir_block, finput, name);
+  dir_unlock(fs, dir_block);
+  if (journal_op(fs) != 0 && res == 0)
+    res = ERR_IO;
+
+  return res;
+}
+
+
+// fs_import com o directrio dir_block j bloqueado para escrita
+int import_file(vfs_t *fs, int dir_block, int finput, char *nome_dest) {
+  dir_entry *entry = dir_find(fs, dir_block, nome_dest, 0, NULL, NULL);
+  struct stat statbuf;
+
+  if (entry == NULL && !valid_name(nome_dest))
+    return ERR_NAME;
+  if (entry != NULL && entry->type == TYPE_DIR)
+    return ERR_EXISTS;
+  if (fstat(finput, &statbuf) == -1)
+    return ERR_IO;
+
+  long long req_size = statbuf.st_size;
+  // um ficheiro vazio no ocupa nenhum bloco (first_block fica a -1)
+  int data_blocks = (req_size + fs->sb->block_size - 1) / fs->sb->block_size;
+  int dir_blocks = entry == NULL && dir_full(fs, dir_block, nome_dest);
+
+  if (!reserve_blocks(fs, dir_blocks + data_blocks))
+    return ERR_FULL;
+
+  int first_block = get_free_chain(fs, data_blocks);
+  if (read_chain(fs, finput, first_block, req_size) == -1)
+  {
+    delete_chain(fs, first_block);
+    unreserve_blocks(fs, dir_blocks);
+    return ERR_IO;
+  }
+
+  if (entry == NULL)
+    dir_insert(fs, dir_block, TYPE_FILE, nome_dest, req_size, first_block);
+  else
+  {
+    journal_mark(fs, entry, sizeof(dir_entry));
+    release_chain(fs, entry->first_block);
+    init_dir_entry(entry, TYPE_FILE, nome_dest, req_size, first_block);
+  }
+
+  return 0;
+}
+
+
+// put / cat - escreve o ficheiro nome_orig no ficheiro UNIX aberto em foutput
+int fs_export(vfs_t *fs, char *nome_orig, int foutput) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block, res = resolve_path(fs, nome_orig, &dir_block, name);
+  dir_entry *entry = NULL;
+
+  if (res != 0)
+    return res;
+
+  dir_lock(fs, dir_block, F_RDLCK);
+  if (dir_valid(fs, dir_block))
+    entry = dir_find(fs, dir_block, name, TYPE_FILE, NULL, NULL);
+
+  if (entry == NULL)
+    res = ERR_NOT_FOUND;
+  else if (write_chain(fs, foutput, entry->first_block, entry->size) == -1)
+    res = ERR_IO;
+  dir_unlock(fs, dir_block);
+
+  return res;
+}
+
+
+// cp - copia o ficheiro nome_orig para nome_dest (ou para dentro do directrio nome_dest)
+int fs_copy(vfs_t *fs, char *nome_orig, char *nome_dest) {
+  char orig[MAX_NAME_LENGHT + 1], dest[MAX_NAME_LENGHT + 1];
+  int src_dir, dst_dir, sub_block, res;
+
+  if ((res = resolve_path(fs, nome_orig, &src_dir, orig)) != 0 || (res = resolve_path(fs, nome_dest, &dst_dir, dest)) != 0)
+    return res;
+  if ((sub_block = lock_dirs(fs, src_dir, dst_dir, dest)) == -1)
+    return ERR_NOT_FOUND;
+
+  res = copy_file(fs, src_dir, orig, dst_dir, dest);
+  unlock_dirs(fs, src_dir, dst_dir, sub_block);
+  if (journal_op(fs) != 0 && res == 0)
+    res = ERR_IO;
+
+  return res;
+}
+
+
+// fs_copy com os directrios de origem e de destino j bloqueados para escrita (com lock_dirs)
+int copy_file(vfs_t *fs, int src_dir, char *nome_orig, int dst_dir, char *nome_dest) {
+  int exp_dir = dst_dir;
+  dir_entry *entry = dir_find(fs, src_dir, nome_orig, TYPE_FILE, NULL, NULL);
+
+  if (entry == NULL)
+    return ERR_NOT_FOUND;
+
+  int inp_block = entry->first_block;
+  long long req_size = entry->size;
+
+  dir_entry *target = dir_find(fs, dst_dir, nome_dest, 0, NULL, NULL);
+  if (target != NULL && target->type == TYPE_DIR)
+  {
+    exp_dir = target->first_block;
+    nome_dest = nome_orig;
+    target = dir_find(fs, exp_dir, nome_dest, 0, NULL, NULL);
+  }
+  if (target == entry)
+    return 0;
+  if (target == NULL && !valid_name(nome_dest))
+    return ERR_NAME;
+  if (target != NULL && target->type == TYPE_DIR)
+    return ERR_EXISTS;
+
+  // um destino que j existe  substitudo na sua prpria entrada
+  int dir_blocks = target == NULL && dir_full(fs, exp_dir, nome_dest);
+
+  if (!reserve_blocks(fs, dir_blocks))
+    return ERR_FULL;
+
+  // a cpia partilha a cadeia do original at um deles ser alterado
+  if (inp_block != -1 && !share_block(fs, inp_block) && (inp_block = copy_chain(fs, inp_block)) == -1)
+  {
+    unreserve_blocks(fs, dir_blocks);
+    return ERR_FULL;
+  }
+
+  if (target == NULL)
+    dir_insert(fs, exp_dir, TYPE_FILE, nome_dest, req_size, inp_block);
+  else
+  {
+    journal_mark(fs, target, sizeof(dir_entry));
+    release_chain(fs, target->first_block);
+    init_dir_entry(target, TYPE_FILE, nome_dest, req_size, inp_block);
+  }
+
+  return 0;
+}
+
+
+// mv - muda o nome da entrada nome_orig para nome_dest (ou move-a para dentro do directrio nome_dest)
+int fs_rename(vfs_t *fs, char *nome_orig, char *nome_dest) {
+  char orig[MAX_NAME_LENGHT + 1], dest[MAX_NAME_LENGHT + 1];
+  int src_dir, dst_dir, sub_block, res;
+
+  if ((res = resolve_path(fs, nome_orig, &src_dir, orig)) != 0 || (res = resolve_path(fs, nome_dest, &dst_dir, dest)) != 0)
+    return res;
+  if ((sub_block = lock_dirs(fs, src_dir, dst_dir, dest)) == -1)
+    return ERR_NOT_FOUND;
+
+  res = rename_entry(fs, src_dir, orig, dst_dir, dest);
+  unlock_dirs(fs, src_dir, dst_dir, sub_block);
+  if (journal_op(fs) != 0 && res == 0)
+    res = ERR_IO;
+
+  return res;
+}
+
+
+// fs_rename com os directrios de origem e de destino j bloqueados para escrita (com lock_dirs)
+int rename_entry(vfs_t *fs, int src_dir, char *nome_orig, int dst_dir, char *nome_dest) {
+  int exp_dir = dst_dir, block, slot;
+  dir_entry *entry = dir_find(fs, src_dir, nome_orig, 0, &block, &slot);
+
+  if (entry == NULL || strcmp(nome_orig, ".") == 0 || strcmp(nome_orig, "..") == 0)
+    return ERR_NOT_FOUND;
+
+  dir_entry moved = *entry;
+
+  dir_entry *target = dir_find(fs, dst_dir, nome_dest, 0, NULL, NULL);
+  if (target != NULL && target->type == TYPE_DIR)
+  {
+    exp_dir = target->first_block;
+    nome_dest = nome_orig;
+    target = dir_find(fs, exp_dir, nome_dest, 0, NULL, NULL);
+  }
+  if (target == entry)
+    return 0;
+  if (moved.type == TYPE_DIR && dir_contains(fs, moved.first_block, exp_dir))
+    return ERR_INPUT;
+  if (target == NULL && !valid_name(nome_dest))
+    return ERR_NAME;
+  if (target != NULL && target->type == TYPE_DIR)
+    return ERR_EXISTS;
+
+  if (target == NULL && !reserve_blocks(fs, dir_full(fs, exp_dir, nome_dest)))
+    return ERR_FULL;
+
+  // o ficheiro substitudo d lugar  entrada movida, na mesma posio, antes de a original ser removida
+  // (que pode por isso mudar de posio); com um nome novo a entrada  acrescentada na posio que lhe
+  // cabe na ordem dos nomes, mesmo dentro do mesmo directrio (onde mantm a data)
+  if (target != NULL)
+  {
+    journal_mark(fs, target, sizeof(dir_entry));
+    release_chain(fs, target->first_block);
+    init_dir_entry(target, moved.type, nome_dest, moved.size, moved.first_block);
+  }
+  else
+  {
+    target = dir_insert(fs, exp_dir, moved.type, nome_dest, moved.size, moved.first_block);
+    if (exp_dir == src_dir)
+    {
+      target->day = moved.day;
+      target->month = moved.month;
+      target->year = moved.year;
+    }
+  }
+
+  dir_find(fs, src_dir, nome_orig, moved.type, &block, &slot);
+  dir_remove(fs, src_dir, block, slot);
+
+  // a entrada ".." do directrio movido muda, e com ela as entradas guardadas nas caches
+  if (moved.type == TYPE_DIR)
+  {
+    dir_entry *parent = &((dir_entry *) BLOCK(moved.first_block))[1];
+    journal_mark(fs, parent, sizeof(dir_entry));
+    parent->first_block = exp_dir;
+    dir_changed(fs, moved.first_block, find_index(fs, moved.first_block));
+  }
+
+  return 0;
+}
+
+
+// rm - remove o ficheiro nome_fich
+int fs_unlink(vfs_t *fs, char *nome_fich) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block, block, slot, res = resolve_path(fs, nome_fich, &dir_block, name);
+  dir_entry *entry = NULL;
+
+  if (res != 0)
+    return res;
+
+  dir_lock(fs, dir_block, F_WRLCK);
+  if (dir_valid(fs, dir_block))
+    entry = dir_find(fs, dir_block, name, TYPE_FILE, &block, &slot);
+
+  if (entry == NULL)
+    res = ERR_NOT_FOUND;
+  else
+  {
+    release_chain(fs, entry->first_block);
+    dir_remove(fs, dir_block, block, slot);
+  }
+  dir_unlock(fs, dir_block);
+  if (journal_op(fs) != 0 && res == 0)
+    res = ERR_IO;
+
+  return res;
+}
+
+
+// cp -r - copia o directrio nome_orig (com todo o seu contedo) para nome_dest, ou para dentro do
+// directrio nome_dest; a cpia  construda fora da rvore, com os subdirectrios copiados em
+// paralelo, e s  acrescentada ao directrio de destino no fim (um ficheiro  copiado como em fs_copy)
+int fs_copy_tree(vfs_t *fs, char *nome_orig, char *nome_dest) {
+  char orig[MAX_NAME_LENGHT + 1], dest[MAX_NAME_LENGHT + 1], *name = dest;
+  int src_dir, dst_dir, sub_block, src_block = -1, root = -1, res;
+
+  if ((res = resolve_path(fs, nome_orig, &src_dir, orig)) != 0 || (res = resolve_path(fs, nome_dest, &dst_dir, dest)) != 0)
+    return res;
+  if ((sub_block = lock_dirs(fs, src_dir, dst_dir, dest)) == -1)
+    return ERR_NOT_FOUND;
+
+  int exp_dir = dst_dir;
+  dir_entry *entry = dir_find(fs, src_dir, orig, 0, NULL, NULL);
+  if (entry != NULL && entry->type == TYPE_FILE)
+  {
+    res = copy_file(fs, src_dir, orig, dst_dir, dest);
+    unlock_dirs(fs, src_dir, dst_dir, sub_block);
+    if (journal_op(fs) != 0 && res == 0)
+      res = ERR_IO;
+    return res;
+  }
+
+  dir_entry *target = dir_find(fs, dst_dir, dest, 0, NULL, NULL);
+  if (target != NULL && target->type == TYPE_DIR)
+  {
+    exp_dir = target->first_block;
+    name = orig;
+    target = dir_find(fs, exp_dir, name, 0, NULL, NULL);
+  }
+
+  if (entry == NULL)
+    res = ERR_NOT_FOUND;
+  else if (target != NULL)
+    res = ERR_EXISTS;
+  else if (!valid_name(name))
+    res = ERR_NAME;
+  else if (!reserve_blocks(fs, 1))
+    res = ERR_FULL;
+  else
+  {
+    src_block = entry->first_block;
+    root = get_free_block(fs);
+    count_walk(fs, 1);
+  }
+  unlock_dirs(fs, src_dir, dst_dir, sub_block);
+  // as threads do percurso confirmam os grupos, e por isso o contexto no pode ter operaes a meio
+  int lost = journal_op(fs);
+  if (res != 0)
+    return res;
+
+  res = walk_tree(fs, 1, src_block, root, exp_dir);
+
+  // o destino pode ter mudado enquanto a cpia era construda
+  if (res == 0)
+  {
+    dir_lock(fs, exp_dir, F_WRLCK);
+    if (!dir_valid(fs, exp_dir))
+      res = ERR_NOT_FOUND;
+    else if (dir_find(fs, exp_dir, name, 0, NULL, NULL) != NULL)
+      res = ERR_EXISTS;
+    else if (!reserve_blocks(fs, dir_full(fs, exp_dir, name)))
+      res = ERR_FULL;
+    else
+    {
+      dir_insert(fs, exp_dir, TYPE_DIR, name, 0, root);
+      count_walk(fs, -1);
+    }
+    dir_unlock(fs, exp_dir);
+  }
+  if (journal_op(fs) != 0)
+    lost = ERR_IO;
+  if (res != 0)
+  {
+    walk_tree(fs, 0, root, -1, -1);
+    count_walk(fs, -1);
+    journal_op(fs);
+  }
+
+  return res != 0 ? res : lost;
+}
+
+
+// rm -r - remove o directrio nome_dir com todo o seu contedo: a entrada  retirada logo do directrio
+// pai e a rvore  depois libertada em paralelo (um ficheiro  removido como em fs_unlink); como em
+// fs_rename, no remove o directrio corrente nem um dos que o contm
+int fs_remove_tree(vfs_t *fs, char *nome_dir) {
+  char name[MAX_NAME_LENGHT + 1];
+  int dir_block, block, slot, sub_block, res;
+  dir_entry *entry;
+
+  if ((res = resolve_path(fs, nome_dir, &dir_block, name)) != 0)
+    return res;
+  if ((sub_block = lock_dirs(fs, dir_block, dir_block, name)) == -1)
+    return ERR_NOT_FOUND;
+
+  if ((entry = dir_find(fs, dir_block, name, 0, &block, &slot)) == NULL)
+    res = ERR_NOT_FOUND;
+  else if (!valid_name(name))
+    res = ERR_NAME;
+  else if (entry->type == TYPE_DIR && dir_contains(fs, sub_block, fs->current_dir))
+    res = ERR_INPUT;
+  else
+  {
+    if (entry->type == TYPE_FILE)
+      release_chain(fs, entry->first_block);
+    else
+      count_walk(fs, 1);
+    dir_remove(fs, dir_block, block, slot);
+  }
+  unlock_dirs(fs, dir_block, dir_block, sub_block);
+  int lost = journal_op(fs);
+
+  if (res == 0 && sub_block != dir_block)
+  {
+    walk_tree(fs, 0, sub_block, -1, -1);
+    count_walk(fs, -1);
+    if (journal_op(fs) != 0)
+      lost = ERR_IO;
+  }
+
+  return res != 0 ? res : lost;
+}
+
+
+// muda o nmero mximo de threads (incluindo a que chama a funo) que percorrem as rvores de
+// fs_copy_tree e fs_remove_tree; por omisso  o nmero de processadores
+void fs_set_workers(vfs_t *fs, int n) {
+  fs->workers = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : n;
+  return;
+}
+
+
+// percorre a rvore que comea no directrio src, copiando-a (copy = 1) para o bloco dst, j alocado, com
+// o directrio pai parent, ou libertando-a (a rvore j no deve estar ligada a nenhum directrio); a thread
+// que chama a funo  uma das que percorrem a rvore e as outras so iniciadas quando h directrios
+// por percorrer e nenhuma est livre; devolve o primeiro erro
+int walk_tree(vfs_t *fs, int copy, int src, int dst, int parent) {
+  tree_walk walk;
+  int i;
+
+  memset(&walk, 0, sizeof(walk));
+  walk.fs = fs;
+  walk.copy = copy;
+  pthread_mutex_init(&walk.mutex, NULL);
+  pthread_cond_init(&walk.cond, NULL);
+  walk.tasks_size = 64;
+  walk.tasks = (tree_task *) malloc(walk.tasks_size * sizeof(tree_task));
+  walk.tasks[walk.n_tasks++] = (tree_task) {src, dst, parent};
+
+  tree_run(&walk, fs);
+  for (i = 0; i < walk.n_threads; i++)
+    pthread_join(walk.threads[i], NULL);
+
+  pthread_mutex_destroy(&walk.mutex);
+  pthread_cond_destroy(&walk.cond);
+  free(walk.tasks);
+
+  return walk.error;
+}
+
+// acrescenta o directrio src s tarefas por fazer, iniciando mais uma thread se nenhuma estiver livre
+void tree_push(tree_walk *walk, int src, int dst, int parent) {
+  pthread_mutex_lock(&walk->mutex);
+  if (walk->n_tasks == walk->tasks_size)
+  {
+    walk->tasks_size *= 2;
+    walk->tasks = (tree_task *) realloc(walk->tasks, walk->tasks_size * sizeof(tree_task));
+  }
+  walk->tasks[walk->n_tasks++] = (tree_task) {src, dst, parent};
+
+  if (walk->idle > 0)
+    pthread_cond_signal(&walk->cond);
+  else if (walk->n_threads < walk->fs->workers - 1
+           && pthread_create(&walk->threads[walk->n_threads], NULL, tree_worker, walk) == 0)
+    walk->n_threads++;
+  pthread_mutex_unlock(&walk->mutex);
+
+  return;
+}
+
+// percorre, com o contexto fs, os directrios por fazer at no haver mais nenhum nem nenhum a ser percorrido
+void tree_run(tree_walk *walk, vfs_t *fs) {
+  pthread_mutex_lock(&walk->mutex);
+  while (walk->n_tasks > 0 || walk->busy > 0)
+  {
+    if (walk->n_tasks == 0)
+    {
+      walk->idle++;
+      pthread_cond_wait(&walk->cond, &walk->mutex);
+      walk->idle--;
+      continue;
+    }
+
+    tree_task task = walk->tasks[--walk->n_tasks];
+    walk->busy++;
+    pthread_mutex_unlock(&walk->mutex);
+
+    if (walk->copy)
+      copy_dir(fs, walk, &task);
+    else
+      remove_dir(fs, walk, &task);
+    if (journal_op(fs) != 0)
+      __atomic_store_n(&walk->error, ERR_IO, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&walk->mutex);
+    if (--walk->busy == 0 && walk->n_tasks == 0)
+      pthread_cond_broadcast(&walk->cond);
+  }
+  pthread_mutex_unlock(&walk->mutex);
+
+  return;
+}
+
+// thread do percurso: monta a imagem com um contexto prprio (com o seu descritor, para que os bloqueios
+// dos directrios a excluam das outras) e com as mesmas opes do contexto de quem pediu a operao
+void *tree_worker(void *arg) {
+  tree_walk *walk = (tree_walk *) arg;
+  int error;
+  vfs_t *fs = fs_mount(walk->fs->name, &error);
+
+  if (fs == NULL)
+    return NULL;
+  fs->hints = walk->fs->hints;
+  fs->journal->window = walk->fs->journal->window;
+  fs->journal->strict = walk->fs->journal->strict;
+
+  tree_run(walk, fs);
+  fs_unmount(fs);
+
+  return NULL;
+}
+
+// copia as entradas do directrio task->src para task->dst: a cadeia da cpia e os primeiros blocos dos
+// subdirectrios so alocados de uma s vez, os ficheiros partilham as cadeias do original (como em
+// fs_copy) e os subdirectrios passam a ser tarefas; depois de um erro, ou se o original j no existir,
+// a cpia fica vazia
+void copy_dir(vfs_t *fs, tree_walk *walk, tree_task *task) {
+  int block_size = fs->sb->block_size, n_entries = 2, n_subdirs = 0, cur_src = task->src, slot = 1, i;
+  dir_entry *entry;
+
+  dir_lock(fs, task->src, F_RDLCK);
+  if (dir_valid(fs, task->src) && __atomic_load_n(&walk->error, __ATOMIC_RELAXED) == 0)
+    for (; (entry = dir_next(fs, &cur_src, &slot)) != NULL; n_entries++)
+      n_subdirs += entry->type == TYPE_DIR;
+
+  int n_blocks = (n_entries + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+  if (!reserve_blocks(fs, n_blocks - 1 + n_subdirs))
+  {
+    __atomic_store_n(&walk->error, ERR_FULL, __ATOMIC_RELAXED);
+    n_entries = 2;
+    n_blocks = 1;
+    n_subdirs = 0;
+  }
+
+  // os primeiros n_blocks - 1 blocos alocados continuam a cadeia da cpia e os outros so os subdirectrios
+  int extra = get_free_chain(fs, n_blocks - 1 + n_subdirs), last = task->dst, subdirs = extra;
+  fat_set(fs, task->dst, n_blocks > 1 ? extra : -1);
+  for (i = 1; i < n_blocks; i++)
+    last = i == 1 ? extra : fat_get(fs, last);
+  if (n_blocks > 1)
+  {
+    subdirs = fat_get(fs, last);
+    fat_set(fs, last, -1);
+  }
+
+  // a cpia tem os blocos todos cheios, excepto o ltimo, com as entradas pela ordem do original
+  dir_entry *dst = (dir_entry *) BLOCK(task->dst);
+  unsigned int generation = *DIR_GENERATION(task->dst);
+  journal_mark(fs, dst, block_size);
+  for (i = 1, cur_src = extra; i < n_blocks; i += slot, cur_src = fat_get(fs, cur_src + slot - 1))
+  {
+    // as sequncias contguas da cadeia so registadas de uma s vez
+    for (slot = 1; i + slot < n_blocks && fat_get(fs, cur_src + slot - 1) == cur_src + slot; slot++);
+    journal_mark(fs, BLOCK(cur_src), (size_t) slot * block_size);
+  }
+  memset(dst, 0, block_size);
+  init_dir_entry(&dst[0], TYPE_DIR, ".", n_entries, task->dst);
+  init_dir_entry(&dst[1], TYPE_DIR, "..", last, task->parent);
+  // um ndice de um directrio que ocupou antes o mesmo bloco fica obsoleto
+  *DIR_GENERATION(task->dst) = generation + 1;
+
+  int cur_dst = task->dst;
+  cur_src = task->src;
+  slot = 1;
+  for (i = 2; i < n_entries; i++)
+  {
+    if (i % DIR_ENTRIES_PER_BLOCK == 0)
+    {
+      cur_dst = fat_get(fs, cur_dst);
+      memset(BLOCK(cur_dst), 0, block_size);
+    }
+    entry = dir_next(fs, &cur_src, &slot);
+    int first_block = entry->first_block;
+    long long size = entry->size;
+
+    if (entry->type == TYPE_DIR)
+    {
+      first_block = subdirs;
+      subdirs = fat_get(fs, subdirs);
+      fat_set(fs, first_block, -1);
+      tree_push(walk, entry->first_block, first_block, task->dst);
+    }
+    else if (first_block != -1 && !share_block(fs, first_block) && (first_block = copy_chain(fs, first_block)) == -1)
+    {
+      __atomic_store_n(&walk->error, ERR_FULL, __ATOMIC_RELAXED);
+      size = 0;
+    }
+    init_dir_entry(&((dir_entry *) BLOCK(cur_dst))[i % DIR_ENTRIES_PER_BLOCK], entry->type, entry->name, size, first_block);
+  }
+  dir_unlock(fs, task->src);
+
+  return;
+}
+
+// liberta o directrio task->src, depois de largar as cadeias dos seus ficheiros e de passar os seus
+// subdirectrios a tarefas; os blocos libertados so devolvidos ao mapa uma palavra de cada vez
+void remove_dir(vfs_t *fs, tree_walk *walk, tree_task *task) {
+  free_batch batch = {-1, 0, 0};
+  int dir_block = task->src, cur_block = dir_block, next_block;
+
+  // espera pelas operaes de outros contextos que ainda estejam a usar o directrio
+  dir_lock(fs, dir_block, F_WRLCK);
+  if (!dir_valid(fs, dir_block))
+  {
+    dir_unlock(fs, dir_block);
+    return;
+  }
+
+  dir_entry *entry;
+  int slot = 1;
+  while ((entry = dir_next(fs, &cur_block, &slot)) != NULL)
+  {
+    if (entry->type == TYPE_DIR)
+      tree_push(walk, entry->first_block, -1, -1);
+    else if (entry->first_block != -1)
+      release_chain_batch(fs, entry->first_block, &batch);
+  }
+
+  // a gerao muda para que os ndices do directrio nos outros contextos sejam descartados
+  drop_index(fs, dir_block);
+  dir_changed(fs, dir_block, NULL);
+  for (cur_block = dir_block; cur_block != -1; cur_block = next_block)
+  {
+    next_block = fat_get(fs, cur_block);
+    batch_free(fs, &batch, cur_block);
+  }
+  batch_flush(fs, &batch);
+  dir_unlock(fs, dir_block);
+
+  return;
+}
+
+// conta (n = 1) ou descarta (n = -1) um percurso de fs_copy_tree ou fs_remove_tree: enquanto a cpia 
+// construda, ou a rvore removida libertada, os seus blocos no so alcanados a partir da raiz, e
+// se a imagem falhar a meio so recuperados ao montar (ver reclaim_blocks)
+void count_walk(vfs_t *fs, int n) {
+  journal_mark(fs, fs->sb, sizeof(superblock));
+  __atomic_add_fetch(&fs->sb->n_walks, n, __ATOMIC_ACQ_REL);
+  return;
+}
+
+// depois de uma falha a meio de fs_copy_tree ou fs_remove_tree (sb->n_walks diferente de 0): percorre a
+// rvore a partir da raiz e liberta os blocos ocupados que no so alcanados, e refaz as referncias,
+// que podem contar cadeias partilhadas com essas rvores; s  chamada por quem repe o dirio, antes de
+// qualquer outro contexto usar a imagem, e pode ser repetida se a imagem falhar outra vez (n_walks s
+// volta a 0 depois de o mapa estar no disco); devolve 0 ou -1
+int reclaim_blocks(vfs_t *fs) {
+  int n_blocks = FAT_ENTRIES(fs->sb->fat_type), root = fs->sb->root_block, n_stack = 0, stack_size = 64, n_used, i;
+  unsigned long long *used = (unsigned long long *) calloc(n_blocks / 64, sizeof(unsigned long long));
+  unsigned short *refs = (unsigned short *) calloc(n_blocks, sizeof(unsigned short));
+  int *stack = (int *) malloc(stack_size * sizeof(int));
+
+  refs[root] = 1;
+  n_used = reclaim_chain(fs, used, refs, root);
+  stack[n_stack++] = root;
+  while (n_stack > 0)
+  {
+    int cur_block = stack[--n_stack], slot = 1;
+    dir_entry *entry;
+
+    while ((entry = dir_next(fs, &cur_block, &slot)) != NULL)
+    {
+      int block = entry->first_block;
+      if (block < 0 || block >= n_blocks)
+        continue;
+      // um subdirectrio j alcanado (s numa imagem estragada) no  percorrido outra vez
+      if (entry->type == TYPE_DIR && (used[block / 64] >> (block % 64) & 1))
+        continue;
+      refs[block]++;
+      n_used += reclaim_chain(fs, used, refs, block);
+      if (entry->type == TYPE_DIR)
+      {
+        if (n_stack == stack_size)
+        {
+          stack_size *= 2;
+          stack = (int *) realloc(stack, stack_size * sizeof(int));
+        }
+        stack[n_stack++] = block;
+      }
+    }
+  }
+
+  // os blocos que deixam de estar ocupados ficam como os de delete_block
+  for (i = 0; i < n_blocks; i++)
+  {
+    if ((fs->bitmap[i / 64] & ~used[i / 64]) >> (i % 64) & 1)
+      fat_set(fs, i, -1);
+    if (fs->refs[i] != refs[i])
+      fs->refs[i] = refs[i];
+  }
+  for (i = 0; i < n_blocks / 64; i++)
+    if (fs->bitmap[i] != used[i])
+      fs->bitmap[i] = used[i];
+  fs->sb->n_free_blocks = n_blocks - n_used;
+  fs->sb->generation++;
+  free(used);
+  free(refs);
+  free(stack);
+
+  if (fdatasync(fs->fd) == -1)
+    return -1;
+  fs->sb->n_walks = 0;
+  journal_free_map(fs);
+
+  return 0;
+}
+
+// marca em used os blocos da cadeia que comea em block, at ao fim ou a um bloco j marcado (o resto de
+// uma cadeia partilhada), e conta em refs as ligaes entre eles; devolve o nmero de blocos marcados
+int reclaim_chain(vfs_t *fs, unsigned long long *used, unsigned short *refs, int block) {
+  int n_blocks = FAT_ENTRIES(fs->sb->fat_type), n = 0;
+
+  for (; block >= 0 && block < n_blocks && !(used[block / 64] >> (block % 64) & 1); block = fat_get(fs, block), n++)
+  {
+    used[block / 64] |= 1ULL << (block % 64);
+    int next = fat_get(fs, block);
+    if (next >= 0 && next < n_blocks)
+      refs[next]++;
+  }
+
+  return n;
+}
+
+
+// liga (on = 1) ou desliga as dicas dadas ao kernel sobre o acesso  imagem em cada operao
+void fs_set_hints(vfs_t *fs, int on) {
+  fs->hints = on;
+  return;
+}
+
+
+// pede (on = 1) ou deixa de pedir pginas grandes para o mapeamento da imagem, o que diminui as falhas na
+// TLB da FAT e das cadeias longas; o kernel s as usa se o sistema de ficheiros da imagem as suportar
+// (tmpfs, por exemplo); devolve ERR_INPUT numa imagem pequena e ERR_IO se o kernel recusar
+int fs_set_hugepages(vfs_t *fs, int on) {
+  if (fs->size < HUGE_PAGES_MIN)
+    return ERR_INPUT;
+  if (madvise(fs->sb, fs->size, on ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) == -1)
+    return ERR_IO;
+
+  return 0;
+}
+
+
+// contadores de faltas de pgina e de falhas na TLB da thread desde que a imagem foi montada
+int fs_vm_stats(vfs_t *fs, vm_stats *stats) {
+  read_vm_counters(fs, stats);
+  stats->minor_faults -= fs->vm_base.minor_faults;
+  stats->major_faults -= fs->vm_base.major_faults;
+  if (stats->tlb_misses != -1)
+    stats->tlb_misses -= fs->vm_base.tlb_misses;
+
+  return 0;
+}
+
+
+// frag - calcula as medidas de fragmentao do espao livre e das cadeias de blocos
+int fs_frag(vfs_t *fs, frag_stats *stats) {
+  int n_blocks = FAT_ENTRIES(fs->sb->fat_type), i;
+  int run = 0;
+
+  memset(stats, 0, sizeof(frag_stats));
+
+  // os blocos a partir de sb->high_water nunca foram usados e no precisam de ser lidos
+  for (i = 0; i < fs->sb->high_water; i++)
+  {
+    if (BLOCK_USED(i))
+    {
+      if (fat_get(fs, i) != -1)
+      {
+        stats->links++;
+        if (fat_get(fs, i) != i + 1)
+          stats->jumps++;
+      }
+      run = 0;
+      continue;
+    }
+
+    if (run++ == 0)
+      stats->free_extents++;
+    if (run > stats->largest_extent)
+      stats->largest_extent = run;
+  }
+  if (fs->sb->high_water < n_blocks)
+  {
+    if (run == 0)
+      stats->free_extents++;
+    run += n_blocks - fs->sb->high_water;
+    if (run > stats->largest_extent)
+      stats->largest_extent = run;
+  }
+
+  stats->free_blocks = fs->sb->n_free_blocks;
+  stats->never_used = n_blocks - fs->sb->high_water;
+
+  return 0;
+}
+
+
+// desloca para uma sequncia de blocos contguos a parte no partilhada da cadeia que comea em block,
+// se tiver blocos fora de ordem; a cadeia  referida pela entrada entry ou, se prev no for -1, continua
+// o bloco prev (o primeiro bloco de um directrio do tipo TYPE_DIR, que nunca muda de lugar); devolve o
+// nmero de blocos deslocados, 0 se no valeu a pena ou no h espao e -1 se passam de max_blocks
+int defrag_chain(vfs_t *fs, dir_entry *entry, int prev, int block, char type, int max_blocks) {
+  int block_size = fs->sb->block_size, n = 0, jumps = 0, cur, next, first, i = 0;
+
+  // os blocos partilhados com cpias do ficheiro ficam onde esto
+  for (cur = block; cur != -1 && __atomic_load_n(&fs->refs[cur], __ATOMIC_ACQUIRE) == 1; cur = next)
+  {
+    next = fat_get(fs, cur);
+    n++;
+    if (next != -1 && next != cur + 1 && __atomic_load_n(&fs->refs[next], __ATOMIC_ACQUIRE) == 1)
+      jumps++;
+  }
+
+  // uma cadeia j contgua s  deslocada para junto de prev
+  int hint = prev != -1 && block != prev + 1 ? prev + 1 : -1;
+  if (jumps == 0 && hint != -1)
+    for (i = hint; i < hint + n && i < FAT_ENTRIES(fs->sb->fat_type); i++)
+      if (BLOCK_USED(i))
+        break;
+  if (n == 0 || (jumps == 0 && (hint == -1 || i < hint + n)))
+    return 0;
+  if (n > max_blocks)
+    return -1;
+  if (!reserve_blocks(fs, n))
+    return 0;
+  if ((first = get_free_extent(fs, n, hint)) == -1)
+  {
+    unreserve_blocks(fs, n);
+    return 0;
+  }
+
+  if (type == TYPE_DIR)
+    journal_mark(fs, BLOCK(first), (size_t) n * block_size);
+  else
+    journal_data(fs, BLOCK(first), (size_t) n * block_size);
+  for (cur = block, i = first; i < first + n; i++, cur = fat_get(fs, cur))
+    memcpy(BLOCK(i), BLOCK(cur), block_size);
+  // o ltimo bloco novo fica ligado ao primeiro bloco partilhado, que passa a ser referido por ele
+  if (cur != -1)
+    fat_set(fs, first + n - 1, cur);
+
+  if (prev == -1)
+  {
+    journal_mark(fs, entry, sizeof(dir_entry));
+    entry->first_block = first;
+  }
+  else
+    fat_set(fs, prev, first);
+  if (type == TYPE_DIR)
+  {
+    dir_entry *dir = (dir_entry *) BLOCK(prev);
+    journal_mark(fs, &dir[1], sizeof(dir_entry));
+    dir[1].size = first + n - 1;
+  }
+
+  for (cur = block, i = 0; i < n; i++, cur = next)
+  {
+    next = fat_get(fs, cur);
+    delete_block(fs, cur);
+  }
+
+  // os ficheiros abertos esquecem as posies guardadas
+  journal_mark(fs, fs->sb, sizeof(superblock));
+  __atomic_add_fetch(&fs->sb->generation, 1, __ATOMIC_ACQ_REL);
+
+  return n;
+}
+
+
+// defrag - torna contguas as cadeias dos ficheiros e dos directrios (o primeiro bloco de cada directrio
+// fica no lugar e o resto da cadeia passa para junto dele, se houver espao), percorrendo a rvore a partir
+// da raiz e com cada directrio bloqueado s enquanto as suas cadeias so deslocadas; pra ao fim de
+// max_usec microssegundos (negativo para no haver limite) e salta as cadeias que passariam de max_blocks
+// blocos deslocados (excepto a primeira, para que cada chamada avance mesmo com um limite menor do que a
+// cadeia) e, como as cadeias j contguas so saltadas, a chamada seguinte continua onde esta ficou
+int fs_defrag(vfs_t *fs, long long max_usec, int max_blocks, defrag_stats *stats) {
+  long long end = max_usec < 0 ? -1 : now_usec() + max_usec;
+  int n_stack = 1, stack_size = 64, stop = 0, skipped = 0, res = 0;
+  int *stack = (int *) malloc(stack_size * sizeof(int));
+
+  memset(stats, 0, sizeof(defrag_stats));
+  stack[0] = fs->sb->root_block;
+
+  while (n_stack > 0 && !stop)
+  {
+    int dir_block = stack[--n_stack], moved;
+
+    dir_lock(fs, dir_block, F_WRLCK);
+    if (!dir_valid(fs, dir_block))
+    {
+      dir_unlock(fs, dir_block);
+      continue;
+    }
+
+    int next_block = fat_get(fs, dir_block);
+    if (next_block != -1)
+    {
+      stats->chains++;
+      moved = defrag_chain(fs, NULL, dir_block, next_block, TYPE_DIR, max_blocks < 0 || stats->blocks == 0 ? INT_MAX : max_blocks - stats->blocks);
+      if (moved > 0)
+      {
+        // os ndices do directrio (neste e nos outros contextos) guardam os blocos antigos
+        drop_index(fs, dir_block);
+        dir_changed(fs, dir_block, NULL);
+        stats->moved++;
+        stats->blocks += moved;
+      }
+      else if (moved == -1)
+        skipped++;
+    }
+
+    int cur_block = dir_block, slot = 1;
+    dir_entry *entry;
+    while (!stop && (entry = dir_next(fs, &cur_block, &slot)) != NULL)
+    {
+      if (entry->type == TYPE_DIR)
+      {
+        if (n_stack == stack_size)
+        {
+          stack_size *= 2;
+          stack = (int *) realloc(stack, stack_size * sizeof(int));
+        }
+        stack[n_stack++] = entry->first_block;
+        continue;
+      }
+      if (entry->first_block == -1)
+        continue;
+
+      stats->chains++;
+      if (end != -1 && now_usec() >= end)
+        stop = 1;
+      else if ((moved = defrag_chain(fs, entry, -1, entry->first_block, TYPE_FILE, max_blocks < 0 || stats->blocks == 0 ? INT_MAX : max_blocks - stats->blocks)) == -1)
+        skipped++;
+      else if (moved > 0)
+      {
+        stats->moved++;
+        stats->blocks += moved;
+      }
+    }
+    dir_unlock(fs, dir_block);
+    if (journal_op(fs) != 0)
+      res = ERR_IO;
+
+    if (end != -1 && now_usec() >= end)
+      stop = 1;
+  }
+
+  stats->complete = n_stack == 0 && !stop && skipped == 0;
+  free(stack);
+
+  return res;
+}
+
+
+// contadores das operaes internas feitas pelo contexto fs desde a montagem (a zero se a biblioteca for
+// compilada sem VFS_STATS), e os blocos livres contados no mapa, para comparar com os do superblock
+int fs_op_stats(vfs_t *fs, op_stats *stats) {
+  int n_blocks = FAT_ENTRIES(fs->sb->fat_type), used = 0, i;
+
+  *stats = fs->counters;
+  // os blocos a partir de sb->high_water nunca foram usados
+  for (i = 0; i < (fs->sb->high_water + 63) / 64; i++)
+    used += __builtin_popcountll(__atomic_load_n(&fs->bitmap[i], __ATOMIC_RELAXED));
+  stats->free_blocks = n_blocks - used;
+  stats->sb_free_blocks = __atomic_load_n(&fs->sb->n_free_blocks, __ATOMIC_RELAXED);
+
+  return 0;
+}
@@ -0,0 +1,174 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   libvfs: o sistema de ficheiros virtual como biblioteca    //
+//                                                             //
+// Cada imagem montada  um contexto vfs_t independente (com o //
+// seu directrio corrente), pelo que um processo pode ter     //
+// vrias imagens abertas ao mesmo tempo. As funes devolvem  //
+// 0 ou um dos cdigos ERR_*; fs_read e fs_write devolvem o    //
+// nmero de bytes transferidos ou -ERR_*.                     //
+//                                                             //
+// Vrios processos, ou vrias threads com um contexto cada    //
+// (um contexto no deve ser usado por duas threads ao mesmo   //
+// tempo), podem montar a mesma imagem: cada operao bloqueia //
+// os directrios que usa (para leitura ou para escrita) e os  //
+// blocos livres so reservados e ocupados de forma atmica.   //
+//                                                             //
+// As alteraes aos metadados so confirmadas em grupos num   //
+// dirio no fim da imagem (uma escrita sncrona por grupo),   //
+// que  reposto ao montar a imagem depois de uma falha: cada  //
+// grupo fica todo ou nada. O grupo aberto  comum a todos os  //
+// contextos e s  confirmado sem nenhuma operao a meio;    //
+// antes de uma regio ser alterada pela primeira vez depois   //
+// do ltimo checkpoint, a sua imagem anterior  escrita no    //
+// dirio. Um grupo  confirmado no fim da operao em que     //
+// passar a janela de confirmao, com fs_commit e ao          //
+// desmontar; com fs_commit_pending, um programa que espera    //
+// por pedidos sabe quando deve chamar fs_commit. O modo de    //
+// sincronizao (fs_set_sync) escolhe quando os grupos so    //
+// confirmados, e fs_sync passa tudo para o disco.             //
+//                                                             //
+// compilao: gcc -c libvfs.c -Wall && ar rcs libvfs.a libvfs.o
+// (os programas que usam a biblioteca so ligados com -lpthread;
+// com -DVFS_STATS, fs_op_stats conta tambm as operaes internas)
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#ifndef LIBVFS_H
+#define LIBVFS_H
+
+#include <sys/types.h>
+
+#define TYPE_DIR 'D'
+#define TYPE_FILE 'F'
+#define MAX_NAME_LENGHT 20
+
+#define VALID_FAT_TYPE(TYPE) (TYPE == 8 || TYPE == 10 || TYPE == 12 || TYPE == 16 || TYPE == 32)
+#define VALID_BLOCK_SIZE(BS) (BS == 256 || BS == 512 || BS == 1024)
+
+// cdigos de erro devolvidos pela biblioteca (e, em modo no interactivo, pelo programa vfs)
+#define ERR_INPUT 1      // comando desconhecido ou argumentos invlidos
+#define ERR_NOT_FOUND 2  // ficheiro ou directrio inexistente
+#define ERR_FULL 3       // sem espao livre no sistema de ficheiros
+#define ERR_NOT_EMPTY 4  // directrio no vazio
+#define ERR_IO 5         // erro ao ler ou escrever um ficheiro UNIX (ou a imagem)
+#define ERR_NAME 6       // nome vazio, demasiado longo, "." ou ".."
+#define ERR_EXISTS 7     // j existe um directrio com esse nome
+#define ERR_AGAIN 8      // o descritor no bloqueante no aceita mais dados (fs_sendfile), ou o
+                         // contexto tem um directrio aberto (fs_commit e fs_sync)
+
+// modos de abertura de um ficheiro (fs_open)
+#define VFS_READ 1       // permite fs_read
+#define VFS_WRITE 2      // permite fs_write
+#define VFS_CREATE 4     // cria o ficheiro se no existir
+#define VFS_TRUNC 8      // esvazia o ficheiro ao abrir (com VFS_WRITE)
+
+// modos de sincronizao (fs_set_sync)
+#define VFS_SYNC_NONE 0     // sem dirio: as alteraes chegam ao disco quando o kernel as escrever
+#define VFS_SYNC_BATCH 1    // os grupos so confirmados quando passa a janela de confirmao (por omisso)
+#define VFS_SYNC_COMMAND 2  // os grupos s so confirmados com fs_commit (no fim de cada comando)
+#define VFS_SYNC_STRICT 3   // cada operao  confirmada e escrita nas suas posies antes de retornar
+
+typedef struct directory_entry {
+  char type;                   // tipo da entrada (TYPE_DIR ou TYPE_FILE)
+  char name[MAX_NAME_LENGHT];  // nome da entrada
+  unsigned char day;           // dia em que foi criada (entre 1 e 31)
+  unsigned char month;         // mes em que foi criada (entre 1 e 12)
+  unsigned char year;          // ano em que foi criada (entre 0 e 255 - 0 representa o ano de 1900)
+  long long size;              // tamanho em bytes (0 se TYPE_DIR)
+  int first_block;             // primeiro bloco de dados (-1 num ficheiro vazio)
+} dir_entry;
+
+typedef struct frag_stats {
+  int free_blocks;     // total de blocos livres
+  int free_extents;    // nmero de sequncias de blocos livres contguos
+  int largest_extent;  // tamanho da maior dessas sequncias
+  int never_used;      // blocos nunca utilizados (a partir do high water mark)
+  int links;           // ligaes entre blocos nas cadeias da FAT
+  int jumps;           // ligaes para um bloco que no  o seguinte
+} frag_stats;
+
+typedef struct vm_stats {
+  long long minor_faults;  // faltas de pgina resolvidas sem ler o disco
+  long long major_faults;  // faltas de pgina que leram o disco
+  long long tlb_misses;    // falhas na TLB de dados (-1 se o contador no estiver disponvel)
+} vm_stats;
+
+typedef struct defrag_stats {
+  int chains;    // cadeias examinadas (de ficheiros e directrios)
+  int moved;     // cadeias tornadas contguas
+  int blocks;    // blocos deslocados
+  int complete;  // 1 se toda a rvore foi percorrida sem chegar ao limite de tempo e sem saltar cadeias
+} defrag_stats;
+
+typedef struct op_stats {
+  long long fat_hops;          // entradas da FAT lidas (ligaes seguidas nas cadeias)
+  long long blocks_allocated;  // blocos ocupados pelo contexto
+  long long blocks_freed;      // blocos libertados pelo contexto
+  long long dir_lookups;       // procuras de um nome num directrio
+  long long name_compares;     // comparaes de nomes nessas procuras e nas inseres
+  int free_blocks;             // blocos livres contados no mapa de blocos utilizados
+  int sb_free_blocks;          // blocos livres segundo o superblock (sem os reservados)
+} op_stats;
+
+typedef struct vfs vfs_t;            // imagem montada
+typedef struct vfs_file vfs_file;    // ficheiro aberto
+typedef struct vfs_dir vfs_dir;      // directrio aberto para leitura das entradas
+
+// imagens
+off_t fs_image_size(int, int);
+int fs_format(char*, int, int);
+vfs_t *fs_mount(char*, int*);   // ERR_FULL se uma imagem antiga no tiver blocos para ser convertida
+vfs_t *fs_clone(vfs_t*);
+void fs_unmount(vfs_t*);
+
+// directrios; os nomes so caminhos absolutos ou relativos ao directrio corrente do contexto, com as
+// componentes separadas por '/' (ERR_NOT_FOUND se faltar um dos directrios intermdios)
+int fs_mkdir(vfs_t*, char*);
+int fs_chdir(vfs_t*, char*);
+int fs_getcwd(vfs_t*, char*, int);  // ERR_INPUT se o caminho no couber, ERR_NOT_FOUND se foi removido
+int fs_rmdir(vfs_t*, char*);         // ERR_INPUT para o directrio corrente
+vfs_dir *fs_opendir(vfs_t*, char*, int*);  // bloqueia o directrio para leitura at fs_closedir,
+                                           // e o contexto no o deve alterar entretanto nem
+                                           // confirmar grupos (fs_commit devolve ERR_AGAIN)
+int fs_readdir(vfs_dir*, dir_entry*);      // "." e ".." e depois as outras pela ordem dos nomes
+void fs_seekdir(vfs_dir*, char*);          // salta para a primeira entrada com nome >= ao dado
+void fs_closedir(vfs_dir*);
+
+// ficheiros; um ficheiro aberto  procurado pelo nome em cada operao: deixa de ser encontrado
+// (ERR_NOT_FOUND) se for removido ou movido, e o seu directrio no deve ser removido entretanto
+vfs_file *fs_open(vfs_t*, char*, int, int*);
+long long fs_read(vfs_file*, void*, long long);
+long long fs_write(vfs_file*, const void*, long long);
+long long fs_sendfile(vfs_file*, int, long long);
+long long fs_lseek(vfs_file*, long long, int);
+int fs_close(vfs_file*);
+int fs_import(vfs_t*, int, char*);
+int fs_export(vfs_t*, char*, int);
+int fs_copy(vfs_t*, char*, char*);
+int fs_rename(vfs_t*, char*, char*);
+int fs_unlink(vfs_t*, char*);
+
+// rvores de directrios, percorridas em paralelo por vrias threads (cada uma monta a imagem)
+int fs_copy_tree(vfs_t*, char*, char*);
+int fs_remove_tree(vfs_t*, char*);  // ERR_INPUT para o directrio corrente ou um dos que o contm
+void fs_set_workers(vfs_t*, int);
+
+// dirio (a janela de confirmao  em microssegundos: 0 confirma cada operao e -1 desliga o dirio)
+int fs_commit(vfs_t*);
+int fs_sync(vfs_t*);
+void fs_set_sync(vfs_t*, int);
+void fs_set_commit_window(vfs_t*, long long);
+long long fs_commit_pending(vfs_t*);
+
+// acesso ao mapeamento da imagem
+void fs_set_hints(vfs_t*, int);
+int fs_set_hugepages(vfs_t*, int);
+int fs_vm_stats(vfs_t*, vm_stats*);  // contadores da thread desde a montagem
+
+// informao sobre o sistema de ficheiros
+int fs_frag(vfs_t*, frag_stats*);
+int fs_defrag(vfs_t*, long long, int, defrag_stats*);  // limites em microssegundos e em blocos (-1 sem limite)
+int fs_op_stats(vfs_t*, op_stats*);  // contadores do contexto desde a montagem (a zero sem VFS_STATS)
+
+#endif
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# baseline_upgrade.sh - monta imagens criadas pelo programa original (a
+# verso 0: superblock, FAT de um int por entrada e entradas de 32 bytes) e
+# verifica que so convertidas sem perder nada: a rvore e o contedo dos
+# ficheiros so comparados com o .out de cada imagem, o mapa dos blocos tem
+# de concordar com o superblock, no fica o ficheiro temporrio da converso,
+# o ficheiro vazio deixa de ter blocos e a imagem convertida continua a
+# aceitar alteraes; no fim, quatro processos montam a mesma imagem ao
+# mesmo tempo e s um a pode converter
+#
+# As imagens foram criadas com o programa original (o primeiro commit) pelos
+# comandos de tests/baseline.cmds, com blocos de B bytes e FAT F:
+#   git show fd58466:vfs.c > vfs0.c && gcc vfs0.c -w -lreadline -lcurses -o vfs0
+#   printf 'hello baseline\n\0' > a.txt; : > empty.txt
+#   printf '%0(B-1)d\0%0(B-1)d\0tail\n\0' 0 0 | tr 0 x > big.bin
+#   ./vfs0 -bB -fF IMAGEM < baseline.cmds
+# (o programa original copia cada bloco com strcpy, da os '\0'):
+#   tests/baseline.img                 B = 256, F = 8
+#   tests/baseline-b512-f10.img.gz     B = 512, F = 10 (comprimida com gzip)
+#   tests/baseline-b1024-f12.img.gz    B = 1024, F = 12 (idem)
+#
+# utilizao: tests/baseline_upgrade.sh [VFS]   (por omisso ./vfs)
+
+VFS=${1:-./vfs}
+DIR=$(dirname $0)
+TMP=${TMPDIR:-/tmp}/vfs_baseline_upgrade.$$
+LIST="ls; cd docs; ls; cat readme; cd old; ls; cat deep; cd /src; ls; cat main; cat copy; cat /big; cat /empty"
+
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+fail() {
+  echo "baseline_upgrade: $1 ($image)"
+  exit 1
+}
+
+# os blocos livres no mapa e no superblock (comando stats)
+check_free() {
+  $VFS -c stats $TMP/img | awk '/^free blocks: .* in the bitmap/ { found = 1; if ($3 != $7) exit 1 } END { exit !found }' \
+    || fail "bitmap and superblock disagree $1"
+}
+
+for image in baseline baseline-b512-f10 baseline-b1024-f12
+do
+  if test -f $DIR/$image.img
+  then
+    cp $DIR/$image.img $TMP/img || exit 1
+  else
+    gzip -dc $DIR/$image.img.gz > $TMP/img || exit 1
+  fi
+
+  $VFS -c "$LIST" $TMP/img > $TMP/out || fail "cannot mount the image"
+  cmp -s $TMP/out $DIR/$image.out || fail "converted tree differs from tests/$image.out"
+  test ! -e $TMP/img.upgrade || fail "temporary image left after the upgrade"
+  check_free "after the upgrade"
+
+  # a segunda montagem j no converte nada
+  $VFS -c "$LIST" $TMP/img > $TMP/out && cmp -s $TMP/out $DIR/$image.out || fail "tree changed on the second mount"
+
+  # com as entradas de 40 bytes em vez de 32, a raiz pode passar a precisar de mais um bloco
+  $VFS -c "mkdir new; cd new; get $DIR/baseline.cmds cmds; cp cmds again; cd /docs; rm n1; mv n2 /src; rmdir /d8" $TMP/img > $TMP/out \
+    && test ! -s $TMP/out || fail "cannot change the converted image: $(cat $TMP/out)"
+  $VFS -c "cat /new/again" $TMP/img | cmp -s - $DIR/baseline.cmds || fail "file written after the upgrade differs"
+  check_free "after changing the converted image"
+
+  # na verso 1 um ficheiro vazio deixou de ter blocos: a converso liberta o bloco de /empty
+  before=$($VFS -c stats $TMP/img | awk '/^free blocks:/ { print $3 }')
+  $VFS -c "rm /empty; stats" $TMP/img | awk -v n=$before '/^free blocks:/ { found = 1; if ($3 != n) exit 1 } END { exit !found }' \
+    || fail "empty file still owns a block after the upgrade"
+  $VFS -c "get /dev/null /empty" $TMP/img > $TMP/out && test ! -s $TMP/out || fail "cannot recreate the empty file"
+done
+
+gzip -dc $DIR/$image.img.gz > $TMP/img || exit 1
+for i in 1 2 3 4
+do
+  $VFS -c "$LIST" $TMP/img > $TMP/out$i 2>&1 &
+done
+wait
+for i in 1 2 3 4
+do
+  cmp -s $TMP/out$i $DIR/$image.out || fail "tree differs when mounted by four processes at once"
+done
+check_free "after four processes mounted it at once"
+
+echo "baseline_upgrade: ok"
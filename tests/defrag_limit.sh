@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# defrag_limit.sh - o defrag com um limite de blocos menor do que as cadeias
+# fragmentadas tem de avanar em cada chamada: numa imagem FAT8 com dois
+# ficheiros de 4 blocos espalhados pelos buracos deixados por ficheiros
+# apagados, "defrag 3" desloca uma cadeia de cada vez (a primeira passa do
+# limite, a segunda  saltada e fica para a chamada seguinte) at no
+# restar nenhuma ligao fora de ordem, sem alterar o contedo dos ficheiros
+#
+# utilizao: tests/defrag_limit.sh [VFS]   (por omisso ./vfs)
+
+VFS=${1:-./vfs}
+TMP=${TMPDIR:-/tmp}/vfs_defrag_limit.$$
+
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+head -c 62976 /dev/zero > $TMP/fill
+head -c 256 /dev/zero | tr '\0' s > $TMP/s
+head -c 1024 /dev/zero | tr '\0' c > $TMP/c
+head -c 1024 /dev/zero | tr '\0' e > $TMP/e
+
+fail() {
+  echo "defrag_limit: $1"
+  exit 1
+}
+
+# c ocupa os buracos de s1, s3, s5 e s7, e e os de s2, s4, s6 e s8
+$VFS -b256 -f8 -c "get $TMP/fill fill; get $TMP/s s1; get $TMP/s s2; get $TMP/s s3; get $TMP/s s4; get $TMP/s s5; get $TMP/s s6; get $TMP/s s7; get $TMP/s s8; rm s1; rm s3; rm s5; rm s7; sync; get $TMP/c c; rm s2; rm s4; rm s6; rm s8; sync; get $TMP/e e; rm fill" $TMP/img > $TMP/out \
+  || fail "cannot create the image"
+grep -v '^vfs: formatting' $TMP/out | grep -q . && fail "cannot create the image: $(cat $TMP/out)"
+$VFS -c frag $TMP/img | grep -q 'non-contiguous 0 ' && fail "the files were not fragmented"
+
+runs=0
+while [ $runs -lt 4 ]
+do
+  runs=$((runs + 1))
+  $VFS -c "defrag 3" $TMP/img > $TMP/out || fail "defrag failed"
+  grep -q '^moved 0 blocks.*stopped' $TMP/out && fail "defrag 3 made no progress (run $runs)"
+  grep -q 'stopped at the limit' $TMP/out || break
+done
+grep -q 'stopped at the limit' $TMP/out && fail "defrag 3 did not finish in $runs runs"
+$VFS -c frag $TMP/img | grep -q 'non-contiguous 0 ' || fail "chains still fragmented after $runs runs"
+
+$VFS -c "cat c" $TMP/img | cmp -s - $TMP/c || fail "c changed by defrag"
+$VFS -c "cat e" $TMP/img | cmp -s - $TMP/e || fail "e changed by defrag"
+
+echo "defrag_limit: ok"
@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# freed_reuse.sh - os blocos libertados num grupo que ainda no foi
+# confirmado no podem ser reutilizados antes da confirmao: se a imagem
+# falhar, as imagens anteriores devolvem-nos ao ficheiro apagado, que ficaria
+# com o contedo do novo. Numa imagem com um ficheiro f j no disco, apaga f e
+# cria g, mata o processo antes da confirmao e verifica, depois de montar
+# outra vez, que f (se existir) ainda tem o seu contedo e g (se existir) o
+# dele; com a imagem quase cheia (o primeiro caso) o grupo que apaga f 
+# confirmado antes de g ser criado
+#
+# utilizao: tests/freed_reuse.sh [VFS]   (por omisso ./vfs)
+
+VFS=${1:-./vfs}
+TMP=${TMPDIR:-/tmp}/vfs_freed_reuse.$$
+
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+head -c 1024 /dev/zero | tr '\0' F > $TMP/fF
+head -c 1024 /dev/zero | tr '\0' G > $TMP/fG
+
+fail() {
+  echo "freed_reuse: $1"
+  exit 1
+}
+
+# os blocos livres no mapa e no superblock (comando stats)
+check_free() {
+  $VFS -c stats $TMP/img | awk '/^free blocks: .* in the bitmap/ { found = 1; if ($3 != $7) exit 1 } END { exit !found }' \
+    || fail "bitmap and superblock disagree $1"
+}
+
+for size in 64000 32000
+do
+  rm -f $TMP/img $TMP/fifo
+  head -c $size /dev/zero > $TMP/big
+  $VFS -b256 -f8 -c "get $TMP/big big; get $TMP/fF f; sync" $TMP/img > /dev/null || fail "cannot create the image"
+
+  # os comandos chegam por um pipe que fica aberto, para que o grupo aberto no seja confirmado  sada
+  mkfifo $TMP/fifo || exit 1
+  $VFS $TMP/img < $TMP/fifo > /dev/null 2>&1 &
+  pid=$!
+  exec 3> $TMP/fifo
+  echo "rm f; get $TMP/fG g" | tr ';' '\n' >&3
+  sleep 1
+  kill -9 $pid
+  wait $pid 2> /dev/null
+  exec 3>&-
+
+  $VFS -c ls $TMP/img > $TMP/ls || fail "cannot mount the image after the crash ($size)"
+  if grep -q '^f	' $TMP/ls
+  then
+    $VFS -c "cat f" $TMP/img | grep -q G && fail "f has the contents of g after the crash ($size)"
+  fi
+  if grep -q '^g	' $TMP/ls
+  then
+    $VFS -c "cat g" $TMP/img | grep -q F && fail "g has the contents of f after the crash ($size)"
+  fi
+  check_free "after the crash ($size)"
+done
+
+echo "freed_reuse: ok"
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# tree_reclaim.sh - uma falha a meio de rm -r (ou de cp -r) deixa fora da
+# raiz a parte da rvore que ainda no foi libertada; os seus blocos tm de
+# ser recuperados ao montar outra vez. Numa imagem com uma rvore de 8192
+# directrios (cpias de cp -r, que partilham as cadeias dos ficheiros), mata
+# o processo em vrios instantes de rm -r, monta a imagem, acaba a remoo se
+# a rvore ainda l estiver e verifica que os blocos livres voltam a ser os
+# de antes de a rvore ser criada
+#
+# utilizao: tests/tree_reclaim.sh [VFS]   (por omisso ./vfs)
+
+VFS=${1:-./vfs}
+TMP=${TMPDIR:-/tmp}/vfs_tree_reclaim.$$
+TREE="mkdir t; get $TMP/f t/f; mkdir t/a; get $TMP/f t/a/g"
+for name in b c d e g h i j k l m n
+do
+  TREE="$TREE; cp -r t t/$name"
+done
+
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+head -c 3000 /dev/zero | tr '\0' f > $TMP/f
+
+fail() {
+  echo "tree_reclaim: $1"
+  exit 1
+}
+
+# os blocos livres no mapa e no superblock (comando stats), como MAPA/SUPERBLOCK
+free_blocks() {
+  $VFS -c stats $TMP/img | awk '/^free blocks: .* in the bitmap/ { print $3 "/" $7 }'
+}
+
+$VFS -b1024 -f16 -c "sync" $TMP/img > /dev/null || fail "cannot create the image"
+free=$(free_blocks)
+$VFS -c "$TREE; sync" $TMP/img > /dev/null || fail "cannot create the tree"
+cp $TMP/img $TMP/tree
+
+for delay in 0.05 0.2 0.4
+do
+  cp $TMP/tree $TMP/img
+  rm -f $TMP/fifo
+  mkfifo $TMP/fifo || exit 1
+  $VFS $TMP/img < $TMP/fifo > /dev/null 2>&1 &
+  pid=$!
+  exec 3> $TMP/fifo
+  echo "rm -r t" >&3
+  sleep $delay
+  kill -9 $pid
+  wait $pid 2> /dev/null
+  exec 3>&-
+
+  $VFS -c ls $TMP/img > $TMP/ls || fail "cannot mount the image after the crash ($delay s)"
+  if grep -q '^t	' $TMP/ls
+  then
+    $VFS -c "rm -r t" $TMP/img > /dev/null || fail "cannot remove the tree after the crash ($delay s)"
+  fi
+  blocks=$(free_blocks)
+  test "$blocks" = "$free" || fail "free blocks $blocks after the crash ($delay s), $free before the tree"
+done
+
+echo "tree_reclaim: ok"
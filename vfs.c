@@ -2,36 +2,55 @@
 //                                                             //
 //         Trabalho II: Sistema de Gesto de Ficheiros         //
 //                                                             //
-// compilao: gcc vfs.c -Wall -lreadline -lcurses -o vfs      //
-// utilizao: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM //
+// compilao: gcc vfs.c libvfs.c -Wall -lreadline -lcurses -lpthread -o vfs
+// utilizao: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] FILESYSTEM
+//             vfs -d SOCKET FILESYSTEM (modo servidor; ver vfsc.c)
+//             --sync=none|batch|command|strict escolhe quando //
+//             as alteraes chegam ao disco (omisso: batch)  //
+//             --no-hints desliga as dicas madvise e           //
+//             --hugepages pede pginas grandes ao kernel      //
+//             --stats=FILE escreve em FILE, ao sair, as       //
+//             estatsticas do comando stats em JSON (s com   //
+//             -DVFS_STATS, como no Makefile)                  //
+//             --record=TRACE guarda em TRACE cada comando     //
+//             executado, com o instante, a latncia e, no     //
+//             modo servidor, a ligao que o enviou, e        //
+//             --replay=TRACE volta a execut-los na imagem    //
+//             (o mais depressa possvel, ou com --pace ao     //
+//             ritmo original) e compara os tempos             //
 //                                                             //
 //                    Pedro Paredes                            //
 //                                                             //
 /////////////////////////////////////////////////////////////////
 
+
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
 #include <readline/readline.h>
 #include <readline/history.h>
-
-#define DEBUG 0
+#include "libvfs.h"
 
 #define MAXARGS 100
-#define CHECK_NUMBER 9999
-#define TYPE_DIR 'D'
-#define TYPE_FILE 'F'
-#define MAX_NAME_LENGHT 20
-
-#define FAT_ENTRIES(TYPE) (TYPE == 8 ? 256 : TYPE == 10 ? 1024 : 4096)
-#define FAT_SIZE(TYPE) (FAT_ENTRIES(TYPE) * sizeof(int))
-#define BLOCK(N) (blocks + N * sb->block_size)
-#define DIR_ENTRIES_PER_BLOCK (sb->block_size / sizeof(dir_entry))
+#define PATH_SIZE 4096
+#define BATCH_BUFFER_SIZE (1 << 16)
+#define CAT_BUFFER_SIZE (1 << 16)
+#define MAX_EVENTS 64
+#define HIST_SUB_BITS 4    // cada potncia de 2 dos histogramas de latncia  dividida em 2^HIST_SUB_BITS partes
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) << HIST_SUB_BITS)
 
 typedef struct command {
   char *cmd;              // string apenas com o comando
@@ -39,69 +58,142 @@ typedef struct command {
   char *argv[MAXARGS+1];  // vector de argumentos do comando
 } COMMAND;
 
-typedef struct superblock_entry {
-  int check_number;   // nmero que permite identificar o sistema como vlido
-  int block_size;     // tamanho de um bloco {256, 512(default) ou 1024 bytes}
-  int fat_type;       // tipo de FAT {8, 10(default) ou 12}
-  int root_block;     // nmero do 1 bloco a que corresponde o directrio raiz
-  int free_block;     // nmero do 1 bloco da lista de blocos no utilizados
-  int n_free_blocks;  // total de blocos no utilizados
-} superblock;
-
-typedef struct directory_entry {
-  char type;                   // tipo da entrada (TYPE_DIR ou TYPE_FILE)
-  char name[MAX_NAME_LENGHT];  // nome da entrada
-  unsigned char day;           // dia em que foi criada (entre 1 e 31)
-  unsigned char month;         // mes em que foi criada (entre 1 e 12)
-  unsigned char year;          // ano em que foi criada (entre 0 e 255 - 0 representa o ano de 1900)
-  int size;                    // tamanho em bytes (0 se TYPE_DIR)
-  int first_block;             // primeiro bloco de dados
-} dir_entry;
+// histograma das latncias de um comando (em ns), com erro relativo inferior a 2^-HIST_SUB_BITS:
+// os valores abaixo de 2^HIST_SUB_BITS tm uma posio cada, e os outros ficam na posio da sua
+// potncia de 2 e dos HIST_SUB_BITS bits seguintes ao mais significativo (ver hist_bucket)
+typedef struct latency_hist {
+  char *cmd;                         // nome do comando
+  long long count;                   // execues
+  long long total_ns;                // soma das latncias
+  long long max_ns;                  // maior latncia
+  long long buckets[HIST_BUCKETS];   // execues em cada intervalo
+} latency_hist;
 
 // variveis globais
-superblock *sb;   // superblock do sistema de ficheiros
-int *fat;         // apontador para a FAT
-char *blocks;     // apontador para a regio dos dados
-int current_dir;  // bloco do directrio corrente
+vfs_t *fs;              // sistema de ficheiros montado
+FILE *out;              // sada dos comandos (stdout, ou a resposta ao cliente em modo servidor)
+char *batch_commands;   // comandos passados com -c (separados por ';' ou mudanas de linha)
+char *batch_script;     // ficheiro de comandos passado com -s
+char *server_socket;    // socket UNIX passado com -d (modo servidor)
+vfs_file *cat_file;     // ltimo ficheiro lido por partes com cat (fica aberto para reutilizar o ndice de saltos)
+char cat_name[PATH_SIZE];  // caminho desse ficheiro
+int sync_mode = VFS_SYNC_BATCH;      // modo de sincronizao passado com --sync
+int hints = 1;                       // 0 com --no-hints
+int hugepages;                       // 1 com --hugepages
+char *sync_modes[] = {"none", "batch", "command", "strict"};
+char *stats_file;                    // ficheiro passado com --stats, escrito ao sair
+FILE *trace;                         // trace aberto com --record
+long long trace_start;               // instante (now_nsec) em que o trace foi aberto
+char *replay_file;                   // trace passado com --replay
+int pace;                            // 1 com --pace (a repetio respeita os instantes do trace)
+int trace_conn;                      // ligao do comando em execuo no modo servidor (0 fora dele)
+latency_hist histograms[] = {{"ls"}, {"mkdir"}, {"cd"}, {"pwd"}, {"rmdir"}, {"get"}, {"put"}, {"cat"}, {"cp"}, {"mv"},
+                             {"rm"}, {"frag"}, {"defrag"}, {"vmstat"}, {"sync"}, {"stats"}};
 
 // funes auxiliares
 COMMAND parse(char*);
 void parse_argv(int, char*[]);
-void init_filesystem(int, int, char*);
-void init_superblock(int, int);
-void init_fat(void);
-void init_dir_block(int, int);
-void init_dir_entry(dir_entry*, char, char*, int, int);
-void exec_com(COMMAND);
+void mount_filesystem(int, int, char*);
+void unmount_filesystem(void);
+int exec_com(COMMAND);
+int dispatch_com(COMMAND);
+int wrong_args(COMMAND, int);
+int report(char*, int, char*);
+int batch_line(char*, int*);
+int run_batch(FILE*);
+int run_commands(char*);
+void trace_command(COMMAND, long long, long long, int);
+int run_replay(char*);
+
+// modo servidor
+struct connection;
+int run_server(char*);
+void server_accept(int, vfs_t*);
+int conn_serve(struct connection*);
+void conn_watch(struct connection*, unsigned int);
+void conn_close(struct connection*);
+void conn_append(struct connection*, char*, int);
+void server_request(struct connection*, char*);
+int server_cat(struct connection*, COMMAND);
 
 // funes de manipulao de directrios
-void vfs_ls(void);
-void vfs_mkdir(char*);
-void vfs_cd(char*);
-void vfs_pwd(void);
-void vfs_rmdir(char*);
+int vfs_ls(char*);
+int vfs_mkdir(char*);
+int vfs_cd(char*);
+int vfs_pwd(void);
+int vfs_rmdir(char*);
 
 // funes de manipulao de ficheiros
-void vfs_get(char*, char*);
-void vfs_put(char*, char*);
-void vfs_cat(char*);
-void vfs_cp(char*, char*);
-void vfs_mv(char*, char*);
-void vfs_rm(char*);
+int vfs_get(char*, char*);
+int vfs_put(char*, char*);
+int vfs_cat(char*);
+int vfs_cat_range(char*, char*, char*);
+int cat_range_args(char*, char*, long long*, long long*);
+int vfs_cp(char*, char*);
+int vfs_cp_tree(char*, char*);
+int vfs_mv(char*, char*);
+int vfs_rm(char*);
+int vfs_rm_tree(char*);
+
+// funes de informao sobre o sistema de ficheiros
+int vfs_frag(void);
+int vfs_defrag(COMMAND);
+int vfs_vmstat(void);
+int vfs_sync(void);
+int vfs_stats(void);
+
+// estatsticas (com VFS_STATS)
+long long now_nsec(void);
+int hist_bucket(long long);
+long long bucket_value(int);
+long long hist_percentile(latency_hist*, double);
+int hist_index(char*);
+void hist_add(latency_hist*, long long);
+void record_latency(char*, long long);
+void write_stats_json(FILE*);
 
 
 int main(int argc, char *argv[]) {
   char *linha;
   COMMAND com;
+  int status = 0;
 
+  out = stdout;
   parse_argv(argc, argv);
+  if (replay_file != NULL)
+    return run_replay(replay_file);
+  if (server_socket != NULL)
+    return run_server(server_socket);
+  if (batch_commands != NULL || batch_script != NULL || !isatty(0)) {
+    if (batch_commands != NULL)
+      status = run_commands(batch_commands);
+    else if (batch_script != NULL) {
+      FILE *script = fopen(batch_script, "r");
+      if (script == NULL) {
+        printf("vfs: cannot open script (%s)\n", batch_script);
+        exit(1);
+      }
+      status = run_batch(script);
+    }
+    else
+      status = run_batch(stdin);
+    // desmontar confirma as ltimas operaes no dirio
+    unmount_filesystem();
+    return status;
+  }
+
   while (1) {
-    if ((linha = readline("vfs$ ")) == NULL)
+    // cada comando interactivo fica confirmado antes de se esperar pelo seguinte
+    fs_commit(fs);
+    if ((linha = readline("vfs$ ")) == NULL) {
+      unmount_filesystem();
       exit(0);
+    }
     if (strlen(linha) != 0) {
       add_history(linha);
       com = parse(linha);
-      exec_com(com);
+      if (com.cmd != NULL)
+        exec_com(com);
     }
     free(linha);
   }
@@ -113,9 +205,9 @@ COMMAND parse(char *linha) {
   int i = 0;
   COMMAND com;
 
-  com.cmd = strtok(linha, " ");
+  com.cmd = strtok(linha, " \t");
   com.argv[0] = com.cmd;
-  while ((com.argv[++i] = strtok(NULL, " ")) != NULL);
+  while (i < MAXARGS && (com.argv[++i] = strtok(NULL, " \t")) != NULL);
   com.argc = i;
   return com;
 }
@@ -126,875 +218,1242 @@ void parse_argv(int argc, char *argv[]) {
 
   block_size = 512; // valor por omisso
   fat_type = 10;    // valor por omisso
-  if (argc < 2 || argc > 4) {
+  if (argc < 2) {
     printf("vfs: invalid number of arguments\n");
-    printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM\n");
+    printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
     exit(1);
   }
   for (i = 1; i < argc - 1; i++) {
     if (argv[i][0] == '-') {
       if (argv[i][1] == 'b') {
 	block_size = atoi(&argv[i][2]);
-	if (block_size != 256 && block_size != 512 && block_size != 1024) {
+	if (!VALID_BLOCK_SIZE(block_size)) {
 	  printf("vfs: invalid block size (%d)\n", block_size);
-	  printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM\n");
+	  printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
 	  exit(1);
 	}
       } else if (argv[i][1] == 'f') {
 	fat_type = atoi(&argv[i][2]);
-	if (fat_type != 8 && fat_type != 10 && fat_type != 12) {
+	if (!VALID_FAT_TYPE(fat_type)) {
 	  printf("vfs: invalid fat type (%d)\n", fat_type);
-	  printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM\n");
+	  printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
 	  exit(1);
 	}
+      } else if (!strncmp(argv[i], "--sync=", 7)) {
+	for (sync_mode = 0; sync_mode < 4 && strcmp(&argv[i][7], sync_modes[sync_mode]); sync_mode++);
+	if (sync_mode == 4) {
+	  printf("vfs: invalid sync mode (%s)\n", &argv[i][7]);
+	  printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
+	  exit(1);
+	}
+      } else if (!strcmp(argv[i], "--no-hints")) {
+	hints = 0;
+      } else if (!strcmp(argv[i], "--hugepages")) {
+	hugepages = 1;
+      } else if (!strncmp(argv[i], "--stats=", 8) && argv[i][8] != '\0') {
+#ifdef VFS_STATS
+	stats_file = &argv[i][8];
+#else
+	printf("vfs: statistics not available (compiled without VFS_STATS)\n");
+	exit(1);
+#endif
+      } else if (!strncmp(argv[i], "--record=", 9) && argv[i][9] != '\0') {
+	if ((trace = fopen(&argv[i][9], "w")) == NULL) {
+	  printf("vfs: cannot create trace (%s)\n", &argv[i][9]);
+	  exit(1);
+	}
+	fprintf(trace, "# start_ns latency_ns status connection command\n");
+	trace_start = now_nsec();
+      } else if (!strncmp(argv[i], "--replay=", 9) && argv[i][9] != '\0') {
+	replay_file = &argv[i][9];
+      } else if (!strcmp(argv[i], "--pace")) {
+	pace = 1;
+      } else if ((argv[i][1] == 'c' || argv[i][1] == 's' || argv[i][1] == 'd') && argv[i][2] == '\0' && i + 1 < argc - 1) {
+	if (argv[i][1] == 'c')
+	  batch_commands = argv[++i];
+	else if (argv[i][1] == 's')
+	  batch_script = argv[++i];
+	else
+	  server_socket = argv[++i];
       } else {
 	printf("vfs: invalid argument (%s)\n", argv[i]);
-	printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM\n");
+	printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
 	exit(1);
       }
     } else {
       printf("vfs: invalid argument (%s)\n", argv[i]);
-      printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM\n");
+      printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
       exit(1);
     }
   }
-  init_filesystem(block_size, fat_type, argv[argc-1]);
+  mount_filesystem(block_size, fat_type, argv[argc-1]);
   return;
 }
 
 
-void init_filesystem(int block_size, int fat_type, char *filesystem_name) {
-  int fsd, filesystem_size;
-
-  if ((fsd = open(filesystem_name, O_RDWR)) == -1) {
-    // o sistema de ficheiros no existe -->  necessrio cri-lo e format-lo
-    if ((fsd = open(filesystem_name, O_CREAT | O_TRUNC | O_RDWR, S_IRWXU)) == -1) {
-      printf("vfs: cannot create filesystem (%s)\n", filesystem_name);
-      printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM\n");
-      exit(1);
-    }
 
-    // calcula o tamanho do sistema de ficheiros
-    filesystem_size = block_size + FAT_SIZE(fat_type) + FAT_ENTRIES(fat_type) * block_size;
-    printf("vfs: formatting virtual file-system (%d bytes) ... please wait\n", filesystem_size);
 
-    // estende o sistema de ficheiros para o tamanho desejado
-    lseek(fsd, filesystem_size - 1, SEEK_SET);
-    write(fsd, "", 1);
+void mount_filesystem(int block_size, int fat_type, char *filesystem_name) {
+  struct stat buf;
+  int error;
 
-    // faz o mapeamento do sistema de ficheiros e inicia as variveis globais
-    if ((sb = (superblock *) mmap(NULL, filesystem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fsd, 0)) == MAP_FAILED) {
-      printf("vfs: cannot map filesystem (mmap error)\n");
-      close(fsd);
-      exit(1);
-    }
-    fat = (int *) ((unsigned long int) sb + block_size);
-    blocks = (char *) ((unsigned long int) fat + FAT_SIZE(fat_type));
-    
-    // inicia o superblock
-    init_superblock(block_size, fat_type);
-    
-    // inicia a FAT
-    init_fat();
-    
-    // inicia o bloco do directrio raiz '/'
-    init_dir_block(sb->root_block, sb->root_block);
-  } else {
-    // calcula o tamanho do sistema de ficheiros
-    struct stat buf;
-    stat(filesystem_name, &buf);
-    filesystem_size = buf.st_size;
-
-    // faz o mapeamento do sistema de ficheiros e inicia as variveis globais
-    if ((sb = (superblock *) mmap(NULL, filesystem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fsd, 0)) == MAP_FAILED) {
-      printf("vfs: cannot map filesystem (mmap error)\n");
-      close(fsd);
+  if (stat(filesystem_name, &buf) == -1) {
+    // o sistema de ficheiros no existe -->  necessrio cri-lo e format-lo
+    printf("vfs: formatting virtual file-system (%lld bytes) ... please wait\n", (long long) fs_image_size(block_size, fat_type));
+    if (fs_format(filesystem_name, block_size, fat_type) != 0) {
+      printf("vfs: cannot create filesystem (%s)\n", filesystem_name);
+      printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
       exit(1);
     }
-    fat = (int *) ((unsigned long int) sb + sb->block_size);
-    blocks = (char *) ((unsigned long int) fat + FAT_SIZE(sb->fat_type));
+  }
 
-    // testa se o sistema de ficheiros  vlido 
-    if (sb->check_number != CHECK_NUMBER || filesystem_size != sb->block_size + FAT_SIZE(sb->fat_type) + FAT_ENTRIES(sb->fat_type) * sb->block_size) {
+  if ((fs = fs_mount(filesystem_name, &error)) == NULL) {
+    if (error == ERR_INPUT)
       printf("vfs: invalid filesystem (%s)\n", filesystem_name);
-      printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12]] FILESYSTEM\n");
-      munmap(sb, filesystem_size);
-      close(fsd);
-      exit(1);
-    }
+    else if (error == ERR_FULL)
+      printf("vfs: cannot upgrade filesystem (%s): no free blocks for the larger directory entries\n", filesystem_name);
+    else
+      printf("vfs: cannot map filesystem (mmap error)\n");
+    printf("Usage: vfs [-b[256|512|1024]] [-f[8|10|12|16|32]] [--sync=none|batch|command|strict] [--no-hints] [--hugepages] [--stats=FILE] [--record=TRACE | --replay=TRACE [--pace]] [-c COMMANDS | -s SCRIPT | -d SOCKET] FILESYSTEM\n");
+    exit(1);
   }
-  close(fsd);
-
-  // inicia o directrio corrente
-  current_dir = sb->root_block;
-  return;
-}
-
-
-void init_superblock(int block_size, int fat_type) {
-  sb->check_number = CHECK_NUMBER;
-  sb->block_size = block_size;
-  sb->fat_type = fat_type;
-  sb->root_block = 0;
-  sb->free_block = 1;
-  sb->n_free_blocks = FAT_ENTRIES(fat_type) - 1;
+  fs_set_sync(fs, sync_mode);
+  fs_set_hints(fs, hints);
+  if (hugepages && fs_set_hugepages(fs, 1) != 0)
+    printf("vfs: huge pages not available for this filesystem\n");
   return;
 }
 
 
-void init_fat(void) {
-  int i;
-
-  fat[0] = -1;
-  for (i = 1; i < sb->n_free_blocks; i++)
-    fat[i] = i + 1;
-  fat[sb->n_free_blocks] = -1;
-  return;
-}
-
+// desmonta a imagem, escrevendo antes as estatsticas no ficheiro passado com --stats
+void unmount_filesystem(void) {
+  FILE *f;
 
-void init_dir_block(int block, int parent_block) {
-  dir_entry *dir = (dir_entry *) BLOCK(block);
-  // o nmero de entradas no directrio (inicialmente 2) fica guardado no campo size da entrada "."
-  init_dir_entry(&dir[0], TYPE_DIR, ".", 2, block);
-  init_dir_entry(&dir[1], TYPE_DIR, "..", 0, parent_block);
+  if (stats_file != NULL)
+  {
+    if ((f = fopen(stats_file, "w")) == NULL)
+      printf("vfs: cannot write statistics (%s)\n", stats_file);
+    else
+    {
+      write_stats_json(f);
+      fclose(f);
+    }
+  }
+  if (trace != NULL)
+    fclose(trace);
+  fs_unmount(fs);
   return;
 }
 
 
-void init_dir_entry(dir_entry *dir, char type, char *name, int size, int first_block) {
-  time_t cur_time = time(NULL);
-  struct tm *cur_tm = localtime(&cur_time);
+// verifica se o comando com recebeu n argumentos (escrevendo o erro se no for o caso)
+int wrong_args(COMMAND com, int n) {
+  if (com.argc == n + 1)
+    return 0;
 
-  dir->type = type;
-  strcpy(dir->name, name);
-  dir->day = cur_tm->tm_mday;
-  dir->month = cur_tm->tm_mon + 1;
-  dir->year = cur_tm->tm_year;
-  dir->size = size;
-  dir->first_block = first_block;
-  return;
+  fprintf(out, "ERROR(%s: invalid number of arguments)\n", com.cmd);
+  return 1;
 }
 
-int cstr_cmp(const void *a, const void *b) 
-{ 
-  const char **ia = (const char **)a;
-  const char **ib = (const char **)b;
-  return strcmp(*ia, *ib);
-} 
-
-int get_free_block() {
-  if (sb->n_free_blocks == 0)
-    return -1;
-
-  int livre = sb->free_block;
-  sb->free_block = fat[livre];
-  fat[livre] = -1;
-
-  sb->n_free_blocks--;
+// escreve a mensagem de erro do comando cmd para o cdigo res devolvido pela biblioteca
+// (not_found descreve a entrada que no foi encontrada); devolve res
+int report(char *cmd, int res, char *not_found) {
+  switch (res)
+  {
+    case ERR_NOT_FOUND:
+      fprintf(out, "ERROR(%s: %s not found)\n", cmd, not_found);
+      break;
+    case ERR_FULL:
+      fprintf(out, "ERROR(%s: memory full)\n", cmd);
+      break;
+    case ERR_NOT_EMPTY:
+      fprintf(out, "ERROR(%s: directory not empty)\n", cmd);
+      break;
+    case ERR_NAME:
+      fprintf(out, "ERROR(%s: invalid name)\n", cmd);
+      break;
+    case ERR_EXISTS:
+      fprintf(out, "ERROR(%s: a directory with that name exists)\n", cmd);
+      break;
+    case ERR_IO:
+      fprintf(out, "ERROR(%s: cannot write filesystem)\n", cmd);
+      break;
+  }
 
-  return livre;
+  return res;
 }
 
-void delete_block(int block) {
-  fat[block] = sb->free_block;
-  sb->free_block = block;
-
-  sb->n_free_blocks++;
-
-  return;
+// executa o comando com, medindo a latncia (com VFS_STATS ou --record)
+int exec_com(COMMAND com) {
+  long long start, ns;
+  int res;
+
+#ifndef VFS_STATS
+  if (trace == NULL)
+    return dispatch_com(com);
+#endif
+  start = now_nsec();
+  res = dispatch_com(com);
+  ns = now_nsec() - start;
+#ifdef VFS_STATS
+  record_latency(com.cmd, ns);
+#endif
+  if (trace != NULL)
+    trace_command(com, start, ns, res);
+
+  return res;
 }
 
-void exec_com(COMMAND com) {
+int dispatch_com(COMMAND com) {
   // para cada comando invocar a funo que o implementa
-  if (!strcmp(com.cmd, "exit"))
+  if (!strcmp(com.cmd, "exit")) {
+    unmount_filesystem();
     exit(0);
+  }
   if (!strcmp(com.cmd, "ls")) {
-    // falta tratamento de erros
-    vfs_ls();
+    if (com.argc == 2)
+      return vfs_ls(com.argv[1]);
+    if (wrong_args(com, 0))
+      return ERR_INPUT;
+    return vfs_ls(NULL);
   } else if (!strcmp(com.cmd, "mkdir")) {
-    // falta tratamento de erros
-    vfs_mkdir(com.argv[1]);
+    if (wrong_args(com, 1))
+      return ERR_INPUT;
+    return vfs_mkdir(com.argv[1]);
   } else if (!strcmp(com.cmd, "cd")) {
-    // falta tratamento de erros
-    vfs_cd(com.argv[1]);
+    if (wrong_args(com, 1))
+      return ERR_INPUT;
+    return vfs_cd(com.argv[1]);
   } else if (!strcmp(com.cmd, "pwd")) {
-    // falta tratamento de erros
-    vfs_pwd();
+    if (wrong_args(com, 0))
+      return ERR_INPUT;
+    return vfs_pwd();
   } else if (!strcmp(com.cmd, "rmdir")) {
-    // falta tratamento de erros
-    vfs_rmdir(com.argv[1]);
+    if (wrong_args(com, 1))
+      return ERR_INPUT;
+    return vfs_rmdir(com.argv[1]);
   } else if (!strcmp(com.cmd, "get")) {
-    // falta tratamento de erros
-    vfs_get(com.argv[1], com.argv[2]);
+    if (wrong_args(com, 2))
+      return ERR_INPUT;
+    return vfs_get(com.argv[1], com.argv[2]);
   } else if (!strcmp(com.cmd, "put")) {
-    // falta tratamento de erros
-    vfs_put(com.argv[1], com.argv[2]);
+    if (wrong_args(com, 2))
+      return ERR_INPUT;
+    return vfs_put(com.argv[1], com.argv[2]);
   } else if (!strcmp(com.cmd, "cat")) {
-    // falta tratamento de erros
-    vfs_cat(com.argv[1]);
+    if (com.argc == 4)
+      return vfs_cat_range(com.argv[1], com.argv[2], com.argv[3]);
+    if (wrong_args(com, 1))
+      return ERR_INPUT;
+    return vfs_cat(com.argv[1]);
   } else if (!strcmp(com.cmd, "cp")) {
-    // falta tratamento de erros
-    vfs_cp(com.argv[1], com.argv[2]);
+    if (com.argc == 4 && !strcmp(com.argv[1], "-r"))
+      return vfs_cp_tree(com.argv[2], com.argv[3]);
+    if (wrong_args(com, 2))
+      return ERR_INPUT;
+    return vfs_cp(com.argv[1], com.argv[2]);
   } else if (!strcmp(com.cmd, "mv")) {
-    // falta tratamento de erros
-    vfs_mv(com.argv[1], com.argv[2]);
+    if (wrong_args(com, 2))
+      return ERR_INPUT;
+    return vfs_mv(com.argv[1], com.argv[2]);
   } else if (!strcmp(com.cmd, "rm")) {
-    // falta tratamento de erros
-    vfs_rm(com.argv[1]);
-  } else
-    printf("ERROR(input: command not found)\n");
-  return;
+    if (com.argc == 3 && !strcmp(com.argv[1], "-r"))
+      return vfs_rm_tree(com.argv[2]);
+    if (wrong_args(com, 1))
+      return ERR_INPUT;
+    return vfs_rm(com.argv[1]);
+  } else if (!strcmp(com.cmd, "frag")) {
+    if (wrong_args(com, 0))
+      return ERR_INPUT;
+    return vfs_frag();
+  } else if (!strcmp(com.cmd, "defrag")) {
+    if (com.argc > 3) {
+      fprintf(out, "ERROR(defrag: invalid number of arguments)\n");
+      return ERR_INPUT;
+    }
+    return vfs_defrag(com);
+  } else if (!strcmp(com.cmd, "vmstat")) {
+    if (wrong_args(com, 0))
+      return ERR_INPUT;
+    return vfs_vmstat();
+  } else if (!strcmp(com.cmd, "sync")) {
+    if (wrong_args(com, 0))
+      return ERR_INPUT;
+    return vfs_sync();
+  } else if (!strcmp(com.cmd, "stats")) {
+    if (wrong_args(com, 0))
+      return ERR_INPUT;
+    return vfs_stats();
+  }
+
+  fprintf(out, "ERROR(input: command not found)\n");
+  return ERR_INPUT;
 }
 
 
-// ls - lista o contedo do directrio actual
-void vfs_ls(void) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i;
+// executa uma linha em modo no interactivo, guardando em status o cdigo do primeiro
+// comando que falhou; devolve 1 se a linha for o comando exit
+int batch_line(char *linha, int *status) {
+  COMMAND com;
+  int res;
 
-  char type_str[100];
-  char **content = (char **) malloc(n_entries * sizeof(char *));
-  for (i = 0; i < n_entries; i++)
-    content[i] = (char * ) malloc(1024 * sizeof(char *));
-  
+  linha[strcspn(linha, "\r\n")] = '\0';
+  com = parse(linha);
+  if (com.cmd == NULL || com.cmd[0] == '#')
+    return 0;
+  if (!strcmp(com.cmd, "exit"))
+    return 1;
 
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
-  {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
+  res = exec_com(com);
+  if (sync_mode == VFS_SYNC_COMMAND)
+    fs_commit(fs);
+  if (res != 0 && *status == 0)
+    *status = res;
+  return 0;
+}
 
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
 
-    if (dir[block_i].type == TYPE_DIR)
-      sprintf(type_str, "DIR");
-    else
-      sprintf(type_str, "%d", dir[block_i].size);
-    
-    sprintf(content[i], "%s\t%02d-%02d-%04d\t%s", dir[block_i].name, dir[block_i].day, dir[block_i].month, 1900 + dir[block_i].year, type_str);
-  }
+// executa os comandos lidos de input, sem readline e com a sada em buffer;
+// devolve o cdigo do primeiro comando que falhou (0 se nenhum falhou)
+int run_batch(FILE *input) {
+  char *linha = NULL;
+  size_t size = 0;
+  int status = 0;
+
+  setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+  while (getline(&linha, &size, input) != -1)
+    if (batch_line(linha, &status))
+      break;
+  free(linha);
+  fflush(stdout);
+
+  return status;
+}
 
-  qsort(content, n_entries, sizeof(char *), cstr_cmp);
 
-  for (i = 0; i < n_entries; i++)
-    printf("%s\n", content[i]);
+// ----------------------------------------------------------------------------------------------
+// traces (--record e --replay): cada linha tem o instante em que o comando comeou (ns desde que o
+// trace foi aberto), a latncia (ns), o cdigo devolvido, a ligao que o enviou no modo servidor (0 fora
+// dele) e o comando com os argumentos separados por um espao; as linhas comeadas por '#' so
+// comentrios (os traces sem a ligao, de verses anteriores, tambm so aceites)
+
+// acrescenta ao trace o comando com, que comeou em start (now_nsec), demorou ns e devolveu res
+void trace_command(COMMAND com, long long start, long long ns, int res) {
+  int i;
 
+  fprintf(trace, "%lld %lld %d %d", start - trace_start, ns, res, trace_conn);
+  for (i = 0; i < com.argc; i++)
+    fprintf(trace, " %s", com.argv[i]);
+  fputc('\n', trace);
   return;
 }
 
 
-// mkdir dir - cria um subdirectrio com nome dir no directrio actual
-void vfs_mkdir(char *nome_dir) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size;
-  int req_blocks = (n_entries % DIR_ENTRIES_PER_BLOCK == 0) + 1;
-
-  if (sb->n_free_blocks < req_blocks)
+// volta a executar os comandos do trace trace_name na imagem montada, com a sada descartada, e
+// escreve o tempo total, o dbito e os percentis das latncias de cada comando, no trace e agora; os
+// comandos de cada ligao do modo servidor so executados num contexto prprio (um clone da imagem
+// montada), como no servidor, para que os caminhos relativos partam do seu directrio corrente;
+// devolve 1 se algum comando devolveu um cdigo diferente do registado
+int run_replay(char *trace_name) {
+  int n_hist = sizeof(histograms) / sizeof(histograms[0]), commands = 0, diverged = 0, res, status, conn, pos, i;
+  vfs_t *root_fs = fs, **contexts = NULL;
+  int n_contexts = 0;
+  latency_hist *orig = (latency_hist *) calloc(n_hist, sizeof(latency_hist));
+  latency_hist *replay = (latency_hist *) calloc(n_hist, sizeof(latency_hist));
+  long long start, ns, first = -1, orig_end = 0, replay_start, t0;
+  FILE *input = fopen(trace_name, "r"), *report_out;
+  char *linha = NULL;
+  size_t size = 0;
+
+  if (input == NULL)
   {
-    printf("ERROR(mkdir: memory full)\n");
-    return;
+    printf("vfs: cannot open trace (%s)\n", trace_name);
+    return 1;
   }
+  for (i = 0; i < n_hist; i++)
+    orig[i].cmd = replay[i].cmd = histograms[i].cmd;
+
+  // a sada dos comandos (incluindo a de cat, escrita directamente no descritor 1)  descartada
+  fflush(stdout);
+  report_out = fdopen(dup(1), "w");
+  i = open("/dev/null", O_WRONLY);
+  dup2(i, 1);
+  close(i);
+
+  replay_start = now_nsec();
+  while (getline(&linha, &size, input) != -1)
+  {
+    if (linha[0] == '#')
+      continue;
+    if (sscanf(linha, "%lld %lld %d %d %n", &start, &ns, &status, &conn, &pos) != 4 || conn < 0)
+    {
+      if (sscanf(linha, "%lld %lld %d %n", &start, &ns, &status, &pos) != 3)
+        continue;
+      conn = 0;
+    }
+    linha[strcspn(linha, "\r\n")] = '\0';
+    COMMAND com = parse(linha + pos);
+    if (com.cmd == NULL)
+      continue;
 
-  if (DEBUG)
-    printf("Blocks: used %d from %lu\n", n_entries + 1, DIR_ENTRIES_PER_BLOCK);
+    if (conn >= n_contexts)
+    {
+      contexts = (vfs_t **) realloc(contexts, (conn + 1) * sizeof(vfs_t *));
+      memset(contexts + n_contexts, 0, (conn + 1 - n_contexts) * sizeof(vfs_t *));
+      n_contexts = conn + 1;
+    }
+    if (contexts[conn] == NULL)
+      contexts[conn] = conn == 0 ? root_fs : fs_clone(root_fs);
+    fs = contexts[conn];
+
+    if (first == -1)
+      first = start;
+    if (start + ns > orig_end)
+      orig_end = start + ns;
+    if (pace && (t0 = replay_start + (start - first) - now_nsec()) > 0)
+    {
+      struct timespec ts = {t0 / 1000000000, t0 % 1000000000};
+      nanosleep(&ts, NULL);
+    }
 
-  dir[0].size++;
+    t0 = now_nsec();
+    res = exec_com(com);
+    t0 = now_nsec() - t0;
+    if (sync_mode == VFS_SYNC_COMMAND)
+      fs_commit(fs);
 
-  int new_block = get_free_block();
-  init_dir_block(new_block, current_dir);
+    commands++;
+    if (res != status)
+      diverged++;
+    if ((i = hist_index(com.cmd)) != -1)
+    {
+      hist_add(&orig[i], ns);
+      hist_add(&replay[i], t0);
+    }
+  }
+  double orig_s = first == -1 ? 0 : (orig_end - first) / 1e9, replay_s = (now_nsec() - replay_start) / 1e9;
+  free(linha);
+  fclose(input);
+  fflush(stdout);
+  for (i = 1; i < n_contexts; i++)
+    if (contexts[i] != NULL)
+      fs_unmount(contexts[i]);
+  free(contexts);
+  fs = root_fs;
+
+  fprintf(report_out, "replayed %d commands (%d with a different result)\n", commands, diverged);
+  fprintf(report_out, "%-8s %12s %12s\n", "", "elapsed_s", "commands/s");
+  fprintf(report_out, "%-8s %12.3f %12.1f\n", "trace", orig_s, orig_s > 0 ? commands / orig_s : 0.0);
+  fprintf(report_out, "%-8s %12.3f %12.1f\n", "replay", replay_s, replay_s > 0 ? commands / replay_s : 0.0);
+  fprintf(report_out, "%-8s %10s %14s %14s %14s %14s\n", "command", "count", "trace_p50_us", "replay_p50_us", "trace_p99_us", "replay_p99_us");
+  for (i = 0; i < n_hist; i++)
+    if (orig[i].count > 0)
+      fprintf(report_out, "%-8s %10lld %14.1f %14.1f %14.1f %14.1f\n", orig[i].cmd, orig[i].count,
+              hist_percentile(&orig[i], 0.5) / 1e3, hist_percentile(&replay[i], 0.5) / 1e3,
+              hist_percentile(&orig[i], 0.99) / 1e3, hist_percentile(&replay[i], 0.99) / 1e3);
+  fclose(report_out);
+  free(orig);
+  free(replay);
+
+  unmount_filesystem();
+  return diverged != 0;
+}
 
-  int cur_block = current_dir;
-  while (fat[cur_block] != -1)
-    cur_block = fat[cur_block];
 
-  if (n_entries % DIR_ENTRIES_PER_BLOCK == 0)
-  {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
-  }
+// executa os comandos passados com -c, separados por ';' ou mudanas de linha
+int run_commands(char *commands) {
+  char *linha;
+  int status = 0;
 
-  dir = (dir_entry *) BLOCK(cur_block);
-  
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_DIR, nome_dir, 0, new_block);
+  setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+  while ((linha = strsep(&commands, ";\n")) != NULL)
+    if (batch_line(linha, &status))
+      break;
+  fflush(stdout);
 
-  return;
+  return status;
 }
 
 
-// cd dir - move o directrio actual para dir.
-void vfs_cd(char *nome_dir) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i;
+// ls [dir | [dir/]prefixo*] - lista o contedo do directrio dir (ou do directrio actual), ou s as
+// entradas com o prefixo dado; as entradas j vm pela ordem dos nomes e so escritas  medida que so lidas
+int vfs_ls(char *nome_dir) {
+  char path[PATH_SIZE], type_str[100], *prefix = NULL, *slash;
+  int error, len = 0;
+  vfs_dir *dir;
+  dir_entry entry;
 
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
+  if (nome_dir != NULL && (len = strlen(nome_dir)) > 0 && nome_dir[len - 1] == '*')
   {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
+    snprintf(path, sizeof(path), "%.*s", len - 1, nome_dir);
+    if ((slash = strrchr(path, '/')) == NULL)
     {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
+      prefix = path;
+      nome_dir = NULL;
     }
-
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (dir[block_i].type == TYPE_DIR && strcmp(dir[block_i].name, nome_dir) == 0)
+    else
     {
-      current_dir = dir[block_i].first_block;
-      return;
+      prefix = slash + 1;
+      *slash = '\0';
+      nome_dir = slash == path ? "/" : path;
     }
+    len = strlen(prefix);
   }
 
-  printf("ERROR(cd: directory not found)\n");
+  if ((dir = fs_opendir(fs, nome_dir, &error)) == NULL)
+    return report("ls", error, "directory");
+  if (prefix != NULL)
+    fs_seekdir(dir, prefix);
 
-  return;
+  while (fs_readdir(dir, &entry))
+  {
+    // as entradas com o prefixo so as que se seguem  primeira com nome igual ou posterior a ele
+    if (prefix != NULL && (len > MAX_NAME_LENGHT || strncmp(entry.name, prefix, len) != 0))
+      break;
+
+    if (entry.type == TYPE_DIR)
+      sprintf(type_str, "DIR");
+    else
+      sprintf(type_str, "%lld", entry.size);
+    fprintf(out, "%.*s\t%02d-%02d-%04d\t%s\n", MAX_NAME_LENGHT, entry.name, entry.day, entry.month, 1900 + entry.year, type_str);
+  }
+  fs_closedir(dir);
+
+  return 0;
 }
 
 
-// pwd - escreve o caminho absoluto do directrio actual
-void vfs_pwd(void) {
-  char name[1024], tmp[1024];
-  name[0] = '/';
-  name[1] = '\0';
+// mkdir dir - cria um subdirectrio com nome dir no directrio actual
+int vfs_mkdir(char *nome_dir) {
+  return report("mkdir", fs_mkdir(fs, nome_dir), "directory");
+}
 
-  int it_dir = current_dir;
-  int i;
-  while (it_dir != 0)
-  {
-    dir_entry *dir = (dir_entry *) BLOCK(it_dir);
-    int prev_dir = dir[1].first_block;
-    dir = (dir_entry *) BLOCK(prev_dir);
-    int n_entries = dir[0].size;
 
-    int cur_block = prev_dir;
-    for (i = 0; i < n_entries; i++)
-    {
-      if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-      {
-        if (DEBUG)
-          printf("Changed Block\n");
-        cur_block = fat[cur_block];
-        dir = (dir_entry *) BLOCK(cur_block);
-      }
+// cd dir - move o directrio actual para dir.
+int vfs_cd(char *nome_dir) {
+  // o ficheiro aberto por cat  procurado no directrio onde foi aberto
+  if (cat_file != NULL)
+  {
+    fs_close(cat_file);
+    cat_file = NULL;
+  }
 
-      int block_i = i % DIR_ENTRIES_PER_BLOCK;
+  return report("cd", fs_chdir(fs, nome_dir), "directory");
+}
 
-      if (dir[block_i].first_block == it_dir)
-      {
-	strcpy(tmp, dir[block_i].name);
-	strcat(tmp, name);
-	strcpy(name, tmp);
-	strcpy(tmp, "/");
-	strcat(tmp, name);
-	strcpy(name, tmp);
-	break;
-      }
-    }
 
-    it_dir = prev_dir;
-  }
+// pwd - escreve o caminho absoluto do directrio actual
+int vfs_pwd(void) {
+  char name[PATH_SIZE];
+  int res = fs_getcwd(fs, name, PATH_SIZE);
 
-  printf("%s\n", name);
+  if (res == ERR_INPUT)
+    fprintf(out, "ERROR(pwd: path too long)\n");
+  if (res != 0)
+    return report("pwd", res, "directory");
+  // como antes da biblioteca, o caminho de um subdirectrio termina em '/'
+  fprintf(out, "%s%s\n", name, name[1] != '\0' ? "/" : "");
 
-  return;
+  return 0;
 }
 
 
 // rmdir dir - remove o subdirectrio dir (se vazio) do directrio actual
-void vfs_rmdir(char *nome_dir) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i;
+int vfs_rmdir(char *nome_dir) {
+  int res = fs_rmdir(fs, nome_dir);
 
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
-  {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
+  if (res == ERR_INPUT)
+    fprintf(out, "ERROR(rmdir: cannot remove the current directory)\n");
 
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
+  return report("rmdir", res, "directory");
+}
 
-    if (dir[block_i].type == TYPE_DIR && strcmp(dir[block_i].name, nome_dir) == 0)
-    { 
-      dir_entry *del_dir = (dir_entry *) BLOCK(dir[block_i].first_block);
 
-      if (del_dir[0].size != 2)
-      {
-	printf("ERROR(rmdir: directory not empty)\n");
-	return;
-      }
+// get fich1 fich2 - copia um ficheiro normal UNIX fich1 para um ficheiro no nosso sistema fich2
+int vfs_get(char *nome_orig, char *nome_dest) {
+  int finput = open(nome_orig, O_RDONLY), res;
+
+  if (finput == -1)
+    return report("get", ERR_NOT_FOUND, "input file");
 
-      int last_block = cur_block;
-      while (fat[last_block] != -1)
-        last_block = fat[last_block];
-      dir_entry *last_dir_block = (dir_entry *) BLOCK(last_block);
-      dir_entry last_dir = last_dir_block[(n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK];
+  if ((res = fs_import(fs, finput, nome_dest)) == ERR_IO)
+    fprintf(out, "ERROR(get: cannot read input file)\n");
+  close(finput);
 
-      if ((n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK == 0)
-        delete_block(last_block);
-      delete_block(dir[block_i].first_block);
+  return res == ERR_IO ? res : report("get", res, "input file");
+}
 
-      dir[block_i].type = last_dir.type;
-      strcpy(dir[block_i].name, last_dir.name);
-      dir[block_i].day = last_dir.day;
-      dir[block_i].month = last_dir.month;
-      dir[block_i].year = last_dir.year;
-      dir[block_i].size = last_dir.size;
-      dir[block_i].first_block = last_dir.first_block;
 
-      dir = (dir_entry *) BLOCK(current_dir);
-      dir[0].size--;
+// put fich1 fich2 - copia um ficheiro do nosso sistema fich1 para um ficheiro normal UNIX fich2
+int vfs_put(char *nome_orig, char *nome_dest) {
+  vfs_file *file;
+  int foutput, res;
 
-      return;
-    }
+  // confirma que o ficheiro existe antes de criar o destino
+  if ((file = fs_open(fs, nome_orig, VFS_READ, &res)) == NULL)
+    return report("put", ERR_NOT_FOUND, "file");
+  fs_close(file);
+
+  if ((foutput = open(nome_dest, O_CREAT|O_TRUNC|O_WRONLY, 0644)) == -1)
+  {
+    fprintf(out, "ERROR(put: cannot create output file)\n");
+    return ERR_IO;
   }
 
-  printf("ERROR(rmdir: directory not found)\n");
+  if ((res = fs_export(fs, nome_orig, foutput)) == ERR_IO)
+    fprintf(out, "ERROR(put: cannot write output file)\n");
+  close(foutput);
 
-  return;
+  return res == ERR_IO ? res : report("put", res, "file");
 }
 
 
-// get fich1 fich2 - copia um ficheiro normal UNIX fich1 para um ficheiro no nosso sistema fich2
-void vfs_get(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size;
+// cat fich - escreve para o ecr o contedo do ficheiro fich
+int vfs_cat(char *nome_fich) {
+  fflush(out);
+  return report("cat", fs_export(fs, nome_fich, 1), "file");
+}
 
-  struct stat statbuf;
-  if (stat(nome_orig, &statbuf) == -1)
-  {
-    printf("ERROR(get: input file not found)\n");
-    return;
-  }
-  
-  int req_size = (int)statbuf.st_size;
-  int req_blocks = (n_entries % DIR_ENTRIES_PER_BLOCK == 0) + (req_size + sb->block_size - 1) / sb->block_size;
 
-  if (sb->n_free_blocks < req_blocks)
+// converte os argumentos offset e len de cat (escrevendo o erro se no forem vlidos)
+int cat_range_args(char *offset_str, char *len_str, long long *offset, long long *len) {
+  char *offset_end, *len_end;
+
+  *offset = strtoll(offset_str, &offset_end, 10);
+  *len = strtoll(len_str, &len_end, 10);
+  if (*offset_end != '\0' || *len_end != '\0' || *offset < 0 || *len < 0)
   {
-    printf("ERROR(get: memory full)\n");
-    return;
+    fprintf(out, "ERROR(cat: invalid offset or length)\n");
+    return ERR_INPUT;
   }
 
-  req_blocks -= (n_entries % DIR_ENTRIES_PER_BLOCK == 0);
-
-  if (DEBUG)
-    printf("Blocks: used %d from %lu\n", n_entries + 1, DIR_ENTRIES_PER_BLOCK);
+  return 0;
+}
 
-  dir[0].size++;
 
-  int first_block = get_free_block();
-  int new_block, next_block = first_block;
-  int finput = open(nome_orig, O_RDONLY), count_block = 1, n;
-  char msg[4200];
-  while ((n = read(finput, msg, sb->block_size)) > 0)
-  {
-    if (count_block != req_blocks)
-    {
-      count_block++;
-      new_block = get_free_block();
-      fat[next_block] = new_block;
-    }
+// cat fich offset len - escreve para o ecr at len bytes do ficheiro fich, a partir da posio offset
+int vfs_cat_range(char *nome_fich, char *offset_str, char *len_str) {
+  char buf[CAT_BUFFER_SIZE];
+  long long offset, len, n = 0;
+  int error;
 
-    strcpy(BLOCK(next_block), msg);
+  if (cat_range_args(offset_str, len_str, &offset, &len) != 0)
+    return ERR_INPUT;
 
-    next_block = new_block;
+  if (cat_file == NULL || strcmp(cat_name, nome_fich) != 0)
+  {
+    if (cat_file != NULL)
+      fs_close(cat_file);
+    if ((cat_file = fs_open(fs, nome_fich, VFS_READ, &error)) == NULL)
+      return report("cat", ERR_NOT_FOUND, "file");
+    snprintf(cat_name, sizeof(cat_name), "%s", nome_fich);
   }
 
-  int cur_block = current_dir;
-  while (fat[cur_block] != -1)
-    cur_block = fat[cur_block];
+  fflush(out);
+  fs_lseek(cat_file, offset, SEEK_SET);
+  while (len > 0 && (n = fs_read(cat_file, buf, len < CAT_BUFFER_SIZE ? len : CAT_BUFFER_SIZE)) > 0)
+  {
+    if (write(1, buf, n) != n)
+      return ERR_IO;
+    len -= n;
+  }
 
-  if (n_entries % DIR_ENTRIES_PER_BLOCK == 0)
+  if (n < 0)
   {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
+    fs_close(cat_file);
+    cat_file = NULL;
+    return report("cat", ERR_NOT_FOUND, "file");
   }
 
-  dir = (dir_entry *) BLOCK(cur_block);
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_FILE, nome_dest, req_size, first_block);
-  
-  return;
+  return 0;
 }
 
 
-// put fich1 fich2 - copia um ficheiro do nosso sistema fich1 para um ficheiro normal UNIX fich2
-void vfs_put(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i;
+// cp fich1 fich2 - copia o ficheiro fich1 para fich2
+// cp fich dir - copia o ficheiro fich para o subdirectrio dir
+int vfs_cp(char *nome_orig, char *nome_dest) {
+  return report("cp", fs_copy(fs, nome_orig, nome_dest), "input file");
+}
 
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
-  {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
 
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (dir[block_i].type == TYPE_FILE && strcmp(dir[block_i].name, nome_orig) == 0)
-    {
-      int foutput = open(nome_dest, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-      int cur = dir[block_i].first_block;
+// cp -r dir1 dir2 - copia o directrio dir1, com todo o seu contedo, para dir2
+// cp -r dir1 dir - copia o directrio dir1 para dentro do subdirectrio dir
+int vfs_cp_tree(char *nome_orig, char *nome_dest) {
+  return report("cp", fs_copy_tree(fs, nome_orig, nome_dest), "input file");
+}
 
-      write(foutput, BLOCK(cur), sb->block_size);
-      while (fat[cur] != -1)
-      {
-        cur = fat[cur];
-        write(foutput, BLOCK(cur), sb->block_size);
-      }
 
-      return;
-    }
-  }
+// mv fich1 fich2 - move o ficheiro fich1 para fich2
+// mv fich dir - move o ficheiro fich para o subdirectrio dir
+int vfs_mv(char *nome_orig, char *nome_dest) {
+  int res = fs_rename(fs, nome_orig, nome_dest);
 
-  printf("ERROR(put: file not found)\n");
+  if (res == ERR_INPUT)
+    fprintf(out, "ERROR(mv: cannot move a directory into itself)\n");
 
-  return;
+  return report("mv", res, "input file");
 }
 
 
-// cat fich - escreve para o ecr o contedo do ficheiro fich
-void vfs_cat(char *nome_fich) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i;
+// rm fich - remove o ficheiro fich
+int vfs_rm(char *nome_fich) {
+  return report("rm", fs_unlink(fs, nome_fich), "file");
+}
 
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
-  {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
 
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (dir[block_i].type == TYPE_FILE && strcmp(dir[block_i].name, nome_fich) == 0)
-    {
-      int next_block = dir[block_i].first_block;
-      write(1, BLOCK(next_block), sb->block_size);
+// rm -r dir - remove o subdirectrio dir com todo o seu contedo
+int vfs_rm_tree(char *nome_dir) {
+  int res = fs_remove_tree(fs, nome_dir);
 
-      while (fat[next_block] != -1)
-      {
-        if (DEBUG)
-          printf("\nNext Block\n");
-        next_block = fat[next_block];
-
-	int write_size = sb->block_size;
-	if (fat[next_block] == -1)
-	  write_size = dir[block_i].size % sb->block_size;
-	
-        write(1, BLOCK(next_block), write_size);
-      }
+  if (res == ERR_INPUT)
+    fprintf(out, "ERROR(rm: cannot remove the current directory or one that contains it)\n");
 
-      return;
-    }
-  }
+  return report("rm", res, "file");
+}
 
-  printf("ERROR(cat: file not found)\n");
 
-  return;
+// frag - escreve as medidas de fragmentao do espao livre e das cadeias de blocos
+int vfs_frag(void) {
+  frag_stats stats;
+
+  fs_frag(fs, &stats);
+  fprintf(out, "free blocks: %d in %d extents (largest %d), %d never used\n", stats.free_blocks, stats.free_extents, stats.largest_extent, stats.never_used);
+  fprintf(out, "chain links: %d, non-contiguous %d (%.1f%% fragmented)\n", stats.links, stats.jumps, stats.links ? 100.0 * stats.jumps / stats.links : 0.0);
+
+  return 0;
 }
 
 
-// cp fich1 fich2 - copia o ficheiro fich1 para fich2
-// cp fich dir - copia o ficheiro fich para o subdirectrio dir
-void vfs_cp(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i, inp_block = -1, exp_dir = current_dir;
+// defrag [LIMITE ...] - torna contguas as cadeias dos ficheiros e directrios, at ao limite de tempo
+// (NNNms ou NNNs) ou de blocos deslocados (NNN), e escreve a contiguidade das cadeias antes e depois
+int vfs_defrag(COMMAND com) {
+  long long max_usec = -1;
+  int max_blocks = -1, i, res;
+  frag_stats before, after;
+  defrag_stats stats;
 
-  int block_i;
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
+  for (i = 1; i < com.argc; i++)
   {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
+    char *end;
+    long long value = strtoll(com.argv[i], &end, 10);
 
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (strcmp(dir[block_i].name, nome_orig) == 0)
-    {
-      inp_block = dir[block_i].first_block;
+    if (end == com.argv[i] || value < 0)
+      break;
+    if (!strcmp(end, "ms"))
+      max_usec = value * 1000;
+    else if (!strcmp(end, "s"))
+      max_usec = value * 1000000;
+    else if (*end == '\0' && value <= INT_MAX)
+      max_blocks = value;
+    else
       break;
-    }
   }
-
-  if (inp_block == -1)
+  if (i < com.argc)
   {
-    printf("ERROR(cp: input file not found)\n");
-    return;
+    fprintf(out, "ERROR(defrag: invalid limit)\n");
+    return ERR_INPUT;
   }
 
-  int req_size = dir[block_i].size;
+  fs_frag(fs, &before);
+  res = fs_defrag(fs, max_usec, max_blocks, &stats);
+  fs_frag(fs, &after);
 
-  dir = (dir_entry *) BLOCK(current_dir);
-  cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
-  {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
+  fprintf(out, "contiguous links before: %d of %d (%.1f%%)\n", before.links - before.jumps, before.links, before.links ? 100.0 * (before.links - before.jumps) / before.links : 100.0);
+  fprintf(out, "moved %d blocks in %d of %d chains%s\n", stats.blocks, stats.moved, stats.chains, stats.complete ? "" : " (stopped at the limit, run defrag again to continue)");
+  fprintf(out, "contiguous links after: %d of %d (%.1f%%)\n", after.links - after.jumps, after.links, after.links ? 100.0 * (after.links - after.jumps) / after.links : 100.0);
 
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (strcmp(dir[block_i].name, nome_dest) == 0)
-    {
-      if (dir[block_i].type == TYPE_DIR)
-      {
-        exp_dir = dir[block_i].first_block;
-        strcpy(nome_dest, nome_orig);
-      }
-      else
-        vfs_rm(nome_dest);
+  return report("defrag", res, "file");
+}
 
-      break;
-    }
-  }
 
-  dir_entry *cur_dir = (dir_entry *) BLOCK(exp_dir);
-  n_entries = cur_dir[0].size;
-  int req_blocks = (n_entries % DIR_ENTRIES_PER_BLOCK == 0) + (req_size + sb->block_size - 1) / sb->block_size;
+// vmstat - escreve as faltas de pgina e as falhas na TLB desde o ltimo vmstat (ou desde a montagem)
+int vfs_vmstat(void) {
+  static vm_stats last;
+  vm_stats stats;
 
-  if (sb->n_free_blocks < req_blocks)
+  fs_vm_stats(fs, &stats);
+  fprintf(out, "page faults: %lld minor, %lld major\n", stats.minor_faults - last.minor_faults, stats.major_faults - last.major_faults);
+  if (stats.tlb_misses == -1)
+    fprintf(out, "dTLB misses: not available\n");
+  else
+    fprintf(out, "dTLB misses: %lld\n", stats.tlb_misses - last.tlb_misses);
+  last = stats;
+
+  return 0;
+}
+
+
+// sync - escreve no disco todas as alteraes feitas  imagem
+int vfs_sync(void) {
+  if (fs_sync(fs) != 0)
   {
-    printf("ERROR(cp: memory full)\n");
-    return;
+    fprintf(out, "ERROR(sync: cannot write filesystem)\n");
+    return ERR_IO;
   }
 
-  req_blocks -= (n_entries % DIR_ENTRIES_PER_BLOCK == 0);
+  return 0;
+}
 
-  cur_dir[0].size++;
 
-  int first_block = get_free_block();
-  int new_block, next_block = first_block;
-  int count_block = 1, cur = inp_block;
+// stats - escreve as latncias dos comandos j executados e os contadores das operaes internas
+// da biblioteca, desde a montagem
+int vfs_stats(void) {
+#ifdef VFS_STATS
+  int i;
+  op_stats stats;
 
-  strcpy(BLOCK(next_block), BLOCK(cur));
-  while (fat[cur] != -1)
+  fprintf(out, "%-8s %10s %12s %10s %10s %10s %10s\n", "command", "count", "total_ms", "p50_us", "p90_us", "p99_us", "max_us");
+  for (i = 0; i < (int) (sizeof(histograms) / sizeof(histograms[0])); i++)
   {
-    if (count_block != req_blocks)
-    {
-      count_block++;
-      new_block = get_free_block();
-      fat[next_block] = new_block;
-    }
+    latency_hist *h = &histograms[i];
+    if (h->count == 0)
+      continue;
+    fprintf(out, "%-8s %10lld %12.3f %10.1f %10.1f %10.1f %10.1f\n", h->cmd, h->count, h->total_ns / 1e6,
+            hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3, hist_percentile(h, 0.99) / 1e3, h->max_ns / 1e3);
+  }
 
-    cur = fat[cur];
-    strcpy(BLOCK(next_block), BLOCK(cur));
+  fs_op_stats(fs, &stats);
+  fprintf(out, "fat hops: %lld, blocks allocated: %lld, freed: %lld\n", stats.fat_hops, stats.blocks_allocated, stats.blocks_freed);
+  fprintf(out, "directory lookups: %lld, name comparisons: %lld (%.1f per lookup)\n", stats.dir_lookups, stats.name_compares,
+          stats.dir_lookups ? (double) stats.name_compares / stats.dir_lookups : 0.0);
+  fprintf(out, "free blocks: %d in the bitmap, %d in the superblock\n", stats.free_blocks, stats.sb_free_blocks);
 
-    next_block = new_block;
-  }
+  return 0;
+#else
+  fprintf(out, "ERROR(stats: compiled without VFS_STATS)\n");
+  return ERR_INPUT;
+#endif
+}
 
-  cur_block = exp_dir;
-  while (fat[cur_block] != -1)
-    cur_block = fat[cur_block];
 
-  if (n_entries % DIR_ENTRIES_PER_BLOCK == 0)
-  {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
-  }
+// ----------------------------------------------------------------------------------------------
+// estatsticas: as latncias dos comandos ficam em histogramas como os HDR (de erro relativo
+// fixo), e os contadores das operaes internas vm da biblioteca (fs_op_stats); sem VFS_STATS
+// exec_com s mede os comandos para um trace (--record)
 
-  dir = (dir_entry *) BLOCK(cur_block);
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_FILE, nome_dest, req_size, first_block);
+long long now_nsec(void) {
+  struct timespec ts;
 
-  
-  return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
+// posio do histograma onde fica a latncia ns
+int hist_bucket(long long ns) {
+  if (ns < (1 << HIST_SUB_BITS))
+    return ns < 0 ? 0 : ns;
 
-// mv fich1 fich2 - move o ficheiro fich1 para fich2
-// mv fich dir - move o ficheiro fich para o subdirectrio dir
-void vfs_mv(char *nome_orig, char *nome_dest) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i, inp_block = -1, exp_dir = current_dir, req_size = -1;
+  int exp = 63 - __builtin_clzll(ns);
+  return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((ns >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
 
-  int block_i;
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
-  {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
+// menor latncia da posio bucket do histograma
+long long bucket_value(int bucket) {
+  if (bucket < (1 << HIST_SUB_BITS))
+    return bucket;
 
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (strcmp(dir[block_i].name, nome_orig) == 0)
-    {
-      int last_block = cur_block;
-      while (fat[last_block] != -1)
-        last_block = fat[last_block];
-      dir_entry *last_dir_block = (dir_entry *) BLOCK(last_block);
-      dir_entry last_dir = last_dir_block[(n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK];
-
-      if ((n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK == 0)
-        delete_block(last_block);
-
-      req_size = dir[block_i].size;
-
-      dir[block_i].type = last_dir.type;
-      strcpy(dir[block_i].name, last_dir.name);
-      dir[block_i].day = last_dir.day;
-      dir[block_i].month = last_dir.month;
-      dir[block_i].year = last_dir.year;
-      dir[block_i].size = last_dir.size;
-      dir[block_i].first_block = last_dir.first_block;
-
-      dir = (dir_entry *) BLOCK(current_dir);
-      dir[0].size--;
-      
-      inp_block = dir[block_i].first_block;
+  int exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  return (long long) ((1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1))) << (exp - HIST_SUB_BITS);
+}
+
+// latncia abaixo da qual ficam as execues da fraco p do histograma h (o limite superior
+// do intervalo onde est o percentil, sem passar da maior latncia)
+long long hist_percentile(latency_hist *h, double p) {
+  long long target = (long long) (p * h->count + 0.5), seen = 0;
+  int i;
+
+  if (target < 1)
+    target = 1;
+  for (i = 0; i < HIST_BUCKETS - 1; i++)
+    if ((seen += h->buckets[i]) >= target)
       break;
-    }
+
+  long long value = bucket_value(i + 1) - 1;
+  return value < h->max_ns ? value : h->max_ns;
+}
+
+// posio do comando cmd em histograms (-1 se for desconhecido)
+int hist_index(char *cmd) {
+  int i;
+
+  for (i = 0; i < (int) (sizeof(histograms) / sizeof(histograms[0])); i++)
+    if (!strcmp(histograms[i].cmd, cmd))
+      return i;
+  return -1;
+}
+
+// acrescenta a latncia ns ao histograma h
+void hist_add(latency_hist *h, long long ns) {
+  h->count++;
+  h->total_ns += ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+  h->buckets[hist_bucket(ns)]++;
+  return;
+}
+
+// acrescenta a latncia ns ao histograma do comando cmd (os comandos desconhecidos so ignorados)
+void record_latency(char *cmd, long long ns) {
+  int i = hist_index(cmd);
+
+  if (i != -1)
+    hist_add(&histograms[i], ns);
+  return;
+}
+
+// escreve em f as estatsticas de stats num objecto JSON (latncias em us)
+void write_stats_json(FILE *f) {
+  int i, first = 1;
+  op_stats stats;
+
+  fprintf(f, "{\n  \"commands\": {");
+  for (i = 0; i < (int) (sizeof(histograms) / sizeof(histograms[0])); i++)
+  {
+    latency_hist *h = &histograms[i];
+    if (h->count == 0)
+      continue;
+    fprintf(f, "%s\n    \"%s\": {\"count\": %lld, \"total_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+            "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}", first ? "" : ",", h->cmd, h->count,
+            h->total_ns / 1e3, hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+            hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max_ns / 1e3);
+    first = 0;
   }
 
-  if (inp_block == -1)
+  fs_op_stats(fs, &stats);
+  fprintf(f, "%s},\n  \"counters\": {\"fat_hops\": %lld, \"blocks_allocated\": %lld, \"blocks_freed\": %lld, "
+          "\"dir_lookups\": %lld, \"name_compares\": %lld, \"free_blocks\": %d, \"sb_free_blocks\": %d}\n}\n",
+          first ? "" : "\n  ", stats.fat_hops, stats.blocks_allocated, stats.blocks_freed, stats.dir_lookups,
+          stats.name_compares, stats.free_blocks, stats.sb_free_blocks);
+  return;
+}
+
+
+// ----------------------------------------------------------------------------------------------
+// modo servidor (-d SOCKET): a imagem  montada uma vez e os comandos chegam de vrios clientes
+// por um socket UNIX, um por linha; cada resposta comea com a linha "<cdigo> <tamanho>" seguida
+// de <tamanho> bytes com a sada do comando (o contedo do ficheiro, no caso de cat). Um cliente
+// pode enviar vrios pedidos sem esperar pelas respostas, que chegam pela mesma ordem.
+
+// directrio corrente  por cliente (um contexto fs_clone por ligao)
+typedef struct connection {
+  int sock;
+  int id;                 // nmero da ligao (a partir de 1), que identifica os seus comandos no trace
+  vfs_t *fs;              // contexto do cliente
+  char *in;               // pedidos recebidos (in_pos  o incio do primeiro ainda no executado)
+  int in_pos, in_len, in_size;
+  char *out;              // respostas por enviar (out_pos  o incio do que falta enviar)
+  int out_pos, out_len, out_size;
+  vfs_file *stream;       // ficheiro de um cat, enviado com fs_sendfile depois das respostas em out
+  long long stream_left;  // bytes do ficheiro que ainda falta enviar
+  int eof;                // o cliente j no envia mais pedidos
+  int closing;            // fecha a ligao depois de enviar as respostas (exit)
+  unsigned int events;    // eventos pedidos ao epoll
+} connection;
+
+int server_epoll;                // descritor do epoll
+int n_connections;               // ligaes aceites
+volatile sig_atomic_t stop_server;  // posto a 1 por SIGINT ou SIGTERM
+
+void server_signal(int sig) {
+  stop_server = 1;
+}
+
+// acrescenta len bytes de data s respostas por enviar da ligao c
+void conn_append(connection *c, char *data, int len) {
+  if (c->out_pos == c->out_len)
+    c->out_pos = c->out_len = 0;
+  if (c->out_len + len > c->out_size)
   {
-    printf("ERROR(mv: input file not found)\n");
-    return;
+    while (c->out_len + len > c->out_size)
+      c->out_size *= 2;
+    c->out = (char *) realloc(c->out, c->out_size);
   }
+  memcpy(c->out + c->out_len, data, len);
+  c->out_len += len;
+
+  return;
+}
+
+// cat em modo servidor: em vez de copiar o ficheiro para out, deixa-o aberto em c->stream
+int server_cat(connection *c, COMMAND com) {
+  long long offset = 0, len = -1, size;
+  int error;
 
-  dir = (dir_entry *) BLOCK(current_dir);
-  cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
+  if (com.argc == 4 && cat_range_args(com.argv[2], com.argv[3], &offset, &len) != 0)
+    return ERR_INPUT;
+  if ((c->stream = fs_open(fs, com.argv[1], VFS_READ, &error)) == NULL)
+    return report("cat", ERR_NOT_FOUND, "file");
+
+  size = fs_lseek(c->stream, 0, SEEK_END);
+  c->stream_left = offset >= size ? 0 : size - offset;
+  if (len >= 0 && len < c->stream_left)
+    c->stream_left = len;
+  fs_lseek(c->stream, offset, SEEK_SET);
+
+  return 0;
+}
+
+// executa o pedido linha da ligao c, acrescentando a resposta s que esto por enviar
+void server_request(connection *c, char *linha) {
+  char header[64], *text = NULL;
+  size_t text_len = 0;
+  COMMAND com;
+  int res = 0;
+
+  linha[strcspn(linha, "\r\n")] = '\0';
+  com = parse(linha);
+
+  // a sada dos comandos  escrita na resposta e no em stdout
+  fs = c->fs;
+  out = open_memstream(&text, &text_len);
+  if (com.cmd == NULL || com.cmd[0] == '#')
+    res = 0;
+  else if (!strcmp(com.cmd, "exit"))
+    c->closing = 1;
+  else if (!strcmp(com.cmd, "cat") && (com.argc == 2 || com.argc == 4))
+    res = server_cat(c, com);
+  else
   {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
-    {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
-    }
+    trace_conn = c->id;
+    res = exec_com(com);
+    trace_conn = 0;
+  }
+  // em modo command a resposta s  enviada depois de confirmado o comando
+  if (sync_mode == VFS_SYNC_COMMAND)
+    fs_commit(fs);
+  fclose(out);
+  out = stdout;
 
-    block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (strcmp(dir[block_i].name, nome_dest) == 0)
+  if (c->stream != NULL)
+  {
+    if (c->stream_left == 0)
     {
-      if (dir[block_i].type == TYPE_DIR)
-      {
-        exp_dir = dir[block_i].first_block;
-        strcpy(nome_dest, nome_orig);
-      }
-      else
-        vfs_rm(nome_dest);
-
-      break;
+      fs_close(c->stream);
+      c->stream = NULL;
     }
+    conn_append(c, header, sprintf(header, "0 %lld\n", c->stream_left));
+  }
+  else
+  {
+    conn_append(c, header, sprintf(header, "%d %zu\n", res, text_len));
+    conn_append(c, text, text_len);
   }
+  free(text);
 
-  dir_entry *cur_dir = (dir_entry *) BLOCK(exp_dir);
-  n_entries = cur_dir[0].size;
-  cur_dir[0].size++;
+  return;
+}
 
-  cur_block = exp_dir;
-  while (fat[cur_block] != -1)
-    cur_block = fat[cur_block];
+// muda os eventos que o epoll vigia na ligao c
+void conn_watch(connection *c, unsigned int events) {
+  struct epoll_event ev;
 
-  if (n_entries % DIR_ENTRIES_PER_BLOCK == 0)
-  {
-    int next_block = get_free_block();
-    fat[cur_block] = next_block;
-    cur_block = next_block;
-  }
+  if (c->events == events)
+    return;
+  ev.events = events;
+  ev.data.ptr = c;
+  epoll_ctl(server_epoll, EPOLL_CTL_MOD, c->sock, &ev);
+  c->events = events;
 
-  dir = (dir_entry *) BLOCK(cur_block);
-  init_dir_entry(&dir[n_entries % DIR_ENTRIES_PER_BLOCK], TYPE_FILE, nome_dest, req_size, inp_block);
-    
   return;
 }
 
+void conn_close(connection *c) {
+  epoll_ctl(server_epoll, EPOLL_CTL_DEL, c->sock, NULL);
+  close(c->sock);
+  if (c->stream != NULL)
+    fs_close(c->stream);
+  fs_unmount(c->fs);
+  free(c->in);
+  free(c->out);
+  free(c);
+  return;
+}
 
-// rm fich - remove o ficheiro fich
-void vfs_rm(char *nome_fich) {
-  dir_entry *dir = (dir_entry *) BLOCK(current_dir);
-  int n_entries = dir[0].size, i;
+// l os pedidos disponveis, executa os que esto completos e envia as respostas at o socket
+// deixar de aceitar dados; devolve -1 se a ligao deve ser fechada
+int conn_serve(connection *c) {
+  char *end;
+  ssize_t n;
 
-  int cur_block = current_dir;
-  for (i = 0; i < n_entries; i++)
+  if (c->events & EPOLLIN)
+    while (!c->eof)
+    {
+      if (c->in_pos > 0 && c->in_pos == c->in_len)
+        c->in_pos = c->in_len = 0;
+      if (c->in_len == c->in_size)
+      {
+        // os pedidos por executar passam para o incio do buffer antes de o aumentar
+        memmove(c->in, c->in + c->in_pos, c->in_len - c->in_pos);
+        c->in_len -= c->in_pos;
+        c->in_pos = 0;
+        if (c->in_len == c->in_size)
+        {
+          c->in_size *= 2;
+          c->in = (char *) realloc(c->in, c->in_size);
+        }
+      }
+
+      if ((n = read(c->sock, c->in + c->in_len, c->in_size - c->in_len)) > 0)
+        c->in_len += n;
+      else if (n == 0)
+      {
+        // o ltimo pedido pode no terminar com uma mudana de linha
+        c->eof = 1;
+        if (c->in_len > c->in_pos && c->in[c->in_len - 1] != '\n')
+        {
+          if (c->in_len == c->in_size)
+            c->in = (char *) realloc(c->in, ++c->in_size);
+          c->in[c->in_len++] = '\n';
+        }
+      }
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      else if (errno != EINTR)
+        return -1;
+    }
+
+  while (1)
   {
-    if (i % DIR_ENTRIES_PER_BLOCK == 0 && i)
+    // os pedidos so executados enquanto as respostas por enviar no forem demasiadas
+    while (c->stream == NULL && !c->closing && c->out_len - c->out_pos < BATCH_BUFFER_SIZE
+           && (end = memchr(c->in + c->in_pos, '\n', c->in_len - c->in_pos)) != NULL)
     {
-      if (DEBUG)
-        printf("Changed Block\n");
-      cur_block = fat[cur_block];
-      dir = (dir_entry *) BLOCK(cur_block);
+      *end = '\0';
+      server_request(c, c->in + c->in_pos);
+      c->in_pos = end + 1 - c->in;
     }
 
-    int block_i = i % DIR_ENTRIES_PER_BLOCK;
-        
-    if (dir[block_i].type == TYPE_FILE && strcmp(dir[block_i].name, nome_fich) == 0)
+    if (c->out_pos < c->out_len)
     {
-      int next_block = dir[block_i].first_block, count = 1;
+      if ((n = send(c->sock, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL)) == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      c->out_pos += n;
+      continue;
+    }
 
-      while (fat[next_block] != -1)
+    if (c->stream != NULL)
+    {
+      // o ficheiro vai da imagem para o socket sem passar por nenhum buffer do servidor
+      if ((n = fs_sendfile(c->stream, c->sock, c->stream_left)) == -ERR_AGAIN)
+        break;
+      // se o ficheiro encolheu entretanto, j no  possvel enviar o tamanho anunciado
+      if (n <= 0)
+        return -1;
+      if ((c->stream_left -= n) == 0)
       {
-        next_block = fat[next_block];
-        count++;
+        fs_close(c->stream);
+        c->stream = NULL;
       }
+      continue;
+    }
 
-      sb->n_free_blocks += count;
-      fat[next_block] = sb->free_block;
-      sb->free_block = dir[block_i].first_block;
+    if (c->closing || (c->eof && c->in_pos == c->in_len))
+      return -1;
+    if (memchr(c->in + c->in_pos, '\n', c->in_len - c->in_pos) == NULL)
+      break;
+  }
 
-      int last_block = cur_block;
-      while (fat[last_block] != -1)
-        last_block = fat[last_block];
-      dir_entry *last_dir_block = (dir_entry *) BLOCK(last_block);
-      dir_entry last_dir = last_dir_block[(n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK];
+  // com respostas por enviar espera-se que o socket as aceite, sem ler mais pedidos
+  conn_watch(c, c->out_pos < c->out_len || c->stream != NULL ? EPOLLOUT : EPOLLIN);
+  return 0;
+}
+
+// aceita as ligaes pendentes no socket listener, cada uma com um contexto prprio (um clone de root_fs)
+void server_accept(int listener, vfs_t *root_fs) {
+  struct epoll_event ev;
+  int sock;
+
+  while ((sock = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+  {
+    connection *c = (connection *) calloc(1, sizeof(connection));
+    c->sock = sock;
+    c->id = ++n_connections;
+    c->fs = fs_clone(root_fs);
+    c->in_size = c->out_size = BATCH_BUFFER_SIZE;
+    c->in = (char *) malloc(c->in_size);
+    c->out = (char *) malloc(c->out_size);
+    c->events = EPOLLIN;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(server_epoll, EPOLL_CTL_ADD, sock, &ev);
+  }
+
+  return;
+}
+
+// serve os comandos recebidos no socket socket_name at receber SIGINT ou SIGTERM
+int run_server(char *socket_name) {
+  struct sockaddr_un addr;
+  struct epoll_event ev, events[MAX_EVENTS];
+  struct sigaction sa;
+  struct stat st;
+  vfs_t *root_fs = fs;
+  int listener, n, i;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_name) >= sizeof(addr.sun_path))
+  {
+    printf("vfs: socket name too long (%s)\n", socket_name);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_name);
 
-      if ((n_entries - 1 + DIR_ENTRIES_PER_BLOCK) % DIR_ENTRIES_PER_BLOCK == 0)
-        delete_block(last_block);
+  // s um socket (de uma execuo anterior)  substitudo; outro ficheiro com o mesmo nome no  apagado
+  if (lstat(socket_name, &st) == 0 && (!S_ISSOCK(st.st_mode) || unlink(socket_name) == -1))
+  {
+    printf("vfs: cannot listen on socket (%s)\n", socket_name);
+    return 1;
+  }
+  if ((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+      || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listener, SOMAXCONN) == -1)
+  {
+    printf("vfs: cannot listen on socket (%s)\n", socket_name);
+    return 1;
+  }
 
-      dir[block_i].type = last_dir.type;
-      strcpy(dir[block_i].name, last_dir.name);
-      dir[block_i].day = last_dir.day;
-      dir[block_i].month = last_dir.month;
-      dir[block_i].year = last_dir.year;
-      dir[block_i].size = last_dir.size;
-      dir[block_i].first_block = last_dir.first_block;
+  // sem SA_RESTART, para que epoll_wait seja interrompido
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = server_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
 
-      dir = (dir_entry *) BLOCK(current_dir);
-      dir[0].size--;
+  server_epoll = epoll_create1(EPOLL_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(server_epoll, EPOLL_CTL_ADD, listener, &ev);
 
-      return;
+  while (!stop_server)
+  {
+    // o grupo de operaes aberto  confirmado quando passa a janela, mesmo sem novos pedidos
+    long long pending = fs_commit_pending(root_fs);
+    if ((n = epoll_wait(server_epoll, events, MAX_EVENTS, pending < 0 ? -1 : (int) ((pending + 999) / 1000))) == -1)
+      continue;
+    if (n == 0)
+      fs_commit(root_fs);
+
+    for (i = 0; i < n; i++)
+    {
+      connection *c = (connection *) events[i].data.ptr;
+      if (c == NULL)
+        server_accept(listener, root_fs);
+      else if (conn_serve(c) == -1)
+        conn_close(c);
     }
   }
 
-  printf("ERROR(rm: file not found)\n");
-  
-  return;
+  // as ligaes ainda abertas so simplesmente abandonadas
+  close(listener);
+  unlink(socket_name);
+  fs = root_fs;
+  unmount_filesystem();
+  return 0;
 }
@@ -0,0 +1,283 @@
+/////////////////////////////////////////////////////////////////
+//                                                             //
+//   vfsc: cliente do modo servidor do vfs (vfs -d SOCKET)     //
+//                                                             //
+// Envia os comandos (um por linha, da entrada padro ou de    //
+// -c, separados por ';') sem esperar pelas respostas e        //
+// escreve a sada de cada um pela mesma ordem. Os ficheiros   //
+// UNIX de get e put so relativos ao directrio do cliente.   //
+//                                                             //
+// compilao: gcc vfsc.c -Wall -o vfsc                        //
+// utilizao: vfsc [-c COMMANDS] SOCKET                       //
+//                                                             //
+/////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAXARGS 100
+#define PATH_SIZE 4096
+#define BUFFER_SIZE (1 << 16)
+
+// variveis globais
+char cwd[PATH_SIZE];   // directrio do cliente (para os ficheiros UNIX de get e put)
+char *send_buf;        // pedidos por enviar
+int send_pos, send_len, send_size;
+int pending;           // pedidos enviados (ou por enviar) sem resposta
+int status;            // cdigo do primeiro comando que falhou
+int exiting;           // 1 depois de exit (os comandos seguintes so ignorados)
+
+// funes auxiliares
+int connect_server(char*);
+void queue_line(char*);
+void queue(char*, int);
+int read_responses(int, char*, int*, long long*, int*);
+
+
+int main(int argc, char *argv[]) {
+  char *commands = NULL, *socket_name, in_buf[BUFFER_SIZE], *linha;
+  char header[64];
+  int sock, in_eof, header_len = 0;
+  long long payload = -1;   // bytes da resposta corrente que faltam escrever (-1 se a ler o cabealho)
+  size_t in_len = 0;
+
+  if (argc == 4 && strcmp(argv[1], "-c") == 0)
+    commands = argv[2];
+  else if (argc != 2)
+  {
+    printf("Usage: vfsc [-c COMMANDS] SOCKET\n");
+    exit(1);
+  }
+  socket_name = argv[argc - 1];
+
+  if ((sock = connect_server(socket_name)) == -1)
+  {
+    printf("vfsc: cannot connect to server (%s)\n", socket_name);
+    exit(1);
+  }
+  if (getcwd(cwd, PATH_SIZE) == NULL)
+    cwd[0] = '\0';
+
+  send_size = BUFFER_SIZE;
+  send_buf = (char *) malloc(send_size);
+
+  // com -c todos os pedidos ficam logo prontos a enviar
+  in_eof = commands != NULL;
+  while (commands != NULL && (linha = strsep(&commands, ";\n")) != NULL)
+    queue_line(linha);
+
+  while (1)
+  {
+    struct pollfd fds[2];
+    int n_fds = 1;
+
+    fds[0].fd = sock;
+    fds[0].events = POLLIN | (send_pos < send_len ? POLLOUT : 0);
+    // s se lem mais comandos quando os anteriores j foram quase todos enviados
+    if (!in_eof && send_len - send_pos < BUFFER_SIZE)
+    {
+      fds[1].fd = 0;
+      fds[1].events = POLLIN;
+      n_fds = 2;
+    }
+    if (poll(fds, n_fds, -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (n_fds == 2 && fds[1].revents)
+    {
+      ssize_t n = read(0, in_buf + in_len, BUFFER_SIZE - 1 - in_len);
+      if (n <= 0)
+      {
+        in_eof = 1;
+        if (in_len > 0)
+        {
+          in_buf[in_len] = '\0';
+          queue_line(in_buf);
+          in_len = 0;
+        }
+      }
+      else
+      {
+        char *start = in_buf, *end;
+        in_len += n;
+        while ((end = memchr(start, '\n', in_buf + in_len - start)) != NULL)
+        {
+          *end = '\0';
+          queue_line(start);
+          start = end + 1;
+        }
+        in_len -= start - in_buf;
+        memmove(in_buf, start, in_len);
+        // uma linha maior que o buffer  enviada por partes
+        if (in_len == BUFFER_SIZE - 1)
+        {
+          queue(in_buf, in_len);
+          in_len = 0;
+        }
+      }
+    }
+
+    if (fds[0].revents & POLLOUT)
+    {
+      ssize_t n = send(sock, send_buf + send_pos, send_len - send_pos, MSG_NOSIGNAL);
+      if (n == -1 && errno != EAGAIN && errno != EINTR)
+        break;
+      if (n > 0 && (send_pos += n) == send_len)
+        send_pos = send_len = 0;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      if (read_responses(sock, header, &header_len, &payload, &status) <= 0)
+        break;
+
+    if (exiting && !in_eof)
+      in_eof = 1;
+
+    // depois do ltimo pedido o servidor fecha a ligao quando tiver respondido a todos
+    if (in_eof && send_pos == send_len)
+    {
+      if (pending == 0)
+        break;
+      if (in_eof == 1)
+        shutdown(sock, SHUT_WR);
+      in_eof = 2;
+    }
+  }
+
+  close(sock);
+  return pending != 0 && status == 0 ? 1 : status;
+}
+
+
+int connect_server(char *socket_name) {
+  struct sockaddr_un addr;
+  int sock;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_name) >= sizeof(addr.sun_path) || (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return -1;
+  strcpy(addr.sun_path, socket_name);
+
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+  {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+
+// acrescenta len bytes de data aos pedidos por enviar
+void queue(char *data, int len) {
+  if (send_pos > 0 && send_pos == send_len)
+    send_pos = send_len = 0;
+  while (send_len + len > send_size)
+  {
+    send_size *= 2;
+    send_buf = (char *) realloc(send_buf, send_size);
+  }
+  memcpy(send_buf + send_len, data, len);
+  send_len += len;
+
+  return;
+}
+
+
+// junta um comando aos pedidos por enviar, tornando absolutos os ficheiros UNIX de get e put
+void queue_line(char *linha) {
+  char *argv[MAXARGS + 1];
+  int argc = 0, i;
+
+  if (exiting)
+    return;
+  linha[strcspn(linha, "\r")] = '\0';
+  while (argc < MAXARGS && (argv[argc] = strtok(argc == 0 ? linha : NULL, " \t")) != NULL)
+    argc++;
+
+  for (i = 0; i < argc; i++)
+  {
+    int unix_file = argc == 3 && ((i == 1 && !strcmp(argv[0], "get")) || (i == 2 && !strcmp(argv[0], "put")));
+
+    if (i > 0)
+      queue(" ", 1);
+    if (unix_file && argv[i][0] != '/' && cwd[0] != '\0')
+    {
+      queue(cwd, strlen(cwd));
+      queue("/", 1);
+    }
+    queue(argv[i], strlen(argv[i]));
+  }
+  queue("\n", 1);
+  pending++;
+  // o servidor responde a exit e fecha a ligao
+  if (argc > 0 && !strcmp(argv[0], "exit"))
+    exiting = 1;
+
+  return;
+}
+
+
+// l o que estiver disponvel das respostas: o cabealho "<cdigo> <tamanho>" de cada uma (guardado em
+// header at estar completo) e depois os bytes da sada, que so escritos em stdout;
+// devolve 0 se o servidor fechou a ligao
+int read_responses(int sock, char *header, int *header_len, long long *payload, int *status) {
+  char buf[BUFFER_SIZE];
+  ssize_t n = recv(sock, buf, BUFFER_SIZE, 0), pos = 0;
+
+  if (n == -1)
+    return errno == EAGAIN || errno == EINTR ? 1 : -1;
+  if (n == 0)
+    return 0;
+
+  while (pos < n)
+  {
+    if (*payload == -1)
+    {
+      // cabealho
+      char *end = memchr(buf + pos, '\n', n - pos);
+      int len = (end != NULL ? end - buf + 1 : n) - pos;
+      if (*header_len + len >= 64)
+        return -1;
+      memcpy(header + *header_len, buf + pos, len);
+      *header_len += len;
+      pos += len;
+      if (end == NULL)
+        break;
+
+      int res;
+      header[*header_len] = '\0';
+      if (sscanf(header, "%d %lld", &res, payload) != 2)
+        return -1;
+      if (res != 0 && *status == 0)
+        *status = res;
+      *header_len = 0;
+    }
+
+    long long chunk = n - pos < *payload ? n - pos : *payload;
+    if (chunk > 0 && fwrite(buf + pos, 1, chunk, stdout) != (size_t) chunk)
+      return -1;
+    pos += chunk;
+    if ((*payload -= chunk) == 0)
+    {
+      *payload = -1;
+      pending--;
+    }
+  }
+  fflush(stdout);
+
+  return 1;
+}